@@ -2,7 +2,8 @@ import subprocess
 import os
 
 availableExtensions = [".vert", ".frag", ".comp"]
-execLocation = r"D:\Users\Bjorn\Documents\Libraries\Vulkan\1.2.162.1\Bin32\glslc.exe"
+#glslc of the Vulkan SDK, the project compiles the shaders the engine loads the same way on every build
+execLocation = os.path.join(os.environ["VULKAN_SDK"], "Bin", "glslc") if "VULKAN_SDK" in os.environ else "glslc"
 
 #get all the files with the correct extensions
 for file in os.listdir(os.getcwd()):
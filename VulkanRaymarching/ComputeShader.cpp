@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "ComputeShader.h"
 #include "VkEngine.h"
+#include <algorithm>
 
 ComputeShader::ComputeShader(const VkDevice& device, const std::string& computeShaderFile)
 	: Shader(device, computeShaderFile)
@@ -12,25 +13,61 @@ void ComputeShader::SetSkyboxTexture(VkImageView* skyboxTexture)
 	m_SkyboxTexture = skyboxTexture; 
 }
 
+void ComputeShader::SetSkyboxCubemap(VkImageView* skyboxCubemap)
+{
+	m_SkyboxCubemap = skyboxCubemap;
+}
+
 void ComputeShader::SetSwapchainImage(VkImageView* swapchainImage)
 {
 	m_SwapchainImage = swapchainImage; 
 }
 
+void ComputeShader::SetHistoryImages(VkImageView* historyImages)
+{
+	m_HistoryImages = historyImages;
+}
+
+void ComputeShader::SetOutputCacheImage(VkImageView* outputCache)
+{
+	m_OutputCache = outputCache;
+}
+
+void ComputeShader::SetMeshVolume(VkImageView* brickAtlas, VkImageView* brickCells, VkImageView* cellMips, VkBuffer* brickRanges)
+{
+	m_MeshBrickAtlas = brickAtlas;
+	m_MeshBrickCells = brickCells;
+	m_MeshCellMips = cellMips;
+	m_MeshBrickRanges = brickRanges;
+}
+
+void ComputeShader::SetSceneInstances(VkBuffer* instances, VkBuffer* instanceGrid, VkBuffer* instanceBvh, VkBuffer* instanceBvhIndices)
+{
+	m_SceneInstances = instances;
+	m_InstanceGrid = instanceGrid;
+	m_InstanceBvh = instanceBvh;
+	m_InstanceBvhIndices = instanceBvhIndices;
+}
+
+void ComputeShader::SetRayQueueCapacity(uint32_t rayCount)
+{
+	m_RayQueueCapacity = rayCount;
+}
+
 void ComputeShader::InitDescriptors(int overlappingFrames, VkEngine* engine)
 {
 	//Create descriptor pool
 	std::vector<VkDescriptorPoolSize> sizes =
 	{
-		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10},
-		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 10},
-		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10}
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 32 * (uint32_t)overlappingFrames},
+		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 8 * (uint32_t)overlappingFrames},
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 8 * (uint32_t)overlappingFrames}
 	};
 
 	VkDescriptorPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	poolInfo.flags = 0;
-	poolInfo.maxSets = 10;
+	poolInfo.maxSets = (uint32_t)overlappingFrames;
 	poolInfo.poolSizeCount = (uint32_t)sizes.size();
 	poolInfo.pPoolSizes = sizes.data();
 
@@ -45,12 +82,42 @@ void ComputeShader::InitDescriptors(int overlappingFrames, VkEngine* engine)
 	VkDescriptorSetLayoutBinding dimensionsBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
 	VkDescriptorSetLayoutBinding sceneDataBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
 	VkDescriptorSetLayoutBinding lightDataBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
-	VkDescriptorSetLayoutBinding layoutBindings[] = { outputImageBinding, skyboxImageBinding, dimensionsBinding, sceneDataBinding, lightDataBinding };
+	VkDescriptorSetLayoutBinding materialDataBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5);
+	VkDescriptorSetLayoutBinding hitQueueBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);
+	VkDescriptorSetLayoutBinding shadowQueueBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 7);
+	VkDescriptorSetLayoutBinding bounceQueueBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 8);
+	VkDescriptorSetLayoutBinding radianceBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 9);
+	VkDescriptorSetLayoutBinding tileQueueBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 10);
+	VkDescriptorSetLayoutBinding renderSettingsBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 11);
+	VkDescriptorSetLayoutBinding gBufferBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 12);
+	VkDescriptorSetLayoutBinding lowResVisibilityBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 13);
+	VkDescriptorSetLayoutBinding depthHistoryBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 14);
+	VkDescriptorSetLayoutBinding reprojectedDepthBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 15);
+	VkDescriptorSetLayoutBinding statisticsBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 16);
+	VkDescriptorSetLayoutBinding historyImagesBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 17);
+	historyImagesBinding.descriptorCount = HistoryImageCount;
+	VkDescriptorSetLayoutBinding outputCacheBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 18);
+	VkDescriptorSetLayoutBinding edgeListBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 19);
+	VkDescriptorSetLayoutBinding skyboxCubemapBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 20);
+	VkDescriptorSetLayoutBinding sceneProgramBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 21);
+	VkDescriptorSetLayoutBinding meshBrickAtlasBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 22);
+	VkDescriptorSetLayoutBinding meshBrickCellsBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 23);
+	VkDescriptorSetLayoutBinding meshBrickRangesBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 24);
+	VkDescriptorSetLayoutBinding meshCellMipsBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 25);
+	VkDescriptorSetLayoutBinding sceneInstancesBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 26);
+	VkDescriptorSetLayoutBinding instanceGridBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 27);
+	VkDescriptorSetLayoutBinding instanceBvhBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 28);
+	VkDescriptorSetLayoutBinding instanceBvhIndicesBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 29);
+	VkDescriptorSetLayoutBinding layoutBindings[] = { outputImageBinding, skyboxImageBinding, dimensionsBinding, sceneDataBinding, lightDataBinding, materialDataBinding,
+		hitQueueBinding, shadowQueueBinding, bounceQueueBinding, radianceBinding, tileQueueBinding, renderSettingsBinding, gBufferBinding, lowResVisibilityBinding,
+		depthHistoryBinding, reprojectedDepthBinding, statisticsBinding, historyImagesBinding, outputCacheBinding, edgeListBinding, skyboxCubemapBinding, sceneProgramBinding, meshBrickAtlasBinding, meshBrickCellsBinding,
+		meshBrickRangesBinding, meshCellMipsBinding, sceneInstancesBinding, instanceGridBinding,
+		instanceBvhBinding, instanceBvhIndicesBinding };
 
 	VkDescriptorSetLayoutCreateInfo setInfo{};
 	setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 	setInfo.flags = 0;
-	setInfo.bindingCount = 5;
+	setInfo.bindingCount = (uint32_t)std::size(layoutBindings);
 	setInfo.pBindings = layoutBindings;
 	vkCreateDescriptorSetLayout(m_Device, &setInfo, nullptr, &m_descriptorSetLayout);
 
@@ -65,13 +132,58 @@ void ComputeShader::InitDescriptors(int overlappingFrames, VkEngine* engine)
 			vkDestroySampler(m_Device, blockySampler, nullptr);
 		});
 
+	//The cubemap is sampled by direction so it doesn't wrap, the shader picks the mip
+	VkSamplerCreateInfo cubemapSamplerInfo = vkInit::SamplerCreateInfo(VK_FILTER_LINEAR, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+	cubemapSamplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	cubemapSamplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+	VkSampler cubemapSampler;
+	vkCreateSampler(m_Device, &cubemapSamplerInfo, nullptr, &cubemapSampler);
+	engine->m_DeletionQueue.PushFunction([=]()
+		{
+			vkDestroySampler(m_Device, cubemapSampler, nullptr);
+		});
+
+	//Trilinear inside a brick, the shader keeps the coordinates between its border samples. The cells are only fetched
+	VkSamplerCreateInfo brickAtlasSamplerInfo = vkInit::SamplerCreateInfo(VK_FILTER_LINEAR, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+	vkCreateSampler(m_Device, &brickAtlasSamplerInfo, nullptr, &m_MeshBrickAtlasSampler);
+	VkSamplerCreateInfo brickCellSamplerInfo = vkInit::SamplerCreateInfo(VK_FILTER_NEAREST, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+	vkCreateSampler(m_Device, &brickCellSamplerInfo, nullptr, &m_MeshBrickCellSampler);
+	engine->m_DeletionQueue.PushFunction([=]()
+		{
+			vkDestroySampler(m_Device, m_MeshBrickAtlasSampler, nullptr);
+			vkDestroySampler(m_Device, m_MeshBrickCellSampler, nullptr);
+		});
+
+	//Create the wavefront buffers, the queues are also read as indirect dispatch arguments
+	VkDeviceSize queueSize = RayQueueHeaderSize + sizeof(QueuedRay) * (VkDeviceSize)m_RayQueueCapacity;
+	VkBufferUsageFlags queueUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	m_HitQueueBuffer = engine->CreateBuffer(queueSize, queueUsage, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_ShadowQueueBuffer = engine->CreateBuffer(queueSize, queueUsage, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_BounceQueueBuffer = engine->CreateBuffer(queueSize, queueUsage, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_RadianceBuffer = engine->CreateBuffer(sizeof(glm::vec4) * (VkDeviceSize)m_RayQueueCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_TileQueueBuffer = engine->CreateBuffer(sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+
+	//One entry per pixel, the low resolution buffer is sized for the smallest scale (1) so the scale can change at runtime
+	m_GBuffer = engine->CreateBuffer(sizeof(GBufferTexel) * (VkDeviceSize)m_RayQueueCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_LowResVisibilityBuffer = engine->CreateBuffer(sizeof(glm::vec2) * (VkDeviceSize)m_RayQueueCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_DepthHistoryBuffer = engine->CreateBuffer(sizeof(glm::vec4) * (VkDeviceSize)m_RayQueueCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_ReprojectedDepthBuffer = engine->CreateBuffer(sizeof(uint32_t) * (VkDeviceSize)m_RayQueueCapacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_EdgeListBuffer = engine->CreateBuffer(RayQueueHeaderSize + sizeof(uint32_t) * (VkDeviceSize)m_RayQueueCapacity, queueUsage, VMA_MEMORY_USAGE_GPU_ONLY);
+
+	//Only ever copied into, the empty program has to be there before the first frame reads it
+	m_SceneProgramBuffer = engine->CreateBuffer(sizeof(SceneProgramData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_MaterialBuffer = engine->CreateBuffer(sizeof(MaterialData) * MaxMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY);
+	m_SceneProgramChanges.push_back({ 0, 0, sizeof(SceneProgramHeader) });
+
 	m_FrameData.resize(overlappingFrames);
 	for (int i = 0; i < overlappingFrames; ++i)
 	{
 		//Create buffers
 		m_FrameData[i].dimensionsBuffer = engine->CreateBuffer(sizeof(uint32_t) * 2, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
-		m_FrameData[i].sceneBuffer = engine->CreateBuffer(sizeof(glm::mat4) * 3 + sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		m_FrameData[i].sceneBuffer = engine->CreateBuffer(sizeof(SceneBufferData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
 		m_FrameData[i].lightBuffer = engine->CreateBuffer(sizeof(glm::vec4) * 2, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		m_FrameData[i].renderSettingsBuffer = engine->CreateBuffer(sizeof(RenderSettingsBufferData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU);
+		m_FrameData[i].statisticsBuffer = engine->CreateBuffer(sizeof(StatisticsBufferData), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU);
 	
 		//allocate descriptorset
 		VkDescriptorSetAllocateInfo allocInfo{};
@@ -93,6 +205,11 @@ void ComputeShader::InitDescriptors(int overlappingFrames, VkEngine* engine)
 		skyboxImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 		skyboxImageInfo.imageView = *m_SkyboxTexture;
 
+		VkDescriptorImageInfo skyboxCubemapInfo{};
+		skyboxCubemapInfo.sampler = cubemapSampler;
+		skyboxCubemapInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		skyboxCubemapInfo.imageView = *m_SkyboxCubemap;
+
 		VkDescriptorBufferInfo dimensionsBufferInfo{};
 		dimensionsBufferInfo.buffer = m_FrameData[i].dimensionsBuffer.buffer;
 		dimensionsBufferInfo.offset = 0;
@@ -108,17 +225,378 @@ void ComputeShader::InitDescriptors(int overlappingFrames, VkEngine* engine)
 		lightBufferInfo.offset = 0;
 		lightBufferInfo.range = sizeof(LightBufferData);
 
+		VkDescriptorBufferInfo materialBufferInfo{};
+		materialBufferInfo.buffer = m_MaterialBuffer.buffer;
+		materialBufferInfo.offset = 0;
+		materialBufferInfo.range = sizeof(MaterialData) * MaxMaterials;
+
+		VkDescriptorBufferInfo hitQueueInfo{};
+		hitQueueInfo.buffer = m_HitQueueBuffer.buffer;
+		hitQueueInfo.offset = 0;
+		hitQueueInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo shadowQueueInfo{};
+		shadowQueueInfo.buffer = m_ShadowQueueBuffer.buffer;
+		shadowQueueInfo.offset = 0;
+		shadowQueueInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo bounceQueueInfo{};
+		bounceQueueInfo.buffer = m_BounceQueueBuffer.buffer;
+		bounceQueueInfo.offset = 0;
+		bounceQueueInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo radianceInfo{};
+		radianceInfo.buffer = m_RadianceBuffer.buffer;
+		radianceInfo.offset = 0;
+		radianceInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo tileQueueInfo{};
+		tileQueueInfo.buffer = m_TileQueueBuffer.buffer;
+		tileQueueInfo.offset = 0;
+		tileQueueInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo renderSettingsInfo{};
+		renderSettingsInfo.buffer = m_FrameData[i].renderSettingsBuffer.buffer;
+		renderSettingsInfo.offset = 0;
+		renderSettingsInfo.range = sizeof(RenderSettingsBufferData);
+
+		VkDescriptorBufferInfo gBufferInfo{};
+		gBufferInfo.buffer = m_GBuffer.buffer;
+		gBufferInfo.offset = 0;
+		gBufferInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo lowResVisibilityInfo{};
+		lowResVisibilityInfo.buffer = m_LowResVisibilityBuffer.buffer;
+		lowResVisibilityInfo.offset = 0;
+		lowResVisibilityInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo depthHistoryInfo{};
+		depthHistoryInfo.buffer = m_DepthHistoryBuffer.buffer;
+		depthHistoryInfo.offset = 0;
+		depthHistoryInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo reprojectedDepthInfo{};
+		reprojectedDepthInfo.buffer = m_ReprojectedDepthBuffer.buffer;
+		reprojectedDepthInfo.offset = 0;
+		reprojectedDepthInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo statisticsInfo{};
+		statisticsInfo.buffer = m_FrameData[i].statisticsBuffer.buffer;
+		statisticsInfo.offset = 0;
+		statisticsInfo.range = sizeof(StatisticsBufferData);
+
+		VkDescriptorBufferInfo sceneProgramInfo{};
+		sceneProgramInfo.buffer = m_SceneProgramBuffer.buffer;
+		sceneProgramInfo.offset = 0;
+		sceneProgramInfo.range = VK_WHOLE_SIZE;
+
+		VkDescriptorBufferInfo edgeListInfo{};
+		edgeListInfo.buffer = m_EdgeListBuffer.buffer;
+		edgeListInfo.offset = 0;
+		edgeListInfo.range = VK_WHOLE_SIZE;
+
+		//Every frame sees both history images, the render settings tell which one to write
+		VkDescriptorImageInfo historyImageInfos[HistoryImageCount]{};
+		for (uint32_t history = 0; history < HistoryImageCount; ++history)
+		{
+			historyImageInfos[history].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+			historyImageInfos[history].imageView = m_HistoryImages[history];
+			historyImageInfos[history].sampler = VK_NULL_HANDLE;
+		}
+
+		VkDescriptorImageInfo outputCacheInfo{};
+		outputCacheInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		outputCacheInfo.imageView = *m_OutputCache;
+		outputCacheInfo.sampler = VK_NULL_HANDLE;
+
 		//Write texture to the descriptor set
 		VkWriteDescriptorSet imageOutputSetWrite = vkInit::WriteDescriptorSetImage(VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, m_FrameData[i].descriptorSet, &outputImageInfo, 0);
 		VkWriteDescriptorSet skyboxTexture = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, m_FrameData[i].descriptorSet, &skyboxImageInfo, 1);
 		VkWriteDescriptorSet dimensionsSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &dimensionsBufferInfo, 2);
 		VkWriteDescriptorSet sceneSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &sceneBufferInfo, 3);
 		VkWriteDescriptorSet lightSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &lightBufferInfo, 4);
-		VkWriteDescriptorSet writeSets[] = { imageOutputSetWrite, skyboxTexture, dimensionsSetWrite, sceneSetWrite, lightSetWrite };
-		vkUpdateDescriptorSets(m_Device, 5, writeSets, 0, nullptr);
+		VkWriteDescriptorSet materialSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &materialBufferInfo, 5);
+		VkWriteDescriptorSet hitQueueSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &hitQueueInfo, 6);
+		VkWriteDescriptorSet shadowQueueSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &shadowQueueInfo, 7);
+		VkWriteDescriptorSet bounceQueueSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &bounceQueueInfo, 8);
+		VkWriteDescriptorSet radianceSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &radianceInfo, 9);
+		VkWriteDescriptorSet tileQueueSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &tileQueueInfo, 10);
+		VkWriteDescriptorSet renderSettingsSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &renderSettingsInfo, 11);
+		VkWriteDescriptorSet gBufferSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &gBufferInfo, 12);
+		VkWriteDescriptorSet lowResVisibilitySetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &lowResVisibilityInfo, 13);
+		VkWriteDescriptorSet depthHistorySetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &depthHistoryInfo, 14);
+		VkWriteDescriptorSet reprojectedDepthSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &reprojectedDepthInfo, 15);
+		VkWriteDescriptorSet statisticsSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &statisticsInfo, 16);
+		VkWriteDescriptorSet historyImagesSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, m_FrameData[i].descriptorSet, historyImageInfos, 17);
+		historyImagesSetWrite.descriptorCount = HistoryImageCount;
+		VkWriteDescriptorSet outputCacheSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, m_FrameData[i].descriptorSet, &outputCacheInfo, 18);
+		VkWriteDescriptorSet edgeListSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &edgeListInfo, 19);
+		VkWriteDescriptorSet skyboxCubemapSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, m_FrameData[i].descriptorSet, &skyboxCubemapInfo, 20);
+		VkWriteDescriptorSet sceneProgramSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, m_FrameData[i].descriptorSet, &sceneProgramInfo, 21);
+		VkWriteDescriptorSet writeSets[] = { imageOutputSetWrite, skyboxTexture, dimensionsSetWrite, sceneSetWrite, lightSetWrite, materialSetWrite,
+			hitQueueSetWrite, shadowQueueSetWrite, bounceQueueSetWrite, radianceSetWrite, tileQueueSetWrite, renderSettingsSetWrite, gBufferSetWrite, lowResVisibilitySetWrite,
+			depthHistorySetWrite, reprojectedDepthSetWrite, statisticsSetWrite, historyImagesSetWrite, outputCacheSetWrite, edgeListSetWrite, skyboxCubemapSetWrite, sceneProgramSetWrite };
+		vkUpdateDescriptorSets(m_Device, (uint32_t)std::size(writeSets), writeSets, 0, nullptr);
+	}
+
+	UpdateMeshVolumeDescriptors();
+	UpdateSceneInstanceDescriptors();
+}
+
+void ComputeShader::UpdateMeshVolumeDescriptors()
+{
+	VkDescriptorImageInfo brickAtlasInfo{};
+	brickAtlasInfo.sampler = m_MeshBrickAtlasSampler;
+	brickAtlasInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	brickAtlasInfo.imageView = *m_MeshBrickAtlas;
+
+	VkDescriptorImageInfo brickCellsInfo{};
+	brickCellsInfo.sampler = m_MeshBrickCellSampler;
+	brickCellsInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	brickCellsInfo.imageView = *m_MeshBrickCells;
+
+	//Fetched like the cells, so the same sampler
+	VkDescriptorImageInfo cellMipsInfo{};
+	cellMipsInfo.sampler = m_MeshBrickCellSampler;
+	cellMipsInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	cellMipsInfo.imageView = *m_MeshCellMips;
+
+	VkDescriptorBufferInfo brickRangesInfo{};
+	brickRangesInfo.buffer = *m_MeshBrickRanges;
+	brickRangesInfo.offset = 0;
+	brickRangesInfo.range = VK_WHOLE_SIZE;
+
+	for (FrameData& frame : m_FrameData)
+	{
+		VkWriteDescriptorSet brickAtlasSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame.descriptorSet, &brickAtlasInfo, 22);
+		VkWriteDescriptorSet brickCellsSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame.descriptorSet, &brickCellsInfo, 23);
+		VkWriteDescriptorSet brickRangesSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptorSet, &brickRangesInfo, 24);
+		VkWriteDescriptorSet cellMipsSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frame.descriptorSet, &cellMipsInfo, 25);
+		VkWriteDescriptorSet writeSets[] = { brickAtlasSetWrite, brickCellsSetWrite, brickRangesSetWrite, cellMipsSetWrite };
+		vkUpdateDescriptorSets(m_Device, (uint32_t)std::size(writeSets), writeSets, 0, nullptr);
+	}
+}
+
+void ComputeShader::UpdateSceneInstanceDescriptors()
+{
+	VkDescriptorBufferInfo instancesInfo{};
+	instancesInfo.buffer = *m_SceneInstances;
+	instancesInfo.offset = 0;
+	instancesInfo.range = VK_WHOLE_SIZE;
+
+	VkDescriptorBufferInfo gridInfo{};
+	gridInfo.buffer = *m_InstanceGrid;
+	gridInfo.offset = 0;
+	gridInfo.range = VK_WHOLE_SIZE;
+
+	VkDescriptorBufferInfo bvhInfo{};
+	bvhInfo.buffer = *m_InstanceBvh;
+	bvhInfo.offset = 0;
+	bvhInfo.range = VK_WHOLE_SIZE;
+
+	VkDescriptorBufferInfo bvhIndicesInfo{};
+	bvhIndicesInfo.buffer = *m_InstanceBvhIndices;
+	bvhIndicesInfo.offset = 0;
+	bvhIndicesInfo.range = VK_WHOLE_SIZE;
+
+	for (FrameData& frame : m_FrameData)
+	{
+		VkWriteDescriptorSet instancesSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptorSet, &instancesInfo, 26);
+		VkWriteDescriptorSet gridSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptorSet, &gridInfo, 27);
+		VkWriteDescriptorSet bvhSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptorSet, &bvhInfo, 28);
+		VkWriteDescriptorSet bvhIndicesSetWrite = vkInit::WriteDescriptorSetBuffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, frame.descriptorSet, &bvhIndicesInfo, 29);
+		VkWriteDescriptorSet writeSets[] = { instancesSetWrite, gridSetWrite, bvhSetWrite, bvhIndicesSetWrite };
+		vkUpdateDescriptorSets(m_Device, (uint32_t)std::size(writeSets), writeSets, 0, nullptr);
 	}
 }
 
+void ComputeShader::SetSceneProgram(const std::vector<SceneDescription::Instruction>& instructions, const SceneDescription::Bounds& bounds)
+{
+	if (instructions.size() > MaxSceneInstructions)
+		throw std::runtime_error("ComputeShader::SetSceneProgram() >> The scene has " + std::to_string(instructions.size()) + " instructions, the buffer fits " + std::to_string(MaxSceneInstructions));
+
+	std::copy(instructions.begin(), instructions.end(), m_SceneProgram.instructions);
+	m_SceneProgram.header.instructionCount = (uint32_t)instructions.size();
+	m_SceneProgram.header.boundsMin = glm::vec4(bounds.min, 0.0f);
+	m_SceneProgram.header.boundsMax = glm::vec4(bounds.max, 0.0f);
+	++m_SceneProgramVersion;
+
+	//Whatever was still waiting is part of this
+	m_SceneProgramChanges.clear();
+	m_SceneProgramChanges.push_back({ 0, 0, sizeof(SceneProgramHeader) + sizeof(SceneDescription::Instruction) * instructions.size() });
+}
+
+void ComputeShader::PatchSceneProgram(const std::vector<SceneDescription::InstructionPatch>& patches, const SceneDescription::Bounds& bounds)
+{
+	for (const SceneDescription::InstructionPatch& patch : patches)
+	{
+		if (patch.index >= m_SceneProgram.header.instructionCount)
+			throw std::runtime_error("ComputeShader::PatchSceneProgram() >> Instruction " + std::to_string(patch.index) + " is past the end of the program");
+
+		m_SceneProgram.instructions[patch.index] = patch.instruction;
+		m_SceneProgramChanges.push_back({ 0, offsetof(SceneProgramData, instructions) + sizeof(SceneDescription::Instruction) * patch.index, sizeof(SceneDescription::Instruction) });
+	}
+
+	glm::vec4 boundsMin{ bounds.min, 0.0f };
+	glm::vec4 boundsMax{ bounds.max, 0.0f };
+	if (boundsMin != m_SceneProgram.header.boundsMin || boundsMax != m_SceneProgram.header.boundsMax)
+	{
+		m_SceneProgram.header.boundsMin = boundsMin;
+		m_SceneProgram.header.boundsMax = boundsMax;
+		m_SceneProgramChanges.push_back({ 0, 0, sizeof(SceneProgramHeader) });
+	}
+	++m_SceneProgramVersion;
+}
+
+void ComputeShader::SetMaterialBufferData(const std::vector<MaterialData>& materials)
+{
+	m_Materials = materials;
+	m_Materials.resize(glm::min(m_Materials.size(), (size_t)MaxMaterials));
+	m_MaterialChanges.clear();
+	m_MaterialChanges.push_back({ 0, 0, sizeof(MaterialData) * m_Materials.size() });
+}
+
+void ComputeShader::SetMaterial(uint32_t index, const MaterialData& material)
+{
+	if (index >= m_Materials.size())
+		throw std::runtime_error("ComputeShader::SetMaterial() >> There is no material " + std::to_string(index));
+
+	m_Materials[index] = material;
+	m_MaterialChanges.push_back({ 0, sizeof(MaterialData) * index, sizeof(MaterialData) });
+}
+
+namespace
+{
+	//Sorts the ranges and merges the ones that overlap or touch, so an edit that moves a node every frame is one copy
+	void MergeBufferRanges(std::vector<VkBufferCopy>& ranges)
+	{
+		std::sort(ranges.begin(), ranges.end(), [](const VkBufferCopy& a, const VkBufferCopy& b) { return a.dstOffset < b.dstOffset; });
+
+		size_t count = 0;
+		for (const VkBufferCopy& range : ranges)
+		{
+			if (count > 0 && range.dstOffset <= ranges[count - 1].dstOffset + ranges[count - 1].size)
+			{
+				VkBufferCopy& last = ranges[count - 1];
+				last.size = glm::max(last.dstOffset + last.size, range.dstOffset + range.size) - last.dstOffset;
+			}
+			else
+				ranges[count++] = range;
+		}
+		ranges.resize(count);
+	}
+}
+
+VkDeviceSize ComputeShader::StageScenePatches(uint8_t* stagingMemory, VkDeviceSize offset, VkDeviceSize maxBytes)
+{
+	m_SceneProgramCopies.clear();
+	m_MaterialCopies.clear();
+	MergeBufferRanges(m_SceneProgramChanges);
+	MergeBufferRanges(m_MaterialChanges);
+
+	//Keeps the copies 16 byte aligned like the data they come from
+	VkDeviceSize size = 0;
+	for (const std::vector<VkBufferCopy>* changes : { &m_SceneProgramChanges, &m_MaterialChanges })
+	{
+		for (const VkBufferCopy& change : *changes)
+			size += (change.size + 15) / 16 * 16;
+	}
+	if (size == 0 || size > maxBytes)
+		return 0;
+
+	VkDeviceSize start = offset;
+	auto stage = [&](std::vector<VkBufferCopy>& changes, std::vector<VkBufferCopy>& copies, const void* source)
+	{
+		for (VkBufferCopy change : changes)
+		{
+			memcpy(stagingMemory + offset, static_cast<const uint8_t*>(source) + change.dstOffset, change.size);
+			change.srcOffset = offset;
+			copies.push_back(change);
+			offset += (change.size + 15) / 16 * 16;
+		}
+		changes.clear();
+	};
+	stage(m_SceneProgramChanges, m_SceneProgramCopies, &m_SceneProgram);
+	stage(m_MaterialChanges, m_MaterialCopies, m_Materials.data());
+
+	return offset - start;
+}
+
+void ComputeShader::RecordScenePatches(VkCommandBuffer cmd, VkBuffer stagingBuffer)
+{
+	if (m_SceneProgramCopies.empty() && m_MaterialCopies.empty())
+		return;
+
+	//Earlier submits on this queue may still be reading them
+	VkBufferMemoryBarrier toTransfer[2]{};
+	for (int i = 0; i < 2; ++i)
+	{
+		toTransfer[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		toTransfer[i].buffer = i == 0 ? m_SceneProgramBuffer.buffer : m_MaterialBuffer.buffer;
+		toTransfer[i].size = VK_WHOLE_SIZE;
+		toTransfer[i].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		toTransfer[i].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		toTransfer[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		toTransfer[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	}
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 2, toTransfer, 0, nullptr);
+
+	if (!m_SceneProgramCopies.empty())
+		vkCmdCopyBuffer(cmd, stagingBuffer, m_SceneProgramBuffer.buffer, (uint32_t)m_SceneProgramCopies.size(), m_SceneProgramCopies.data());
+	if (!m_MaterialCopies.empty())
+		vkCmdCopyBuffer(cmd, stagingBuffer, m_MaterialBuffer.buffer, (uint32_t)m_MaterialCopies.size(), m_MaterialCopies.data());
+
+	VkBufferMemoryBarrier toReadable[2]{ toTransfer[0], toTransfer[1] };
+	for (VkBufferMemoryBarrier& barrier : toReadable)
+	{
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	}
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 2, toReadable, 0, nullptr);
+
+	m_SceneProgramCopies.clear();
+	m_MaterialCopies.clear();
+}
+
+bool ComputeShader::DetectInputChanges(const RenderSettingsBufferData& renderSettings)
+{
+	bool changed = !m_HasLastInputs
+		|| memcmp(&m_DimensionsBufferData, &m_LastDimensions, sizeof(DimensionsBufferData)) != 0
+		|| m_SceneBufferData.viewMat != m_LastScene.viewMat
+		|| m_SceneBufferData.projMat != m_LastScene.projMat
+		|| m_SceneBufferData.sceneMoved != 0
+		|| memcmp(&m_LightBufferData, &m_LastLight, sizeof(LightBufferData)) != 0
+		|| m_Materials.size() != m_LastMaterials.size()
+		|| memcmp(m_Materials.data(), m_LastMaterials.data(), sizeof(MaterialData) * m_Materials.size()) != 0
+		|| renderSettings.lightingScale != m_LastRenderSettings.lightingScale
+		|| renderSettings.renderWidth != m_LastRenderSettings.renderWidth
+		|| renderSettings.renderHeight != m_LastRenderSettings.renderHeight
+		|| renderSettings.interleavePattern != m_LastRenderSettings.interleavePattern
+		|| renderSettings.edgeSamples != m_LastRenderSettings.edgeSamples
+		|| renderSettings.focusX != m_LastRenderSettings.focusX
+		|| renderSettings.focusY != m_LastRenderSettings.focusY
+		|| renderSettings.foveaInnerRadius != m_LastRenderSettings.foveaInnerRadius
+		|| renderSettings.foveaOuterRadius != m_LastRenderSettings.foveaOuterRadius
+		|| renderSettings.showRateMap != m_LastRenderSettings.showRateMap
+		|| renderSettings.maxMarchingSteps != m_LastRenderSettings.maxMarchingSteps
+		|| renderSettings.reflectionBounces != m_LastRenderSettings.reflectionBounces
+		|| renderSettings.aoTaps != m_LastRenderSettings.aoTaps
+		|| renderSettings.shadowSteps != m_LastRenderSettings.shadowSteps
+		|| renderSettings.lodPixelAngle != m_LastRenderSettings.lodPixelAngle
+		|| renderSettings.fractalIterations != m_LastRenderSettings.fractalIterations
+		|| m_SceneProgramVersion != m_LastSceneProgramVersion;
+
+	m_HasLastInputs = true;
+	m_LastDimensions = m_DimensionsBufferData;
+	m_LastScene = m_SceneBufferData;
+	m_LastLight = m_LightBufferData;
+	m_LastMaterials = m_Materials;
+	m_LastRenderSettings = renderSettings;
+	m_LastSceneProgramVersion = m_SceneProgramVersion;
+
+	return changed;
+}
+
 void ComputeShader::UpdateShaderVariables(int currentFrame, VkEngine* engine)
 {
 	//Update dimensions buffer
@@ -135,4 +613,9 @@ void ComputeShader::UpdateShaderVariables(int currentFrame, VkEngine* engine)
 	data = engine->GetBufferMemory(m_FrameData[currentFrame].lightBuffer);
 	memcpy(data, &m_LightBufferData, sizeof(LightBufferData));
 	engine->ReleaseBufferMemory(m_FrameData[currentFrame].lightBuffer);
+
+	//update render settings
+	data = engine->GetBufferMemory(m_FrameData[currentFrame].renderSettingsBuffer);
+	memcpy(data, &m_RenderSettingsBufferData, sizeof(RenderSettingsBufferData));
+	engine->ReleaseBufferMemory(m_FrameData[currentFrame].renderSettingsBuffer);
 }
@@ -1,8 +1,36 @@
 #pragma once
 #include "Shader.h"
+#include "SceneDescription.h"
 
 class VkEngine;
 
+//Value of the RENDER_STAGE specialization constant (constant_id 0), has to match the STAGE_ constants in the shaders
+enum RenderStage : uint32_t
+{
+	STAGE_MEGAKERNEL = 0,
+	STAGE_PRIMARY,
+	STAGE_SHADE,
+	STAGE_SHADOW,
+	STAGE_REFLECT,
+	STAGE_RESOLVE,
+	STAGE_PERSISTENT,
+	STAGE_PRIMARY_HIT,
+	STAGE_LOWRES_LIGHTING,
+	STAGE_DEFERRED_REFLECT,
+	STAGE_DEFERRED_LIGHTING,
+	STAGE_REPROJECT,
+	STAGE_TAAU_RENDER,
+	STAGE_TAAU_RESOLVE,
+	STAGE_INTERLEAVED_RENDER,
+	STAGE_INTERLEAVED_RESOLVE,
+	STAGE_REFINE,
+	STAGE_PRESENT_CACHED,
+	STAGE_EDGE_DETECT,
+	STAGE_EDGE_SUPERSAMPLE,
+	STAGE_FOVEATED,
+	STAGE_COUNT
+};
+
 class ComputeShader : public Shader
 {
 public:
@@ -18,6 +46,14 @@ public:
 		glm::mat4 viewInverseMat;
 		glm::mat4 projInverseMat;
 		float time;
+		uint32_t sceneMoved;	//Animated surfaces moved since the previous frame, not just the camera
+
+		//Camera of the previous frame for the temporal reprojection, padded to the std430 layout
+		float padding[2];
+		glm::mat4 projMat;
+		glm::mat4 prevViewInverseMat;
+		glm::mat4 prevProjInverseMat;
+		glm::mat4 prevViewProjMat;
 	};
 
 	struct LightBufferData
@@ -26,23 +62,173 @@ public:
 		glm::vec4 lightColor;
 	};
 
+	struct MaterialData
+	{
+		glm::vec4 color;
+		glm::vec4 specular;
+	};
+
+	static const uint32_t MaxMaterials = 64;
+
+	//Start of the scene program buffer, the instructions follow it. An empty program makes the shader use its built-in map()
+	struct SceneProgramHeader
+	{
+		uint32_t instructionCount;
+		uint32_t padding[3];
+		glm::vec4 boundsMin;
+		glm::vec4 boundsMax;
+	};
+
+	static const uint32_t MaxSceneInstructions = 1024;
+
+	//Everything the scene program buffer can hold, the copy on the CPU that the changed ranges are uploaded from
+	struct SceneProgramData
+	{
+		SceneProgramHeader header;
+		SceneDescription::Instruction instructions[MaxSceneInstructions];
+	};
+
+	//Surface seen by a camera ray, std430 pads it to 32 bytes
+	struct GBufferTexel
+	{
+		glm::vec4 normalDepth;
+		uint32_t materialId;
+		uint32_t padding[3];
+	};
+
+	//Settings that change per frame without rebuilding the pipelines
+	struct RenderSettingsBufferData
+	{
+		uint32_t lightingScale = 1;
+		uint32_t temporalReprojection = 0;
+		uint32_t collectStatistics = 0;
+
+		//Temporal upsampling, the jitter is in render pixels
+		uint32_t renderWidth = 0;
+		uint32_t renderHeight = 0;
+		float jitterX = 0.0f;
+		float jitterY = 0.0f;
+		uint32_t historyIndex = 0;
+		uint32_t historyValid = 0;
+
+		//Interleaved rendering, which pixels get traced this frame
+		uint32_t interleavePattern = 0;
+		uint32_t interleavePhase = 0;
+
+		//Static scene, the output is kept in the cache while nothing changes so it can be refined or presented again
+		uint32_t cacheOutput = 0;
+		uint32_t refinementSample = 0;
+
+		uint32_t edgeSamples = 0;
+
+		//Foveated rendering, the radii are in fractions of the screen height around the focus pixel
+		float focusX = 0.0f;
+		float focusY = 0.0f;
+		float foveaInnerRadius = 0.0f;
+		float foveaOuterRadius = 0.0f;
+		uint32_t showRateMap = 0;
+
+		//Quality tier picked by the governor
+		uint32_t maxMarchingSteps = 1024;
+		uint32_t reflectionBounces = 4;
+		uint32_t aoTaps = 5;
+		uint32_t shadowSteps = 1024;
+
+		//Fractal level of detail, 0 = always full detail
+		float lodPixelAngle = 0.0f;
+		uint32_t fractalIterations = 3;
+
+		float skyboxLod = 0.0f;
+	};
+
+	//Full resolution color history of the temporal upsampling, has to match HISTORY_IMAGE_COUNT in the shader
+	static const uint32_t HistoryImageCount = 2;
+	static const VkFormat HistoryImageFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+
+	//32 bit floats so the progressive refinement can average many samples
+	static const VkFormat OutputCacheFormat = VK_FORMAT_R32G32B32A32_SFLOAT;
+
+	//Written by the shader, read back once the frame is done
+	struct StatisticsBufferData
+	{
+		uint32_t primarySteps;
+		uint32_t primaryRays;
+		uint32_t edgePixels;
+	};
+
+	//Entry of the wavefront ray queues, each queue starts with a VkDispatchIndirectCommand and the ray count
+	struct QueuedRay
+	{
+		glm::vec3 origin;
+		uint32_t pixel;
+		glm::vec3 direction;
+		float distance;
+		glm::vec3 energy;
+		uint32_t materialId;
+	};
+
+	static const uint32_t RayQueueHeaderSize = sizeof(uint32_t) * 4;
+
 	ComputeShader(const VkDevice& device, const std::string& computeShaderFile);
 
 	void SetSkyboxTexture(VkImageView* skyboxTexture);
+	void SetSkyboxCubemap(VkImageView* skyboxCubemap);
 	void SetSwapchainImage(VkImageView* swapchainImage);
+	void SetHistoryImages(VkImageView* historyImages);
+	void SetOutputCacheImage(VkImageView* outputCache);
+	void SetMeshVolume(VkImageView* brickAtlas, VkImageView* brickCells, VkImageView* cellMips, VkBuffer* brickRanges);
+	void SetSceneInstances(VkBuffer* instances, VkBuffer* instanceGrid, VkBuffer* instanceBvh, VkBuffer* instanceBvhIndices);
+	void SetRayQueueCapacity(uint32_t rayCount);
 
 	virtual void InitDescriptors(int overlappingFrames, VkEngine* engine);
 
 	virtual void UpdateShaderVariables(int currentFrame, VkEngine* engine);
 
+	//Compares the shader variables with the last call, the previous frame camera and the per frame jitter and indices don't count.
+	//renderSettings is passed in because the per frame fields of it depend on the result.
+	bool DetectInputChanges(const RenderSettingsBufferData& renderSettings);
+
 	const AllocatedBuffer& GetDimensionsBuffer(int currentFrame) { return m_FrameData[currentFrame].dimensionsBuffer; }
 	const AllocatedBuffer& GetLightBuffer(int currentFrame) { return m_FrameData[currentFrame].lightBuffer; }
 	const AllocatedBuffer& GetSceneBuffer(int currentFrame) { return m_FrameData[currentFrame].sceneBuffer; }
+	const AllocatedBuffer& GetMaterialBuffer() { return m_MaterialBuffer; }
+	const AllocatedBuffer& GetRenderSettingsBuffer(int currentFrame) { return m_FrameData[currentFrame].renderSettingsBuffer; }
+	const AllocatedBuffer& GetStatisticsBuffer(int currentFrame) { return m_FrameData[currentFrame].statisticsBuffer; }
 	const VkDescriptorSet& GetDescriptorSet(int currentFrame) { return m_FrameData[currentFrame].descriptorSet; }
+	const AllocatedBuffer& GetHitQueueBuffer() { return m_HitQueueBuffer; }
+	const AllocatedBuffer& GetShadowQueueBuffer() { return m_ShadowQueueBuffer; }
+	const AllocatedBuffer& GetBounceQueueBuffer() { return m_BounceQueueBuffer; }
+	const AllocatedBuffer& GetTileQueueBuffer() { return m_TileQueueBuffer; }
+	const AllocatedBuffer& GetReprojectedDepthBuffer() { return m_ReprojectedDepthBuffer; }
+	const AllocatedBuffer& GetEdgeListBuffer() { return m_EdgeListBuffer; }
+
+	const SceneBufferData& GetSceneBufferData() const { return m_SceneBufferData; }
+	const std::vector<MaterialData>& GetMaterialBufferData() const { return m_Materials; }
 
 	void SetDimensionsBufferData(DimensionsBufferData& bufferData) { m_DimensionsBufferData = bufferData; }
 	void SetSceneBufferData(SceneBufferData& bufferData) { m_SceneBufferData = bufferData; }
 	void SetLightBufferData(LightBufferData& bufferData) { m_LightBufferData = bufferData; }
+	void SetMaterialBufferData(const std::vector<MaterialData>& materials);
+	void SetMaterial(uint32_t index, const MaterialData& material);
+	void SetRenderSettingsBufferData(RenderSettingsBufferData& bufferData) { m_RenderSettingsBufferData = bufferData; }
+
+	//Replaces the scene the shader interprets, the whole program is uploaded with the next patches. Throws when it doesn't fit.
+	void SetSceneProgram(const std::vector<SceneDescription::Instruction>& instructions, const SceneDescription::Bounds& bounds);
+
+	//Changes single instructions of the current program and its bounds, only those are uploaded
+	void PatchSceneProgram(const std::vector<SceneDescription::InstructionPatch>& patches, const SceneDescription::Bounds& bounds);
+
+	//The scene program and the material table live on the GPU and are shared by all frames, only the ranges that changed are copied in.
+	//Writes them into the staging memory from offset on and returns how many bytes it used. When they don't all fit in maxBytes they
+	//wait for the next frame, so a frame never sees half an edit.
+	VkDeviceSize StageScenePatches(uint8_t* stagingMemory, VkDeviceSize offset, VkDeviceSize maxBytes);
+	void RecordScenePatches(VkCommandBuffer cmd, VkBuffer stagingBuffer);
+
+	//Points the descriptor sets of all frames at the current mesh volume, none of the frames can be in flight
+	void UpdateMeshVolumeDescriptors();
+
+	//Same for the instances of the scene and their grid
+	void UpdateSceneInstanceDescriptors();
 
 private:
 	struct FrameData
@@ -50,16 +236,76 @@ private:
 		AllocatedBuffer sceneBuffer;
 		AllocatedBuffer lightBuffer;
 		AllocatedBuffer dimensionsBuffer;
+		AllocatedBuffer renderSettingsBuffer;
+		AllocatedBuffer statisticsBuffer;
 
 		VkDescriptorSet descriptorSet;
 	};
 	std::vector<FrameData> m_FrameData;
 
 	VkImageView* m_SkyboxTexture;
+	VkImageView* m_SkyboxCubemap;
 	VkImageView* m_SwapchainImage;
+	VkImageView* m_HistoryImages;
+	VkImageView* m_OutputCache;
+	VkImageView* m_MeshBrickAtlas;
+	VkImageView* m_MeshBrickCells;
+	VkImageView* m_MeshCellMips;
+	VkBuffer* m_MeshBrickRanges;
+	VkBuffer* m_SceneInstances;
+	VkBuffer* m_InstanceGrid;
+	VkBuffer* m_InstanceBvh;
+	VkBuffer* m_InstanceBvhIndices;
+	VkSampler m_MeshBrickAtlasSampler;
+	VkSampler m_MeshBrickCellSampler;
+
+	//Wavefront buffers, only used while a frame is being recorded so all frames share them
+	uint32_t m_RayQueueCapacity = 0;
+	AllocatedBuffer m_HitQueueBuffer;
+	AllocatedBuffer m_ShadowQueueBuffer;
+	AllocatedBuffer m_BounceQueueBuffer;
+	AllocatedBuffer m_RadianceBuffer;
+
+	//Tile counter for the persistent threads
+	AllocatedBuffer m_TileQueueBuffer;
+
+	//G-buffer and the low resolution shadow/AO that is upsampled with it
+	AllocatedBuffer m_GBuffer;
+	AllocatedBuffer m_LowResVisibilityBuffer;
+
+	//Camera ray depth of the last frame and where it lands in the current one
+	AllocatedBuffer m_DepthHistoryBuffer;
+	AllocatedBuffer m_ReprojectedDepthBuffer;
+
+	//Pixels picked for supersampling, same header as the ray queues
+	AllocatedBuffer m_EdgeListBuffer;
+
+	//Scene program and material table, written by the copies of RecordScenePatches()
+	AllocatedBuffer m_SceneProgramBuffer;
+	AllocatedBuffer m_MaterialBuffer;
 
 	//Shader variables
 	DimensionsBufferData m_DimensionsBufferData;
 	SceneBufferData m_SceneBufferData;
 	LightBufferData m_LightBufferData;
+	std::vector<MaterialData> m_Materials;
+	RenderSettingsBufferData m_RenderSettingsBufferData;
+
+	SceneProgramData m_SceneProgram{};
+	uint32_t m_SceneProgramVersion = 1;
+
+	//Byte ranges that changed since they were last staged (dstOffset and size) and the copies of the ones that were
+	std::vector<VkBufferCopy> m_SceneProgramChanges;
+	std::vector<VkBufferCopy> m_MaterialChanges;
+	std::vector<VkBufferCopy> m_SceneProgramCopies;
+	std::vector<VkBufferCopy> m_MaterialCopies;
+
+	//Inputs of the last DetectInputChanges()
+	bool m_HasLastInputs = false;
+	DimensionsBufferData m_LastDimensions;
+	SceneBufferData m_LastScene;
+	LightBufferData m_LastLight;
+	std::vector<MaterialData> m_LastMaterials;
+	RenderSettingsBufferData m_LastRenderSettings;
+	uint32_t m_LastSceneProgramVersion = 0;
 };
\ No newline at end of file
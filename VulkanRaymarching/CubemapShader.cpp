@@ -0,0 +1,86 @@
+#include "pch.h"
+#include "CubemapShader.h"
+#include "VkEngine.h"
+
+CubemapShader::CubemapShader(const VkDevice& device, const std::string& computeShaderFile)
+	: Shader(device, computeShaderFile)
+{
+}
+
+void CubemapShader::SetEquirectTexture(VkImageView* equirectTexture)
+{
+	m_EquirectTexture = equirectTexture;
+}
+
+void CubemapShader::SetCubemapFaces(VkImageView* cubemapFaces)
+{
+	m_CubemapFaces = cubemapFaces;
+}
+
+void CubemapShader::InitDescriptors(int overlappingFrames, VkEngine* engine)
+{
+	//Create descriptor pool
+	std::vector<VkDescriptorPoolSize> sizes =
+	{
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, (uint32_t)overlappingFrames},
+		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, (uint32_t)overlappingFrames}
+	};
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.flags = 0;
+	poolInfo.maxSets = (uint32_t)overlappingFrames;
+	poolInfo.poolSizeCount = (uint32_t)sizes.size();
+	poolInfo.pPoolSizes = sizes.data();
+
+	if (vkCreateDescriptorPool(m_Device, &poolInfo, nullptr, &m_DescriptorPool) != VK_SUCCESS)
+		throw std::runtime_error("CubemapShader::InitDescriptors() >> Failed to create descriptor pool!");
+
+	//Create setLayoutBinding
+	VkDescriptorSetLayoutBinding equirectBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding facesBinding = vkInit::DescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1);
+	VkDescriptorSetLayoutBinding layoutBindings[] = { equirectBinding, facesBinding };
+
+	VkDescriptorSetLayoutCreateInfo setInfo{};
+	setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	setInfo.flags = 0;
+	setInfo.bindingCount = (uint32_t)std::size(layoutBindings);
+	setInfo.pBindings = layoutBindings;
+	vkCreateDescriptorSetLayout(m_Device, &setInfo, nullptr, &m_descriptorSetLayout);
+
+	//The equirectangular mapping goes outside of 0-1, so it has to repeat
+	VkSamplerCreateInfo samplerInfo = vkInit::SamplerCreateInfo(VK_FILTER_LINEAR);
+	vkCreateSampler(m_Device, &samplerInfo, nullptr, &m_EquirectSampler);
+
+	//allocate descriptorset
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.descriptorPool = m_DescriptorPool;
+	allocInfo.pSetLayouts = &m_descriptorSetLayout;
+	if (vkAllocateDescriptorSets(m_Device, &allocInfo, &m_DescriptorSet) != VK_SUCCESS)
+		throw std::runtime_error("CubemapShader::InitDescriptors() >> Failed to allocate descriptor set!");
+
+	VkDescriptorImageInfo equirectImageInfo{};
+	equirectImageInfo.sampler = m_EquirectSampler;
+	equirectImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	equirectImageInfo.imageView = *m_EquirectTexture;
+
+	VkDescriptorImageInfo facesImageInfo{};
+	facesImageInfo.sampler = VK_NULL_HANDLE;
+	facesImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	facesImageInfo.imageView = *m_CubemapFaces;
+
+	VkWriteDescriptorSet equirectSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, m_DescriptorSet, &equirectImageInfo, 0);
+	VkWriteDescriptorSet facesSetWrite = vkInit::WriteDescriptorSetImage(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, m_DescriptorSet, &facesImageInfo, 1);
+	VkWriteDescriptorSet writeSets[] = { equirectSetWrite, facesSetWrite };
+	vkUpdateDescriptorSets(m_Device, (uint32_t)std::size(writeSets), writeSets, 0, nullptr);
+}
+
+void CubemapShader::CleanDescriptors()
+{
+	//Destroying the pool frees the set as well
+	vkDestroyDescriptorPool(m_Device, m_DescriptorPool, nullptr);
+	vkDestroyDescriptorSetLayout(m_Device, m_descriptorSetLayout, nullptr);
+	vkDestroySampler(m_Device, m_EquirectSampler, nullptr);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "Shader.h"
+
+class VkEngine;
+
+//Converts the equirectangular skybox into the faces of a cubemap, only dispatched once at load
+class CubemapShader : public Shader
+{
+public:
+	static const VkFormat CubemapFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+
+	CubemapShader(const VkDevice& device, const std::string& computeShaderFile);
+
+	void SetEquirectTexture(VkImageView* equirectTexture);
+	void SetCubemapFaces(VkImageView* cubemapFaces);
+
+	//The shader only lives for the conversion, so it cleans its descriptors itself instead of using the deletion queue
+	virtual void InitDescriptors(int overlappingFrames, VkEngine* engine);
+	void CleanDescriptors();
+
+	//Nothing changes per frame
+	virtual void UpdateShaderVariables(int currentFrame, VkEngine* engine) {}
+
+	const VkDescriptorSet& GetDescriptorSet() { return m_DescriptorSet; }
+
+private:
+	VkImageView* m_EquirectTexture;
+	VkImageView* m_CubemapFaces;
+
+	VkDescriptorSet m_DescriptorSet;
+	VkSampler m_EquirectSampler = VK_NULL_HANDLE;
+};
@@ -2,6 +2,10 @@
 #include "ImGuiHandler.h"
 
 #include "VkEngine.h"
+#include "ComputeShader.h"
+
+#include <algorithm>
+#include <filesystem>
 
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
@@ -29,10 +33,20 @@ void ImGuiHandler::Draw()
 	ImGui::NewFrame();
 
 	DrawShaderWindow();
+	DrawStatsWindow();
+	DrawRenderSettingsWindow();
+	DrawSceneWindow();
 
 	ImGui::Render();
 }
 
+bool ImGuiHandler::IsIdle()
+{
+	//Hovering and dragging change the windows without changing any of the render inputs
+	const ImGuiIO& io = ImGui::GetIO();
+	return io.MouseDelta.x == 0.0f && io.MouseDelta.y == 0.0f && io.MouseWheel == 0.0f && !ImGui::IsAnyMouseDown() && !ImGui::IsAnyItemActive();
+}
+
 void ImGuiHandler::Render(VkCommandBuffer cmd)
 {
 	ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), cmd);
@@ -125,8 +139,409 @@ void ImGuiHandler::DrawShaderWindow()
 	{
 		m_pEngine->m_CurrentShader = m_FileBrowser.GetSelected().string();
 		m_FileBrowser.ClearSelected();
+
+		//The generated scene shader was made from the previous one
+		m_pEngine->m_GeneratedShader.clear();
+		m_pEngine->m_GeneratedShaderReady = false;
 		m_pEngine->ReloadShaders();
 	}
 
+	//Scenes are interpreted by the shader, switching them doesn't rebuild anything
+	ImGui::Separator();
+	std::string currentScene = m_pEngine->m_CurrentScene.empty() ? "Built-in map()" : std::filesystem::path(m_pEngine->m_CurrentScene).filename().string();
+	if (ImGui::BeginCombo("Scene", currentScene.c_str()))
+	{
+		if (ImGui::Selectable("Built-in map()", m_pEngine->m_CurrentScene.empty()))
+			m_pEngine->LoadScene("");
+
+		std::error_code error;
+		for (const auto& entry : std::filesystem::directory_iterator(m_pEngine->m_SceneDirectory, error))
+		{
+			if (entry.path().extension() != ".scene")
+				continue;
+
+			std::string path = entry.path().string();
+			if (ImGui::Selectable(entry.path().filename().string().c_str(), path == m_pEngine->m_CurrentScene))
+				m_pEngine->LoadScene(path);
+		}
+		ImGui::EndCombo();
+	}
+
+	if (!m_pEngine->m_CurrentScene.empty())
+	{
+		if (ImGui::Button("Reload scene"))
+			m_pEngine->LoadScene(m_pEngine->m_CurrentScene);
+
+		//Resizing the atlas drops the resident bricks, so only once the slider is let go
+		if (m_pEngine->m_MeshBrickStreamer && !m_pEngine->m_Scene.GetMeshFile().empty())
+		{
+			ImGui::SliderInt("Brick budget (MB)", &m_pEngine->m_MeshBrickBudgetMB, 1, 1024);
+			if (ImGui::IsItemDeactivatedAfterEdit())
+				m_pEngine->ResizeMeshBrickAtlas();
+
+			//Encoding a format the first time it's picked takes a moment, the file is kept next to the Float32 one
+			if (ImGui::BeginCombo("Brick format", SdfBrickFormatNames[m_pEngine->m_MeshBrickFormat]))
+			{
+				for (uint32_t format = 0; format < SDF_BRICK_FORMAT_COUNT; ++format)
+				{
+					bool supported = m_pEngine->IsMeshBrickFormatSupported((SdfBrickFormat)format);
+					if (ImGui::Selectable(SdfBrickFormatNames[format], format == m_pEngine->m_MeshBrickFormat, supported ? 0 : ImGuiSelectableFlags_Disabled))
+						m_pEngine->SetMeshBrickFormat((SdfBrickFormat)format);
+				}
+				ImGui::EndCombo();
+			}
+
+			const SdfBrickStreamer& streamer = *m_pEngine->m_MeshBrickStreamer;
+			const SdfBrickFile::Header& header = m_pEngine->m_MeshBrickFile->GetHeader();
+			ImGui::Text("Bricks: %u of %u resident, %u waiting, %u uploaded", streamer.GetResidentCount(), header.brickCount,
+				streamer.GetMissingCount(), m_pEngine->m_MeshBrickUploads);
+			ImGui::Text("Atlas: %.1f MB, all bricks: %.1f MB (%.1f MB as Float32)", (float)streamer.GetSlotCount() * header.brickBytes / (1024.0f * 1024.0f),
+				(float)header.brickCount * header.brickBytes / (1024.0f * 1024.0f), (float)header.brickCount * MeshSdfBaker::GetBrickBytes(SDF_BRICK_FLOAT32) / (1024.0f * 1024.0f));
+
+			if (m_pEngine->m_BrickBenchmarkRunning)
+			{
+				if (m_pEngine->m_BrickBenchmarkStep < SDF_BRICK_FORMAT_COUNT)
+					ImGui::Text("Measuring %s...", SdfBrickFormatNames[m_pEngine->m_BrickBenchmarkStep]);
+			}
+			else if (!m_pEngine->m_SceneBenchmarkRunning)
+			{
+				if (ImGui::Button("Compare brick formats"))
+					m_pEngine->StartBrickBenchmark();
+
+				const std::vector<float>& results = m_pEngine->m_BrickBenchmarkResults;
+				for (uint32_t format = 0; format < results.size(); ++format)
+				{
+					if (results[format] > 0.0f)
+						ImGui::Text("%s: %.3f ms (%.2fx), %u bricks resident", SdfBrickFormatNames[format], results[format],
+							results[SDF_BRICK_FLOAT32] > 0.0f ? results[SDF_BRICK_FLOAT32] / results[format] : 0.0f, m_pEngine->m_BrickBenchmarkResident[format]);
+				}
+			}
+		}
+
+		ImGui::Checkbox("Generated map()", &m_pEngine->m_UseGeneratedScene);
+		ImGui::SameLine();
+		if (m_pEngine->m_GeneratedShaderReady)
+			ImGui::Text("(ready)");
+		else if (!m_pEngine->m_SceneShaderBuilds.empty())
+			ImGui::Text("(compiling...)");
+		else
+			ImGui::Text("(not available, interpreting)");
+
+		if (m_pEngine->m_SceneBenchmarkRunning)
+		{
+			ImGui::Text("Measuring the %s...", m_pEngine->m_SceneBenchmarkStep == 0 ? "interpreter" : "generated shader");
+		}
+		else if (m_pEngine->m_GeneratedShaderReady && !m_pEngine->m_BrickBenchmarkRunning)
+		{
+			if (ImGui::Button("Compare with the interpreter"))
+				m_pEngine->StartSceneBenchmark();
+
+			glm::vec2 result = m_pEngine->m_SceneBenchmarkResult;
+			if (result.y > 0.0f)
+				ImGui::Text("Interpreter: %.3f ms  Generated: %.3f ms (%.2fx)", result.x, result.y, result.x / result.y);
+		}
+	}
+
+	ImGui::End();
+}
+
+
+void ImGuiHandler::DrawStatsWindow()
+{
+	ImGui::Begin("Stats");
+
+	ImGui::Text("Compute: %.3f ms", m_pEngine->m_ComputeTimeMs);
+	ImGui::Text("Compute (average): %.3f ms", m_pEngine->m_AverageComputeTimeMs);
+
+	//Percentiles over the last frames, the p99 is the tail latency
+	const std::vector<float>& history = m_pEngine->m_ComputeTimeHistory;
+	if (!history.empty())
+	{
+		std::vector<float> sorted = history;
+		std::sort(sorted.begin(), sorted.end());
+		auto percentile = [&](float p) { return sorted[(size_t)(p * (sorted.size() - 1))]; };
+
+		ImGui::Text("p50: %.3f ms  p95: %.3f ms  p99: %.3f ms  max: %.3f ms", percentile(0.5f), percentile(0.95f), percentile(0.99f), sorted.back());
+		ImGui::PlotLines("##ComputeHistory", history.data(), (int)history.size(), (int)m_pEngine->m_ComputeTimeHistoryIndex, nullptr, 0.0f, FLT_MAX, ImVec2(0, 60));
+	}
+
+	if (m_pEngine->m_RefinementSample > 0)
+	{
+		ImGui::Text("Static scene: refining sample %u/%d", m_pEngine->m_RefinementSample + 1, m_pEngine->m_RefinementSamples);
+	}
+	else if (m_pEngine->m_PresentCachedFrame)
+	{
+		ImGui::Text("Static scene: presenting the cached frame");
+	}
+
+	ImGui::Checkbox("Count march steps", &m_pEngine->m_CollectStatistics);
+	if (m_pEngine->m_CollectStatistics)
+	{
+		ImGui::Text("Camera ray steps: %.1f per ray", m_pEngine->m_PrimaryStepsPerRay);
+		if (m_pEngine->UseEdgeSupersampling())
+		{
+			ImGui::Text("Edge pixels: %.1f%%", m_pEngine->m_EdgePixelFraction * 100.0f);
+		}
+	}
+
+	if (m_pEngine->m_LodBenchmarkRunning)
+	{
+		ImGui::Text("Measuring LOD savings...");
+	}
+	else if (ImGui::Button("Measure LOD savings"))
+	{
+		m_pEngine->StartLodBenchmark();
+	}
+	else if (!m_pEngine->m_LodBenchmarkResults.empty())
+	{
+		for (size_t i = 0; i < m_pEngine->m_LodBenchmarkResults.size(); ++i)
+		{
+			glm::vec2 steps = m_pEngine->m_LodBenchmarkResults[i];
+			ImGui::Text("Distance %.0f: %.1f -> %.1f steps per ray", LodBenchmarkDistances[i], steps.x, steps.y);
+		}
+	}
+
+	if (ImGui::Button("Reset timings"))
+	{
+		m_pEngine->ResetComputeTimings();
+	}
+
+	ImGui::End();
+}
+
+void ImGuiHandler::DrawRenderSettingsWindow()
+{
+	ImGui::Begin("Render settings");
+
+	const char* renderModes[] = { "Megakernel", "Wavefront", "Persistent threads", "Deferred", "Temporal upsampling", "Interleaved", "Foveated" };
+	int renderMode = (int)m_pEngine->m_RenderMode;
+	if (ImGui::Combo("Render mode", &renderMode, renderModes, (int)std::size(renderModes)))
+	{
+		//Start a fresh timing window so the modes can be compared
+		m_pEngine->m_RenderMode = (RenderMode)renderMode;
+		m_pEngine->ResetComputeTimings();
+	}
+
+	if (m_pEngine->m_RenderMode == RENDER_PERSISTENT)
+	{
+		ImGui::SliderInt("Workgroups", &m_pEngine->m_PersistentGroupCount, 1, 1024);
+	}
+
+	if (m_pEngine->m_RenderMode == RENDER_TEMPORAL_UPSAMPLING)
+	{
+		if (ImGui::SliderFloat("Render scale", &m_pEngine->m_RenderScale, 0.25f, 1.0f))
+		{
+			m_pEngine->ResetComputeTimings();
+		}
+	}
+	else if (m_pEngine->m_RenderMode == RENDER_INTERLEAVED)
+	{
+		const char* patterns[] = { "Checkerboard", "2x2" };
+		int pattern = (int)m_pEngine->m_InterleavePattern;
+		if (ImGui::Combo("Pattern", &pattern, patterns, (int)std::size(patterns)))
+		{
+			m_pEngine->m_InterleavePattern = (InterleavePattern)pattern;
+			m_pEngine->ResetComputeTimings();
+		}
+		ImGui::Text("Traced pixels: %d%% per frame", m_pEngine->m_InterleavePattern == INTERLEAVE_CHECKERBOARD ? 50 : 25);
+	}
+	else if (m_pEngine->m_RenderMode == RENDER_FOVEATED)
+	{
+		const char* focusSources[] = { "Screen center", "Mouse" };
+		int focusSource = (int)m_pEngine->m_FocusSource;
+		if (ImGui::Combo("Focus", &focusSource, focusSources, (int)std::size(focusSources)))
+		{
+			m_pEngine->m_FocusSource = (FocusSource)focusSource;
+		}
+		if (ImGui::SliderFloat("Full rate radius", &m_pEngine->m_FoveaInnerRadius, 0.0f, 1.0f))
+		{
+			m_pEngine->ResetComputeTimings();
+		}
+		if (ImGui::SliderFloat("Half rate radius", &m_pEngine->m_FoveaOuterRadius, 0.0f, 1.5f))
+		{
+			m_pEngine->ResetComputeTimings();
+		}
+		ImGui::Checkbox("Show rate map", &m_pEngine->m_ShowRateMap);
+		ImGui::Text("Traced pixels: %.1f%% per frame", m_pEngine->GetFoveatedRayFraction() * 100.0f);
+	}
+	else if (m_pEngine->m_RenderMode != RENDER_WAVEFRONT)
+	{
+		const char* lightingResolutions[] = { "Full", "Half", "Quarter" };
+		int lightingResolution = m_pEngine->m_LightingScale == 4 ? 2 : m_pEngine->m_LightingScale - 1;
+		if (ImGui::Combo("AO/shadow resolution", &lightingResolution, lightingResolutions, (int)std::size(lightingResolutions)))
+		{
+			m_pEngine->m_LightingScale = 1 << lightingResolution;
+			m_pEngine->ResetComputeTimings();
+		}
+	}
+
+	ImGui::Checkbox("Animate scene", &m_pEngine->m_AnimateScene);
+
+	if (m_pEngine->TracesEveryPixel())
+	{
+		if (ImGui::Checkbox("Edge supersampling", &m_pEngine->m_EdgeSupersampling))
+		{
+			m_pEngine->ResetComputeTimings();
+		}
+		if (m_pEngine->m_EdgeSupersampling)
+		{
+			ImGui::SliderInt("Rays per edge pixel", &m_pEngine->m_EdgeSamples, 1, 16);
+		}
+	}
+
+	const char* staticModes[] = { "Render every frame", "Skip frames", "Refine, then skip" };
+	int staticMode = (int)m_pEngine->m_StaticSceneMode;
+	if (ImGui::Combo("Static scene", &staticMode, staticModes, (int)std::size(staticModes)))
+	{
+		m_pEngine->m_StaticSceneMode = (StaticSceneMode)staticMode;
+	}
+	if (m_pEngine->m_StaticSceneMode == STATIC_REFINE)
+	{
+		ImGui::SliderInt("Refinement samples", &m_pEngine->m_RefinementSamples, 1, 256);
+	}
+
+	//Only used while the scene isn't animating, a moving scene makes the previous depth useless
+	if (ImGui::Checkbox("Temporal reprojection", &m_pEngine->m_TemporalReprojection))
+	{
+		m_pEngine->ResetComputeTimings();
+	}
+
+	if (ImGui::SliderInt("Sponge iterations", &m_pEngine->m_FractalIterations, 1, 6))
+	{
+		m_pEngine->ResetComputeTimings();
+	}
+	if (ImGui::Checkbox("Level of detail", &m_pEngine->m_FractalLod))
+	{
+		m_pEngine->ResetComputeTimings();
+	}
+	if (m_pEngine->m_FractalLod)
+	{
+		ImGui::SliderFloat("LOD pixel scale", &m_pEngine->m_LodPixelScale, 0.25f, 8.0f);
+	}
+
+	ImGui::Checkbox("Quality governor", &m_pEngine->m_QualityGovernor);
+	if (m_pEngine->m_QualityGovernor)
+	{
+		ImGui::SliderFloat("Target compute ms", &m_pEngine->m_TargetComputeTimeMs, 1.0f, 50.0f);
+		ImGui::Text("Quality tier: %s", QualityTiers[m_pEngine->m_QualityTier].name);
+	}
+	else
+	{
+		//Picked by hand while the governor is off
+		int tier = (int)m_pEngine->m_QualityTier;
+		if (ImGui::Combo("Quality tier", &tier, [](void*, int index, const char** name) { *name = QualityTiers[index].name; return true; }, nullptr, (int)QualityTierCount))
+		{
+			m_pEngine->m_QualityTier = (uint32_t)tier;
+			m_pEngine->ResetComputeTimings();
+		}
+	}
+
+	//Shaders without the stage constant only have the megakernel pipeline
+	if (m_pEngine->m_RenderMode != RENDER_MEGAKERNEL && m_pEngine->m_StagePipelines[STAGE_PRIMARY] == VK_NULL_HANDLE)
+	{
+		ImGui::Text("Current shader has no render stages, using the megakernel");
+	}
+
+	ImGui::End();
+}
+
+void ImGuiHandler::DrawSceneWindow()
+{
+	if (m_pEngine->m_CurrentScene.empty())
+		return;
+
+	//Every change is patched into the loaded scene right away, the generated map() is rebuilt once a field is let go
+	ImGui::Begin("Scene editor");
+
+	std::vector<std::string> materialNames = m_pEngine->m_BuiltInMaterialNames;
+	for (const SceneMaterial& material : m_pEngine->m_Scene.GetMaterials())
+		materialNames.push_back(material.name);
+
+	if (ImGui::TreeNode("Materials"))
+	{
+		const std::vector<ComputeShader::MaterialData>& materials = m_pEngine->m_ComputeShader->GetMaterialBufferData();
+		for (uint32_t i = 0; i < materials.size() && i < materialNames.size(); ++i)
+		{
+			if (!ImGui::TreeNode(materialNames[i].c_str()))
+				continue;
+
+			ComputeShader::MaterialData material = materials[i];
+			bool changed = ImGui::ColorEdit3("Color", &material.color.x);
+			changed |= ImGui::ColorEdit3("Specular", &material.specular.x);
+			if (changed)
+				m_pEngine->EditSceneMaterial(i, material);
+			ImGui::TreePop();
+		}
+		ImGui::TreePop();
+	}
+
+	DrawSceneNode(m_pEngine->m_Scene.GetRoot(), materialNames);
+
 	ImGui::End();
 }
+
+void ImGuiHandler::DrawSceneNode(const SceneNode& node, const std::vector<std::string>& materialNames)
+{
+	//Everything at the top level is added together by the root
+	const char* name = node.id == 0 ? "Scene" : SceneDescription::GetNodeName(node.opcode);
+	ImGui::PushID((int)node.id);
+	bool open = ImGui::TreeNodeEx(name, node.children.empty() ? ImGuiTreeNodeFlags_Leaf : ImGuiTreeNodeFlags_DefaultOpen);
+	if (!open)
+	{
+		ImGui::PopID();
+		return;
+	}
+
+	glm::vec4 params[2]{ node.params[0], node.params[1] };
+	uint32_t materialId = node.materialId;
+	bool changed = false;
+	bool finished = false;
+
+	//A Mesh and a Scatter only have their bounds, a Scatter has its materials in its instances
+	bool fixed = node.opcode == SCENE_OP_MESH || node.opcode == SCENE_OP_SCATTER;
+	int paramCount = fixed ? 0 : SceneDescription::GetNodeParamCount(node.opcode);
+	if (node.opcode == SCENE_OP_ROTATE_X || node.opcode == SCENE_OP_ROTATE_Y || node.opcode == SCENE_OP_ROTATE_Z)
+	{
+		changed |= ImGui::SliderAngle("Angle", &params[0].x, -180.0f, 180.0f);
+		finished |= ImGui::IsItemDeactivatedAfterEdit();
+	}
+	else
+	{
+		//Parameters in threes like the file, scales and repetition spacings have to stay positive
+		const float minPositive = 0.001f;
+		const float maxValue = SceneDescription::UnboundedExtent;
+		for (int first = 0; first < paramCount; first += 3)
+		{
+			bool positive = first == 0 && (node.opcode == SCENE_OP_SCALE || node.opcode == SCENE_OP_REPEAT || node.opcode == SCENE_OP_REPEAT_LIMITED);
+			changed |= ImGui::DragScalarN(first == 0 ? "Parameters" : "Limits", ImGuiDataType_Float, &params[first / 3].x, glm::min(paramCount - first, 3), 0.01f,
+				positive ? &minPositive : nullptr, positive ? &maxValue : nullptr, "%.3f");
+			finished |= ImGui::IsItemDeactivatedAfterEdit();
+		}
+	}
+
+	if (SceneDescription::GetNodeKind(node.opcode) == SCENE_NODE_PRIMITIVE && node.opcode != SCENE_OP_SCATTER && materialId < materialNames.size()
+		&& ImGui::BeginCombo("Material", materialNames[materialId].c_str()))
+	{
+		for (uint32_t i = 0; i < materialNames.size(); ++i)
+		{
+			if (ImGui::Selectable(materialNames[i].c_str(), i == materialId) && i != materialId)
+			{
+				materialId = i;
+				changed = true;
+				finished = true;
+			}
+		}
+		ImGui::EndCombo();
+	}
+
+	if (changed)
+		m_pEngine->EditSceneNode(node.id, params, materialId);
+	if (finished)
+		m_pEngine->FinishSceneEdit();
+
+	for (const SceneNode& child : node.children)
+		DrawSceneNode(child, materialNames);
+
+	ImGui::TreePop();
+	ImGui::PopID();
+}
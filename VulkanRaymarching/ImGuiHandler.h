@@ -2,6 +2,7 @@
 #include "imfilebrowser.h"
 
 class VkEngine;
+struct SceneNode;
 
 class ImGuiHandler
 {
@@ -11,12 +12,17 @@ public:
 	void Init();
 	void Draw();
 	void Render(VkCommandBuffer cmd);
+	bool IsIdle();
 
 private:
 	VkResult InitDescriptors();
 	void InitImgui();
 
 	void DrawShaderWindow();
+	void DrawStatsWindow();
+	void DrawRenderSettingsWindow();
+	void DrawSceneWindow();
+	void DrawSceneNode(const SceneNode& node, const std::vector<std::string>& materialNames);
 
 	VkEngine* m_pEngine;
 
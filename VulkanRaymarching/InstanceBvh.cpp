@@ -0,0 +1,261 @@
+#include "pch.h"
+#include "InstanceBvh.h"
+#include <algorithm>
+#include <future>
+#include <numeric>
+#include <thread>
+
+namespace
+{
+	const uint32_t InvalidNode = ~0u;
+
+	//Of InstanceBvh::m_NodeFlags
+	const uint8_t NodeChanged = 1;
+	const uint8_t NodeRefitting = 2;
+
+	SceneDescription::Bounds EmptyBounds()
+	{
+		return { glm::vec3(std::numeric_limits<float>::max()), glm::vec3(std::numeric_limits<float>::lowest()) };
+	}
+
+	void Grow(SceneDescription::Bounds& bounds, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+	{
+		bounds.min = glm::min(bounds.min, boundsMin);
+		bounds.max = glm::max(bounds.max, boundsMax);
+	}
+
+	//Half the surface area, the SAH only compares them
+	float HalfArea(const SceneDescription::Bounds& bounds)
+	{
+		glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(0.0f));
+		return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+	}
+
+	SceneDescription::Bounds InstanceBounds(const SceneInstance& instance, float time)
+	{
+		glm::vec3 center = instance.GetPosition(time);
+		float radius = instance.radius * instance.positionScale.w;
+		return { center - radius, center + radius };
+	}
+}
+
+InstanceBvh::InstanceBvh(const std::vector<SceneInstance>& instances, float time, uint32_t threadCount)
+	: m_Time(time)
+{
+	uint32_t instanceCount = (uint32_t)instances.size();
+	if (instanceCount == 0)
+		return;
+
+	float averageRadius = 0.0f;
+	m_InstanceBounds.resize(instanceCount);
+	m_Centers.resize(instanceCount);
+	for (uint32_t i = 0; i < instanceCount; ++i)
+	{
+		m_InstanceBounds[i] = InstanceBounds(instances[i], time);
+		m_Centers[i] = (m_InstanceBounds[i].min + m_InstanceBounds[i].max) * 0.5f;
+		averageRadius += instances[i].radius * instances[i].positionScale.w;
+		if (instances[i].bobHeight != 0.0f)
+			m_MovingInstances.push_back(i);
+	}
+	m_Margin = MarginRadii * averageRadius / (float)instanceCount;
+
+	//Every split gets its children from the counter, so the subtrees built in parallel never write to the same nodes
+	if (threadCount == 0)
+		threadCount = glm::max(std::thread::hardware_concurrency(), 1u);
+	uint32_t parallelDepth = 0;
+	while ((1u << parallelDepth) < threadCount)
+		++parallelDepth;
+
+	m_Indices.resize(instanceCount);
+	std::iota(m_Indices.begin(), m_Indices.end(), 0u);
+	m_Nodes.resize(2 * instanceCount - 1);
+	m_NodeCount = 1;
+	m_Depth = Build(0, 0, instanceCount, 0, parallelDepth);
+	m_Nodes.resize(m_NodeCount);
+
+	m_InstanceBounds.clear();
+	m_InstanceBounds.shrink_to_fit();
+	m_Centers.clear();
+	m_Centers.shrink_to_fit();
+
+	//Children are always taken after their parent, so going backwards through the nodes refits them bottom up
+	m_Parents.assign(m_Nodes.size(), InvalidNode);
+	m_InstanceLeaves.resize(instanceCount);
+	for (uint32_t node = 0; node < (uint32_t)m_Nodes.size(); ++node)
+	{
+		const Node& current = m_Nodes[node];
+		if (current.count == 0)
+		{
+			m_Parents[current.first] = node;
+			m_Parents[current.first + 1] = node;
+		}
+		for (uint32_t i = current.first; current.count > 0 && i < current.first + current.count; ++i)
+			m_InstanceLeaves[m_Indices[i]] = node;
+	}
+	m_NodeFlags.assign(m_Nodes.size(), 0);
+}
+
+uint32_t InstanceBvh::Build(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth, uint32_t parallelDepth)
+{
+	SceneDescription::Bounds bounds = EmptyBounds();
+	SceneDescription::Bounds centerBounds = EmptyBounds();
+	for (uint32_t i = first; i < first + count; ++i)
+	{
+		uint32_t instance = m_Indices[i];
+		Grow(bounds, m_InstanceBounds[instance].min, m_InstanceBounds[instance].max);
+		Grow(centerBounds, m_Centers[instance], m_Centers[instance]);
+	}
+
+	Node& node = m_Nodes[nodeIndex];
+	node.boundsMin = bounds.min;
+	node.boundsMax = bounds.max;
+
+	//Binned SAH over all three axes, the split with the smallest area times instances on both sides wins
+	glm::vec3 centerExtent = centerBounds.max - centerBounds.min;
+	int bestAxis = -1;
+	uint32_t bestSplit = 0;
+	float bestCost = std::numeric_limits<float>::max();
+	for (int axis = 0; count > LeafSize && depth + 1 < MaxDepth && axis < 3; ++axis)
+	{
+		if (centerExtent[axis] <= 0.0f)
+			continue;
+
+		SceneDescription::Bounds binBounds[BinCount];
+		uint32_t binCounts[BinCount]{};
+		std::fill(std::begin(binBounds), std::end(binBounds), EmptyBounds());
+		float binScale = (float)BinCount / centerExtent[axis];
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			uint32_t instance = m_Indices[i];
+			uint32_t bin = glm::min((uint32_t)((m_Centers[instance][axis] - centerBounds.min[axis]) * binScale), BinCount - 1);
+			Grow(binBounds[bin], m_InstanceBounds[instance].min, m_InstanceBounds[instance].max);
+			++binCounts[bin];
+		}
+
+		//Everything right of a split, then sweep from the left
+		float rightCosts[BinCount]{};
+		SceneDescription::Bounds right = EmptyBounds();
+		uint32_t rightCount = 0;
+		for (uint32_t bin = BinCount - 1; bin > 0; --bin)
+		{
+			Grow(right, binBounds[bin].min, binBounds[bin].max);
+			rightCount += binCounts[bin];
+			rightCosts[bin - 1] = rightCount > 0 ? HalfArea(right) * (float)rightCount : -1.0f;
+		}
+
+		SceneDescription::Bounds left = EmptyBounds();
+		uint32_t leftCount = 0;
+		for (uint32_t split = 0; split + 1 < BinCount; ++split)
+		{
+			Grow(left, binBounds[split].min, binBounds[split].max);
+			leftCount += binCounts[split];
+			if (leftCount == 0 || rightCosts[split] < 0.0f)
+				continue;
+
+			float cost = HalfArea(left) * (float)leftCount + rightCosts[split];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = split;
+			}
+		}
+	}
+
+	//Small enough, too deep or every center in the same place
+	if (bestAxis < 0)
+	{
+		node.first = first;
+		node.count = count;
+		return depth + 1;
+	}
+
+	float binScale = (float)BinCount / centerExtent[bestAxis];
+	float splitMin = centerBounds.min[bestAxis];
+	uint32_t* middle = std::partition(m_Indices.data() + first, m_Indices.data() + first + count, [&](uint32_t instance)
+		{
+			return glm::min((uint32_t)((m_Centers[instance][bestAxis] - splitMin) * binScale), BinCount - 1) <= bestSplit;
+		});
+	uint32_t leftCount = (uint32_t)(middle - (m_Indices.data() + first));
+
+	uint32_t children = m_NodeCount.fetch_add(2);
+	node.first = children;
+	node.count = 0;
+
+	if (depth < parallelDepth && count >= ParallelInstances)
+	{
+		std::future<uint32_t> leftDepth = std::async(std::launch::async, [=]() { return Build(children, first, leftCount, depth + 1, parallelDepth); });
+		uint32_t rightDepth = Build(children + 1, first + leftCount, count - leftCount, depth + 1, parallelDepth);
+		return glm::max(leftDepth.get(), rightDepth);
+	}
+
+	uint32_t leftDepth = Build(children, first, leftCount, depth + 1, parallelDepth);
+	return glm::max(leftDepth, Build(children + 1, first + leftCount, count - leftCount, depth + 1, parallelDepth));
+}
+
+bool InstanceBvh::Refit(const std::vector<SceneInstance>& instances, float time)
+{
+	if (m_MovingInstances.empty() || time == m_Time)
+		return false;
+	m_Time = time;
+
+	//Every leaf with a bobbing instance, then every node above them once
+	std::vector<uint32_t> refitted;
+	for (uint32_t instance : m_MovingInstances)
+	{
+		for (uint32_t node = m_InstanceLeaves[instance]; node != InvalidNode && !(m_NodeFlags[node] & NodeRefitting); node = m_Parents[node])
+		{
+			m_NodeFlags[node] |= NodeRefitting;
+			refitted.push_back(node);
+		}
+	}
+
+	std::sort(refitted.begin(), refitted.end(), std::greater<uint32_t>());
+	for (uint32_t node : refitted)
+	{
+		Node& current = m_Nodes[node];
+		if (current.count > 0)
+			FitLeaf(instances, node, time);
+		else
+		{
+			const Node& left = m_Nodes[current.first];
+			const Node& right = m_Nodes[current.first + 1];
+			current.boundsMin = glm::min(left.boundsMin, right.boundsMin);
+			current.boundsMax = glm::max(left.boundsMax, right.boundsMax);
+		}
+
+		m_NodeFlags[node] &= ~NodeRefitting;
+		MarkChanged(node);
+	}
+
+	std::sort(m_ChangedNodes.begin(), m_ChangedNodes.end());
+	return true;
+}
+
+void InstanceBvh::FitLeaf(const std::vector<SceneInstance>& instances, uint32_t leaf, float time)
+{
+	SceneDescription::Bounds bounds = EmptyBounds();
+	Node& node = m_Nodes[leaf];
+	for (uint32_t i = node.first; i < node.first + node.count; ++i)
+	{
+		SceneDescription::Bounds instance = InstanceBounds(instances[m_Indices[i]], time);
+		Grow(bounds, instance.min, instance.max);
+	}
+	node.boundsMin = bounds.min;
+	node.boundsMax = bounds.max;
+}
+
+void InstanceBvh::MarkChanged(uint32_t node)
+{
+	if (m_NodeFlags[node] & NodeChanged)
+		return;
+	m_NodeFlags[node] |= NodeChanged;
+	m_ChangedNodes.push_back(node);
+}
+
+void InstanceBvh::ClearChanges()
+{
+	for (uint32_t node : m_ChangedNodes)
+		m_NodeFlags[node] &= ~NodeChanged;
+	m_ChangedNodes.clear();
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include "SceneDescription.h"
+
+//Bounding volume hierarchy over the instances of a Scatter node. Trace() in the shader walks it with a stretch of its ray to list the
+//instances that come within the margin of the ray and only evaluates those while it marches that stretch, which holds up where the
+//instances are spread too unevenly for the grid.
+//Built with binned SAH, the subtrees near the top in parallel. Refit() only moves the boxes of the bobbing instances and the nodes
+//above them and remembers which nodes changed, so only those have to be uploaded.
+class InstanceBvh
+{
+public:
+	//std430 layout of a node, the two children are next to each other like in the triangle BVH of MeshSdfBaker
+	struct Node
+	{
+		glm::vec3 boundsMin;
+		uint32_t first;	//First child, or the first index of a leaf
+		glm::vec3 boundsMax;
+		uint32_t count;	//Instances of a leaf, 0 for an inner node
+	};
+
+	//std430 start of the node buffer, the nodes follow it
+	struct Header
+	{
+		glm::mat4 worldToLocal;	//Into the space of the Scatter node, only moves, turns and scales evenly so a ray keeps its distances
+		float margin;	//In the space of the Scatter node, the instances further from a ray than this aren't listed for it
+		uint32_t nodeCount;	//0 when the rays can't use the tree, without instances or when the Scatter is repeated
+		float time;	//The bobbing instances are where they were at this time, the nodes are fitted to it
+		uint32_t padding;
+	};
+
+	static const uint32_t LeafSize = 4;
+	static const uint32_t BinCount = 16;
+
+	//Nodes this deep become leaves however many instances they have, the traversal stack in the shader fits the depth
+	static const uint32_t MaxDepth = 32;
+
+	//Subtrees with fewer instances are built on the thread that split them off
+	static const uint32_t ParallelInstances = 4096;
+
+	//Average instance radii, a wider margin lists more instances per ray but lets the empty stretches take larger steps
+	static constexpr float MarginRadii = 2.0f;
+
+	//With the instances where they are at time. A thread count of 0 uses every core.
+	InstanceBvh(const std::vector<SceneInstance>& instances, float time, uint32_t threadCount = 0);
+
+	//Fits the boxes of the bobbing instances and the nodes above them to time, returns whether any of them changed
+	bool Refit(const std::vector<SceneInstance>& instances, float time);
+
+	const std::vector<Node>& GetNodes() const { return m_Nodes; }
+	const std::vector<uint32_t>& GetIndices() const { return m_Indices; }
+	float GetMargin() const { return m_Margin; }
+	float GetTime() const { return m_Time; }
+	uint32_t GetDepth() const { return m_Depth; }
+
+	//Nodes refitted since the last ClearChanges(), in order
+	const std::vector<uint32_t>& GetChangedNodes() const { return m_ChangedNodes; }
+	void ClearChanges();
+
+private:
+	//Returns the depth of the deepest leaf below the node
+	uint32_t Build(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth, uint32_t parallelDepth);
+	void FitLeaf(const std::vector<SceneInstance>& instances, uint32_t leaf, float time);
+	void MarkChanged(uint32_t node);
+
+	std::vector<Node> m_Nodes;
+	std::vector<uint32_t> m_Indices;
+	float m_Margin = 1.0f;
+	float m_Time = 0.0f;
+	uint32_t m_Depth = 0;
+
+	//Only while building
+	std::vector<SceneDescription::Bounds> m_InstanceBounds;
+	std::vector<glm::vec3> m_Centers;
+	std::atomic<uint32_t> m_NodeCount{ 0 };
+
+	std::vector<uint32_t> m_Parents;
+	std::vector<uint32_t> m_InstanceLeaves;
+	std::vector<uint32_t> m_MovingInstances;
+	std::vector<uint8_t> m_NodeFlags;
+	std::vector<uint32_t> m_ChangedNodes;
+};
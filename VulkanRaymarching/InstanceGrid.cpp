@@ -0,0 +1,81 @@
+#include "pch.h"
+#include "InstanceGrid.h"
+
+InstanceGrid InstanceGrid::Build(const std::vector<SceneInstance>& instances)
+{
+	InstanceGrid grid;
+	if (instances.empty())
+	{
+		grid.header.boundsMin = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		grid.header.boundsMax = glm::vec4(1.0f, 1.0f, 1.0f, 0.5f);
+		grid.header.cellCount = glm::uvec4(1);
+		grid.cellOffsets = { 0, 0 };
+		return grid;
+	}
+
+	glm::vec3 boundsMin{ std::numeric_limits<float>::max() };
+	glm::vec3 boundsMax{ std::numeric_limits<float>::lowest() };
+	float averageRadius = 0.0f;
+	for (const SceneInstance& instance : instances)
+	{
+		//The sphere around the base position that also holds the bobbing
+		float radius = instance.radius * instance.positionScale.w;
+		boundsMin = glm::min(boundsMin, glm::vec3(instance.positionScale) - (radius + instance.bobHeight));
+		boundsMax = glm::max(boundsMax, glm::vec3(instance.positionScale) + (radius + instance.bobHeight));
+		averageRadius += radius;
+	}
+	averageRadius /= (float)instances.size();
+
+	//Cells much smaller than the instances would list every instance in lots of them
+	glm::vec3 extent = glm::max(boundsMax - boundsMin, glm::vec3(0.001f));
+	float cellSize = glm::max(glm::pow(extent.x * extent.y * extent.z / ((float)instances.size() * InstancesPerCell), 1.0f / 3.0f), averageRadius);
+	glm::uvec3 cellCount;
+	while (true)
+	{
+		cellCount = glm::max(glm::uvec3(glm::ceil(extent / cellSize)), glm::uvec3(1));
+		if ((uint64_t)cellCount.x * cellCount.y * cellCount.z <= MaxCells)
+			break;
+		cellSize *= 1.25f;
+	}
+
+	float margin = 0.5f * cellSize;
+	uint32_t totalCells = cellCount.x * cellCount.y * cellCount.z;
+	grid.header.boundsMin = glm::vec4(boundsMin, cellSize);
+	grid.header.boundsMax = glm::vec4(boundsMin + glm::vec3(cellCount) * cellSize, margin);
+	grid.header.cellCount = glm::uvec4(cellCount, totalCells);
+
+	//Counted first and filled in the same order after, so every cell lists its instances in order
+	auto forEachCell = [&](const SceneInstance& instance, auto&& function)
+	{
+		glm::vec3 center{ instance.positionScale };
+		float reach = instance.radius * instance.positionScale.w + instance.bobHeight + margin;
+		glm::uvec3 first{ glm::clamp(glm::ivec3(glm::floor((center - reach - boundsMin) / cellSize)), glm::ivec3(0), glm::ivec3(cellCount) - 1) };
+		glm::uvec3 last{ glm::clamp(glm::ivec3(glm::floor((center + reach - boundsMin) / cellSize)), glm::ivec3(0), glm::ivec3(cellCount) - 1) };
+		for (uint32_t z = first.z; z <= last.z; ++z)
+		{
+			for (uint32_t y = first.y; y <= last.y; ++y)
+			{
+				for (uint32_t x = first.x; x <= last.x; ++x)
+				{
+					//The corners of the range are often out of reach of the sphere
+					glm::vec3 cellMin = boundsMin + glm::vec3(x, y, z) * cellSize;
+					if (glm::length(center - glm::clamp(center, cellMin, cellMin + cellSize)) <= reach)
+						function(x + cellCount.x * (y + cellCount.y * z));
+				}
+			}
+		}
+	};
+
+	grid.cellOffsets.assign(totalCells + 1, 0);
+	for (const SceneInstance& instance : instances)
+		forEachCell(instance, [&](uint32_t cell) { ++grid.cellOffsets[cell + 1]; });
+	for (uint32_t cell = 0; cell < totalCells; ++cell)
+		grid.cellOffsets[cell + 1] += grid.cellOffsets[cell];
+
+	std::vector<uint32_t> fill(grid.cellOffsets.begin(), grid.cellOffsets.end() - 1);
+	grid.indices.resize(grid.cellOffsets.back());
+	for (uint32_t i = 0; i < (uint32_t)instances.size(); ++i)
+		forEachCell(instances[i], [&](uint32_t cell) { grid.indices[fill[cell]++] = i; });
+
+	return grid;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "SceneDescription.h"
+
+//Uniform grid over the instances of a Scatter node, so a sample point only evaluates the instances around it instead of all of them.
+//A cell lists every instance whose bounding sphere comes closer to it than the margin wherever it bobs to, so it never has to be rebuilt. Anything it doesn't list is further away than
+//the margin from every point in the cell, so the closest listed instance, capped at the margin, never oversteps.
+struct InstanceGrid
+{
+	//std430 start of the grid buffer, the cell offsets and then the instance indices follow it
+	struct Header
+	{
+		glm::vec4 boundsMin;	//w is the size of a cell
+		glm::vec4 boundsMax;	//w is the margin
+		glm::uvec4 cellCount;	//w is the number of cells
+	};
+
+	//Keeps the offsets of instances that are spread out very thinly at 16 MB
+	static const uint32_t MaxCells = 1 << 22;
+
+	//Instances per cell by their centers, the margin lists every instance in a few more
+	static constexpr float InstancesPerCell = 1.0f;
+
+	Header header{};
+	std::vector<uint32_t> cellOffsets;	//One more than there are cells, cell i lists indices[cellOffsets[i]] up to indices[cellOffsets[i + 1]]
+	std::vector<uint32_t> indices;
+
+	uint32_t GetBufferSize() const { return (uint32_t)(sizeof(Header) + (cellOffsets.size() + indices.size()) * sizeof(uint32_t)); }
+
+	//Without instances the grid is a single empty cell, so the shader never has to check
+	static InstanceGrid Build(const std::vector<SceneInstance>& instances);
+};
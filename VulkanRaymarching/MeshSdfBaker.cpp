@@ -0,0 +1,713 @@
+#include "pch.h"
+#include "MeshSdfBaker.h"
+#include "tiny_obj_loader.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+namespace
+{
+	struct Triangle
+	{
+		glm::vec3 v0;
+		glm::vec3 v1;
+		glm::vec3 v2;
+	};
+
+	//Node of the triangle BVH, the two children are next to each other so a node only keeps the index of the first.
+	//The area weighted normal and the center are the dipole that stands in for all triangles below the node in the winding number.
+	struct BvhNode
+	{
+		glm::vec3 boundsMin;
+		uint32_t first;		//First child, or the first triangle of a leaf
+		glm::vec3 boundsMax;
+		uint32_t count;		//Triangles of a leaf, 0 for an inner node
+		glm::vec3 areaNormal;
+		float radius;		//Furthest a vertex below the node gets from the center
+		glm::vec3 center;
+	};
+
+	const uint32_t LeafSize = 4;
+	const uint32_t TraversalStackSize = 64;
+
+	//Empty voxels around the mesh, the shader clamps to the edge of the volume so the surface can't touch it
+	const uint32_t BorderVoxels = 2;
+
+	//Nodes further away than this many radii count as one dipole in the winding number
+	const float DipoleDistance = 2.0f;
+
+	//Closest point on a triangle, from Real-Time Collision Detection (Ericson) 5.1.5
+	glm::vec3 ClosestPointOnTriangle(const glm::vec3& p, const Triangle& triangle)
+	{
+		const glm::vec3& a = triangle.v0;
+		const glm::vec3& b = triangle.v1;
+		const glm::vec3& c = triangle.v2;
+
+		glm::vec3 ab = b - a;
+		glm::vec3 ac = c - a;
+		glm::vec3 ap = p - a;
+		float d1 = glm::dot(ab, ap);
+		float d2 = glm::dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f)
+			return a;
+
+		glm::vec3 bp = p - b;
+		float d3 = glm::dot(ab, bp);
+		float d4 = glm::dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3)
+			return b;
+
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+			return a + ab * (d1 / (d1 - d3));
+
+		glm::vec3 cp = p - c;
+		float d5 = glm::dot(ab, cp);
+		float d6 = glm::dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6)
+			return c;
+
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+			return a + ac * (d2 / (d2 - d6));
+
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+			return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+		float denominator = 1.0f / (va + vb + vc);
+		return a + ab * (vb * denominator) + ac * (vc * denominator);
+	}
+
+	//Signed solid angle of a triangle seen from p (Van Oosterom and Strackee), positive when p is behind its front face
+	float SolidAngle(const glm::vec3& p, const Triangle& triangle)
+	{
+		glm::vec3 a = triangle.v0 - p;
+		glm::vec3 b = triangle.v1 - p;
+		glm::vec3 c = triangle.v2 - p;
+		float la = glm::length(a);
+		float lb = glm::length(b);
+		float lc = glm::length(c);
+
+		float numerator = glm::dot(a, glm::cross(b, c));
+		float denominator = la * lb * lc + glm::dot(a, b) * lc + glm::dot(b, c) * la + glm::dot(c, a) * lb;
+		return 2.0f * atan2(numerator, denominator);
+	}
+
+	float BoxDistanceSquared(const glm::vec3& p, const BvhNode& node)
+	{
+		glm::vec3 outside = glm::max(glm::max(node.boundsMin - p, p - node.boundsMax), glm::vec3(0.0f));
+		return glm::dot(outside, outside);
+	}
+
+	class TriangleBvh
+	{
+	public:
+		explicit TriangleBvh(std::vector<Triangle>&& triangles)
+			: m_Triangles(std::move(triangles))
+		{
+			m_Nodes.reserve(m_Triangles.size() * 2);
+			m_Nodes.resize(1);
+			Build(0, 0, (uint32_t)m_Triangles.size());
+		}
+
+		//Anything at or beyond maxDistanceSquared is skipped, maxDistanceSquared itself comes back when nothing is closer
+		float ClosestDistanceSquared(const glm::vec3& p, float maxDistanceSquared) const
+		{
+			float best = maxDistanceSquared;
+			uint32_t stack[TraversalStackSize];
+			uint32_t stackSize = 0;
+			stack[stackSize++] = 0;
+
+			while (stackSize > 0)
+			{
+				const BvhNode& node = m_Nodes[stack[--stackSize]];
+				if (BoxDistanceSquared(p, node) >= best)
+					continue;
+
+				if (node.count > 0)
+				{
+					for (uint32_t i = node.first; i < node.first + node.count; ++i)
+					{
+						glm::vec3 offset = ClosestPointOnTriangle(p, m_Triangles[i]) - p;
+						best = glm::min(best, glm::dot(offset, offset));
+					}
+					continue;
+				}
+
+				//The nearer child goes on top so it's visited first and prunes more of the other one
+				uint32_t nearChild = node.first;
+				uint32_t farChild = node.first + 1;
+				float nearDistance = BoxDistanceSquared(p, m_Nodes[nearChild]);
+				float farDistance = BoxDistanceSquared(p, m_Nodes[farChild]);
+				if (farDistance < nearDistance)
+				{
+					std::swap(nearChild, farChild);
+					std::swap(nearDistance, farDistance);
+				}
+
+				if (farDistance < best)
+					stack[stackSize++] = farChild;
+				if (nearDistance < best)
+					stack[stackSize++] = nearChild;
+			}
+			return best;
+		}
+
+		//Generalized winding number (Jacobson et al.), 1 inside a closed mesh and 0 outside. Far nodes use the dipole
+		//approximation of Barill et al. so a point costs about as much as a closest point query.
+		float WindingNumber(const glm::vec3& p) const
+		{
+			float solidAngle = 0.0f;
+			uint32_t stack[TraversalStackSize];
+			uint32_t stackSize = 0;
+			stack[stackSize++] = 0;
+
+			while (stackSize > 0)
+			{
+				const BvhNode& node = m_Nodes[stack[--stackSize]];
+				glm::vec3 offset = node.center - p;
+				float distance = glm::length(offset);
+
+				if (node.count > 0)
+				{
+					for (uint32_t i = node.first; i < node.first + node.count; ++i)
+						solidAngle += SolidAngle(p, m_Triangles[i]);
+				}
+				else if (distance > DipoleDistance * node.radius)
+					solidAngle += glm::dot(offset, node.areaNormal) / (distance * distance * distance);
+				else
+				{
+					stack[stackSize++] = node.first;
+					stack[stackSize++] = node.first + 1;
+				}
+			}
+			return solidAngle / (4.0f * glm::pi<float>());
+		}
+
+	private:
+		void Build(uint32_t nodeIndex, uint32_t first, uint32_t count)
+		{
+			BvhNode node{};
+			node.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+			node.boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+			glm::vec3 centroidMin = node.boundsMin;
+			glm::vec3 centroidMax = node.boundsMax;
+
+			float area = 0.0f;
+			glm::vec3 weightedCenter{ 0.0f };
+			for (uint32_t i = first; i < first + count; ++i)
+			{
+				const Triangle& triangle = m_Triangles[i];
+				node.boundsMin = glm::min(node.boundsMin, glm::min(triangle.v0, glm::min(triangle.v1, triangle.v2)));
+				node.boundsMax = glm::max(node.boundsMax, glm::max(triangle.v0, glm::max(triangle.v1, triangle.v2)));
+
+				glm::vec3 centroid = (triangle.v0 + triangle.v1 + triangle.v2) / 3.0f;
+				centroidMin = glm::min(centroidMin, centroid);
+				centroidMax = glm::max(centroidMax, centroid);
+
+				glm::vec3 areaNormal = 0.5f * glm::cross(triangle.v1 - triangle.v0, triangle.v2 - triangle.v0);
+				float triangleArea = glm::length(areaNormal);
+				node.areaNormal += areaNormal;
+				weightedCenter += centroid * triangleArea;
+				area += triangleArea;
+			}
+
+			node.center = area > 0.0f ? weightedCenter / area : (node.boundsMin + node.boundsMax) * 0.5f;
+			for (uint32_t i = first; i < first + count; ++i)
+			{
+				const Triangle& triangle = m_Triangles[i];
+				node.radius = glm::max(node.radius, glm::max(glm::distance(node.center, triangle.v0), glm::max(glm::distance(node.center, triangle.v1), glm::distance(node.center, triangle.v2))));
+			}
+
+			//Split at the median centroid of the longest axis, triangles that all share a centroid stay one leaf
+			glm::vec3 centroidExtent = centroidMax - centroidMin;
+			int axis = centroidExtent.x > centroidExtent.y ? (centroidExtent.x > centroidExtent.z ? 0 : 2) : (centroidExtent.y > centroidExtent.z ? 1 : 2);
+			if (count <= LeafSize || centroidExtent[axis] <= 0.0f)
+			{
+				node.first = first;
+				node.count = count;
+				m_Nodes[nodeIndex] = node;
+				return;
+			}
+
+			uint32_t half = count / 2;
+			std::nth_element(m_Triangles.begin() + first, m_Triangles.begin() + first + half, m_Triangles.begin() + first + count,
+				[axis](const Triangle& a, const Triangle& b)
+				{
+					return a.v0[axis] + a.v1[axis] + a.v2[axis] < b.v0[axis] + b.v1[axis] + b.v2[axis];
+				});
+
+			uint32_t children = (uint32_t)m_Nodes.size();
+			m_Nodes.resize(m_Nodes.size() + 2);
+			node.first = children;
+			node.count = 0;
+			m_Nodes[nodeIndex] = node;
+
+			Build(children, first, half);
+			Build(children + 1, first + half, count - half);
+		}
+
+		std::vector<Triangle> m_Triangles;
+		std::vector<BvhNode> m_Nodes;
+	};
+
+	//Hands the indices out one at a time so every thread keeps busy no matter how the work is spread over them
+	template<typename Function>
+	void ParallelFor(uint32_t count, uint32_t threadCount, const Function& function)
+	{
+		std::atomic<uint32_t> next{ 0 };
+		auto work = [&]()
+		{
+			for (uint32_t i = next++; i < count; i = next++)
+				function(i);
+		};
+
+		std::vector<std::thread> workers;
+		for (uint32_t i = 1; i < threadCount; ++i)
+			workers.emplace_back(work);
+		work();
+		for (std::thread& worker : workers)
+			worker.join();
+	}
+
+	//searchDistanceSquared has to be at least the squared distance, it's updated for the next point one voxel further
+	float SignedDistance(const TriangleBvh& bvh, const glm::vec3& point, float voxelSize, float& searchDistanceSquared)
+	{
+		float distance = sqrt(bvh.ClosestDistanceSquared(point, searchDistanceSquared));
+		searchDistanceSquared = (distance + voxelSize) * (distance + voxelSize) * 1.001f;
+
+		//-1 inside a mesh that's turned inside out
+		return abs(bvh.WindingNumber(point)) > 0.5f ? -distance : distance;
+	}
+
+	//Range of the samples of a brick. When it spans the surface it's widened by at most one code so 0 is a code of its own,
+	//otherwise rounding towards 0 would have to flip the sign of the samples closest to the surface
+	glm::vec2 GetBrickRange(const float* samples, uint32_t maxCode)
+	{
+		glm::vec2 range{ *std::min_element(samples, samples + SdfBrickMap::BrickSampleCount), *std::max_element(samples, samples + SdfBrickMap::BrickSampleCount) };
+		if (range.x < 0.0f && range.y > 0.0f)
+		{
+			float step = (range.y - range.x) / (float)(maxCode - 1);
+			range.x = -ceil(-range.x / step) * step;
+			range.y = range.x + (float)maxCode * step;
+		}
+		return range;
+	}
+
+	//Code of a sample normalized to range, rounded towards 0 so the decoded distance never passes the sample
+	uint32_t QuantizeTowardsZero(float distance, const glm::vec2& range, uint32_t maxCode)
+	{
+		float scale = range.y - range.x;
+		if (scale <= 0.0f)
+			return 0;
+
+		float code = (distance - range.x) / scale * (float)maxCode;
+		code = distance >= 0.0f ? floor(code) : ceil(code);
+		return (uint32_t)glm::clamp(code, 0.0f, (float)maxCode);
+	}
+
+	//Normalized values of a BC4 block with red0 > red1, which gives 6 interpolated ones. EncodeBc4Block() never writes the other mode
+	void GetBc4Palette(uint32_t red0, uint32_t red1, float palette[8])
+	{
+		palette[0] = (float)red0 / 255.0f;
+		palette[1] = (float)red1 / 255.0f;
+		for (uint32_t i = 2; i < 8; ++i)
+			palette[i] = (float)((8 - i) * red0 + (i - 1) * red1) / (7.0f * 255.0f);
+	}
+
+	//Sample of texel i of the 4x4 block (blockX, blockY) in slice z
+	uint32_t GetBc4Sample(uint32_t z, uint32_t blockX, uint32_t blockY, uint32_t i)
+	{
+		return (z * SdfBrickMap::BrickSize + blockY * 4 + i / 4) * SdfBrickMap::BrickSize + blockX * 4 + i % 4;
+	}
+
+	void EncodeBc4Block(const float distances[16], const glm::vec2& range, uint8_t* block)
+	{
+		//The endpoints enclose every sample, so rounding towards 0 always has a palette entry to go to
+		float scale = glm::max(range.y - range.x, 1e-30f);
+		float blockMin = *std::min_element(distances, distances + 16);
+		float blockMax = *std::max_element(distances, distances + 16);
+		uint32_t red1 = (uint32_t)glm::clamp(floor((blockMin - range.x) / scale * 255.0f), 0.0f, 255.0f);
+		uint32_t red0 = (uint32_t)glm::clamp(ceil((blockMax - range.x) / scale * 255.0f), 0.0f, 255.0f);
+		if (red0 == red1)
+			red0 < 255 ? ++red0 : --red1;
+
+		//A block on the surface gets the narrowest wider endpoints that put 0 on an interpolated entry of the palette, so the samples
+		//next to the surface don't have to round past it. Entry 8 - j is red1 + j / 7 of the way to red0
+		if (blockMin < 0.0f && blockMax > 0.0f)
+		{
+			int zero = (int)round(-range.x / scale * 255.0f);
+			int minHigh = (int)red0;
+			int bestSpan = 256;
+			for (int low = (int)red1; low >= 0; --low)
+			{
+				for (int j = 1; j < 7; ++j)
+				{
+					int high = low + 7 * (zero - low) / j;
+					if (7 * (zero - low) % j == 0 && high >= minHigh && high <= 255 && high - low < bestSpan)
+					{
+						bestSpan = high - low;
+						red0 = (uint32_t)high;
+						red1 = (uint32_t)low;
+					}
+				}
+			}
+		}
+
+		float palette[8];
+		GetBc4Palette(red0, red1, palette);
+
+		uint64_t indices = 0;
+		for (uint32_t i = 0; i < 16; ++i)
+		{
+			float distance = distances[i];
+			uint32_t best = 0;
+			float bestError = std::numeric_limits<float>::max();
+			for (uint32_t entry = 0; entry < 8; ++entry)
+			{
+				float decoded = range.x + palette[entry] * (range.y - range.x);
+				bool towardsZero = distance >= 0.0f ? decoded <= distance : decoded >= distance;
+				float error = abs(decoded - distance) + (towardsZero ? 0.0f : 1e30f);
+				if (error < bestError)
+				{
+					bestError = error;
+					best = entry;
+				}
+			}
+			indices |= (uint64_t)best << (3 * i);
+		}
+
+		block[0] = (uint8_t)red0;
+		block[1] = (uint8_t)red1;
+		for (uint32_t byte = 0; byte < 6; ++byte)
+			block[2 + byte] = (uint8_t)(indices >> (8 * byte));
+	}
+}
+
+SdfBrickMap MeshSdfBaker::Bake(const std::string& objFile, uint32_t resolution, uint32_t threadCount)
+{
+	auto loadStart = std::chrono::high_resolution_clock::now();
+
+	//Materials of the mesh aren't used, the scene gives it one
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string warning;
+	std::string error;
+	std::string materialDirectory = std::filesystem::path(objFile).parent_path().string() + "/";
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warning, &error, objFile.c_str(), materialDirectory.c_str()))
+		throw std::runtime_error("MeshSdfBaker::Bake() >> Failed to load " + objFile + ": " + error);
+
+	std::vector<Triangle> triangles;
+	glm::vec3 meshMin{ std::numeric_limits<float>::max() };
+	glm::vec3 meshMax{ std::numeric_limits<float>::lowest() };
+	for (const tinyobj::shape_t& shape : shapes)
+	{
+		//LoadObj triangulates the faces
+		for (size_t i = 0; i + 2 < shape.mesh.indices.size(); i += 3)
+		{
+			glm::vec3 vertices[3];
+			for (int corner = 0; corner < 3; ++corner)
+			{
+				size_t vertex = 3 * (size_t)shape.mesh.indices[i + corner].vertex_index;
+				vertices[corner] = glm::vec3(attrib.vertices[vertex], attrib.vertices[vertex + 1], attrib.vertices[vertex + 2]);
+				meshMin = glm::min(meshMin, vertices[corner]);
+				meshMax = glm::max(meshMax, vertices[corner]);
+			}
+			triangles.push_back({ vertices[0], vertices[1], vertices[2] });
+		}
+	}
+
+	if (triangles.empty())
+		throw std::runtime_error("MeshSdfBaker::Bake() >> " + objFile + " doesn't contain any triangles");
+
+	//Cubic voxels, the longest axis gets the resolution and the mesh is centered in the others
+	const uint32_t cellVoxels = SdfBrickMap::BrickSize - 1;
+	resolution = glm::clamp(resolution, MinResolution, MaxResolution);
+	glm::vec3 meshExtent = meshMax - meshMin;
+	float voxelSize = glm::max(glm::max(meshExtent.x, glm::max(meshExtent.y, meshExtent.z)), 1e-6f) / (float)(resolution - 2 * BorderVoxels);
+
+	SdfBrickMap brickMap;
+	brickMap.voxelSize = voxelSize;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		uint32_t voxels = glm::min((uint32_t)glm::ceil(meshExtent[axis] / voxelSize) + 2 * BorderVoxels, resolution);
+		brickMap.cellCount[axis] = (voxels + cellVoxels - 1) / cellVoxels;
+	}
+
+	glm::vec3 center = (meshMin + meshMax) * 0.5f;
+	glm::vec3 halfExtent = glm::vec3(brickMap.cellCount * cellVoxels) * voxelSize * 0.5f;
+	brickMap.boundsMin = center - halfExtent;
+	brickMap.boundsMax = center + halfExtent;
+
+	size_t triangleCount = triangles.size();
+	auto buildStart = std::chrono::high_resolution_clock::now();
+	TriangleBvh bvh{ std::move(triangles) };
+	auto bakeStart = std::chrono::high_resolution_clock::now();
+
+	if (threadCount == 0)
+		threadCount = glm::max(std::thread::hardware_concurrency(), 1u);
+
+	//A cell whose center is further from the surface than half its diagonal plus the band can't need a brick, and that
+	//distance minus half the diagonal holds for all of it. Every other cell gets its brick baked.
+	const float band = BrickBandVoxels * voxelSize;
+	const float cellRadius = 0.5f * sqrt(3.0f) * cellVoxels * voxelSize;
+	uint32_t cellCount = brickMap.cellCount.x * brickMap.cellCount.y * brickMap.cellCount.z;
+	brickMap.cells.resize(cellCount);
+
+	std::vector<uint32_t> candidates;
+	{
+		std::vector<float> centerDistances(cellCount);
+		ParallelFor(cellCount, threadCount, [&](uint32_t cell)
+			{
+				glm::uvec3 coordinate{ cell % brickMap.cellCount.x, (cell / brickMap.cellCount.x) % brickMap.cellCount.y, cell / (brickMap.cellCount.x * brickMap.cellCount.y) };
+				glm::vec3 cellCenter = brickMap.boundsMin + (glm::vec3(coordinate) + 0.5f) * (float)cellVoxels * voxelSize;
+				float searchDistanceSquared = std::numeric_limits<float>::max();
+				centerDistances[cell] = SignedDistance(bvh, cellCenter, voxelSize, searchDistanceSquared);
+			});
+
+		for (uint32_t cell = 0; cell < cellCount; ++cell)
+		{
+			float margin = abs(centerDistances[cell]) - cellRadius;
+			if (margin >= band)
+				brickMap.cells[cell] = SdfBrickMap::EncodeDistance(centerDistances[cell] > 0.0f ? margin : -margin);
+			else
+				candidates.push_back(cell);
+		}
+	}
+
+	//The bricks share their border samples with their neighbours, so the samples are the corners of the voxels
+	brickMap.bricks.resize((size_t)candidates.size() * SdfBrickMap::BrickSampleCount);
+	std::vector<float> closestSamples(candidates.size());
+	ParallelFor((uint32_t)candidates.size(), threadCount, [&](uint32_t candidate)
+		{
+			uint32_t cell = candidates[candidate];
+			glm::uvec3 firstSample = glm::uvec3(cell % brickMap.cellCount.x, (cell / brickMap.cellCount.x) % brickMap.cellCount.y, cell / (brickMap.cellCount.x * brickMap.cellCount.y)) * cellVoxels;
+			float* samples = brickMap.bricks.data() + (size_t)candidate * SdfBrickMap::BrickSampleCount;
+
+			float closest = std::numeric_limits<float>::max();
+			for (uint32_t z = 0; z < SdfBrickMap::BrickSize; ++z)
+			{
+				for (uint32_t y = 0; y < SdfBrickMap::BrickSize; ++y)
+				{
+					float searchDistanceSquared = std::numeric_limits<float>::max();
+					for (uint32_t x = 0; x < SdfBrickMap::BrickSize; ++x)
+					{
+						glm::vec3 point = brickMap.boundsMin + glm::vec3(firstSample + glm::uvec3(x, y, z)) * voxelSize;
+						float distance = SignedDistance(bvh, point, voxelSize, searchDistanceSquared);
+						*samples++ = distance;
+						closest = glm::min(closest, abs(distance));
+					}
+				}
+			}
+			closestSamples[candidate] = closest;
+		});
+
+	//Candidates that turn out to stay clear of the band are empty after all, every point of them is within half a voxel diagonal of a sample
+	uint32_t brickCount = 0;
+	for (uint32_t candidate = 0; candidate < (uint32_t)candidates.size(); ++candidate)
+	{
+		uint32_t cell = candidates[candidate];
+		float* samples = brickMap.bricks.data() + (size_t)candidate * SdfBrickMap::BrickSampleCount;
+		if (closestSamples[candidate] >= band)
+		{
+			float margin = closestSamples[candidate] - 0.5f * sqrt(3.0f) * voxelSize;
+			brickMap.cells[cell] = SdfBrickMap::EncodeDistance(samples[0] > 0.0f ? margin : -margin);
+			continue;
+		}
+
+		//Without its brick the cell only keeps rays out, if the surface can pass through it that makes it a solid block
+		float margin = glm::max(closestSamples[candidate] - 0.5f * sqrt(3.0f) * voxelSize, 0.0f);
+		brickMap.brickCells.push_back(cell);
+		brickMap.brickFallbacks.push_back(SdfBrickMap::EncodeDistance(samples[0] > 0.0f ? margin : -margin));
+
+		if (brickCount != candidate)
+			std::copy(samples, samples + SdfBrickMap::BrickSampleCount, brickMap.bricks.data() + (size_t)brickCount * SdfBrickMap::BrickSampleCount);
+		brickMap.cells[cell] = SdfBrickMap::EncodeBrick(brickCount++);
+	}
+	brickMap.bricks.resize((size_t)brickCount * SdfBrickMap::BrickSampleCount);
+	brickMap.bricks.shrink_to_fit();
+
+	auto bakeEnd = std::chrono::high_resolution_clock::now();
+	auto milliseconds = [](auto start, auto end) { return std::chrono::duration<float, std::milli>(end - start).count(); };
+	glm::uvec3 samples = brickMap.cellCount * cellVoxels + 1u;
+	float denseMegabytes = (float)samples.x * samples.y * samples.z * sizeof(float) / (1024.0f * 1024.0f);
+	float sparseMegabytes = (float)(brickMap.bricks.size() * sizeof(float) + brickMap.cells.size() * sizeof(uint32_t)) / (1024.0f * 1024.0f);
+	std::cout << "Baked " << objFile << " (" << triangleCount << " triangles) at " << samples.x << "x" << samples.y << "x" << samples.z << ": "
+		<< brickCount << " of " << cellCount << " cells have a brick, " << sparseMegabytes << " MB instead of " << denseMegabytes << " MB dense\n"
+		<< "  load " << milliseconds(loadStart, buildStart) << " ms, BVH " << milliseconds(buildStart, bakeStart) << " ms, bake " << milliseconds(bakeStart, bakeEnd)
+		<< " ms on " << threadCount << " threads\n";
+
+	return brickMap;
+}
+
+uint32_t MeshSdfBaker::GetBrickBytes(SdfBrickFormat format)
+{
+	switch (format)
+	{
+	case SDF_BRICK_UNORM16: return SdfBrickMap::BrickSampleCount * sizeof(uint16_t);
+	case SDF_BRICK_UNORM8: return SdfBrickMap::BrickSampleCount;
+	case SDF_BRICK_BC4: return SdfBrickMap::BrickSampleCount / 16 * 8;
+	default: return SdfBrickMap::BrickSampleCount * sizeof(float);
+	}
+}
+
+glm::vec2 MeshSdfBaker::EncodeBrick(const float* samples, SdfBrickFormat format, uint8_t* encoded)
+{
+	const uint32_t sampleCount = SdfBrickMap::BrickSampleCount;
+	if (format == SDF_BRICK_FLOAT32)
+	{
+		memcpy(encoded, samples, sampleCount * sizeof(float));
+		return glm::vec2(0.0f, 1.0f);
+	}
+
+	//BC4 endpoints are 8 bit
+	glm::vec2 range = GetBrickRange(samples, format == SDF_BRICK_UNORM16 ? 65535 : 255);
+	switch (format)
+	{
+	case SDF_BRICK_UNORM16:
+		for (uint32_t i = 0; i < sampleCount; ++i)
+		{
+			uint16_t code = (uint16_t)QuantizeTowardsZero(samples[i], range, 65535);
+			memcpy(encoded + i * sizeof(uint16_t), &code, sizeof(uint16_t));
+		}
+		break;
+	case SDF_BRICK_UNORM8:
+		for (uint32_t i = 0; i < sampleCount; ++i)
+			encoded[i] = (uint8_t)QuantizeTowardsZero(samples[i], range, 255);
+		break;
+	default:
+	{
+		//Blocks in the order a copy into the image expects them, row by row per slice
+		const uint32_t blocksPerRow = SdfBrickMap::BrickSize / 4;
+		for (uint32_t z = 0; z < SdfBrickMap::BrickSize; ++z)
+		{
+			for (uint32_t blockY = 0; blockY < blocksPerRow; ++blockY)
+			{
+				for (uint32_t blockX = 0; blockX < blocksPerRow; ++blockX)
+				{
+					float distances[16];
+					for (uint32_t i = 0; i < 16; ++i)
+						distances[i] = samples[GetBc4Sample(z, blockX, blockY, i)];
+					EncodeBc4Block(distances, range, encoded);
+					encoded += 8;
+				}
+			}
+		}
+		break;
+	}
+	}
+	return range;
+}
+
+void MeshSdfBaker::DecodeBrick(const uint8_t* encoded, SdfBrickFormat format, const glm::vec2& range, float* samples)
+{
+	const uint32_t sampleCount = SdfBrickMap::BrickSampleCount;
+	float scale = range.y - range.x;
+	switch (format)
+	{
+	case SDF_BRICK_FLOAT32:
+		memcpy(samples, encoded, sampleCount * sizeof(float));
+		break;
+	case SDF_BRICK_UNORM16:
+		for (uint32_t i = 0; i < sampleCount; ++i)
+		{
+			uint16_t code;
+			memcpy(&code, encoded + i * sizeof(uint16_t), sizeof(uint16_t));
+			samples[i] = range.x + (float)code / 65535.0f * scale;
+		}
+		break;
+	case SDF_BRICK_UNORM8:
+		for (uint32_t i = 0; i < sampleCount; ++i)
+			samples[i] = range.x + (float)encoded[i] / 255.0f * scale;
+		break;
+	default:
+	{
+		const uint32_t blocksPerRow = SdfBrickMap::BrickSize / 4;
+		for (uint32_t z = 0; z < SdfBrickMap::BrickSize; ++z)
+		{
+			for (uint32_t blockY = 0; blockY < blocksPerRow; ++blockY)
+			{
+				for (uint32_t blockX = 0; blockX < blocksPerRow; ++blockX)
+				{
+					float palette[8];
+					GetBc4Palette(encoded[0], encoded[1], palette);
+					uint64_t indices = 0;
+					for (uint32_t byte = 0; byte < 6; ++byte)
+						indices |= (uint64_t)encoded[2 + byte] << (8 * byte);
+
+					for (uint32_t i = 0; i < 16; ++i)
+						samples[GetBc4Sample(z, blockX, blockY, i)] = range.x + palette[(indices >> (3 * i)) & 7] * scale;
+					encoded += 8;
+				}
+			}
+		}
+		break;
+	}
+	}
+}
+
+SdfCellMips MeshSdfBaker::BuildCellMips(const glm::uvec3& cellCount, const uint32_t* cells)
+{
+	std::vector<float> level(cellCount.x * cellCount.y * cellCount.z);
+	for (size_t cell = 0; cell < level.size(); ++cell)
+	{
+		uint32_t entry = cells[cell];
+		if (entry & 1u)
+			level[cell] = 0.0f;
+		else
+			memcpy(&level[cell], &entry, sizeof(float));
+	}
+
+	//Halving rounds down on every level, so there are floor(log2(largest extent)) levels and the image can hold them all as mips
+	SdfCellMips mips;
+	glm::uvec3 extent = cellCount;
+	do
+	{
+		glm::uvec3 coarseExtent = glm::max(extent / 2u, glm::uvec3(1u));
+		size_t levelStart = mips.texels.size();
+		mips.texels.resize(levelStart + (size_t)coarseExtent.x * coarseExtent.y * coarseExtent.z);
+		for (uint32_t z = 0; z < coarseExtent.z; ++z)
+		{
+			for (uint32_t y = 0; y < coarseExtent.y; ++y)
+			{
+				for (uint32_t x = 0; x < coarseExtent.x; ++x)
+				{
+					//The last texel of an odd axis has three children on it, or the single one of an axis that's 1 wide
+					glm::uvec3 begin{ 2 * x, 2 * y, 2 * z };
+					glm::uvec3 end = glm::min(begin + 2u, extent);
+					if (x == coarseExtent.x - 1) end.x = extent.x;
+					if (y == coarseExtent.y - 1) end.y = extent.y;
+					if (z == coarseExtent.z - 1) end.z = extent.z;
+
+					float smallest = std::numeric_limits<float>::max();
+					float largest = -std::numeric_limits<float>::max();
+					for (uint32_t fineZ = begin.z; fineZ < end.z; ++fineZ)
+					{
+						for (uint32_t fineY = begin.y; fineY < end.y; ++fineY)
+						{
+							for (uint32_t fineX = begin.x; fineX < end.x; ++fineX)
+							{
+								float distance = level[((size_t)fineZ * extent.y + fineY) * extent.x + fineX];
+								smallest = glm::min(smallest, distance);
+								largest = glm::max(largest, distance);
+							}
+						}
+					}
+
+					float distance = smallest > 0.0f ? smallest : largest < 0.0f ? largest : 0.0f;
+					mips.texels[levelStart + ((size_t)z * coarseExtent.y + y) * coarseExtent.x + x] = distance;
+				}
+			}
+		}
+
+		mips.extents.push_back(coarseExtent);
+		level.assign(mips.texels.begin() + levelStart, mips.texels.end());
+		extent = coarseExtent;
+	} while (extent.x > 1 || extent.y > 1 || extent.z > 1);
+
+	return mips;
+}
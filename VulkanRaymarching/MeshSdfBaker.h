@@ -0,0 +1,95 @@
+#pragma once
+#include <cstring>
+#include <string>
+
+//How the samples of a brick are stored. Every format but Float32 is normalized to the range of its brick, so they all decode
+//as range.x + value * (range.y - range.x) and the range of a Float32 brick is (0, 1).
+enum SdfBrickFormat : uint32_t
+{
+	SDF_BRICK_FLOAT32,
+	SDF_BRICK_UNORM16,
+	SDF_BRICK_UNORM8,
+	SDF_BRICK_BC4,	//8 bytes per 4x4 block of a slice
+	SDF_BRICK_FORMAT_COUNT
+};
+
+static const char* const SdfBrickFormatNames[SDF_BRICK_FORMAT_COUNT] = { "Float32", "Unorm16", "Unorm8", "BC4" };
+
+//Sparse signed distance volume, negative inside the mesh and in the units of the mesh.
+//The volume is split into cells of BrickSize - 1 voxels and only the cells near the surface get a brick of BrickSize^3 samples at the
+//corners of their voxels. Neighbouring bricks share their border samples, so filtering inside a brick never needs another one.
+//Every other cell stores one distance that holds for any point in it.
+struct SdfBrickMap
+{
+	static const uint32_t BrickSize = 8;
+	static const uint32_t BrickSampleCount = BrickSize * BrickSize * BrickSize;
+
+	glm::uvec3 cellCount{ 0 };
+	glm::vec3 boundsMin{ 0.0f };	//First sample of the first cell
+	glm::vec3 boundsMax{ 0.0f };	//Last sample of the last cell
+	float voxelSize = 0.0f;
+
+	//One entry per cell with x fastest: (brick << 1) | 1 for a cell with a brick, otherwise the bits of its distance with the lowest one
+	//cleared, which only ever moves the distance towards 0
+	std::vector<uint32_t> cells;
+	std::vector<float> bricks;	//BrickSampleCount samples per brick, x fastest
+
+	//Per brick, the cell it belongs to and the encoded distance that cell can hold instead while the brick isn't on the GPU
+	std::vector<uint32_t> brickCells;
+	std::vector<uint32_t> brickFallbacks;
+
+	uint32_t GetBrickCount() const { return (uint32_t)(bricks.size() / BrickSampleCount); }
+
+	static uint32_t EncodeBrick(uint32_t brick) { return (brick << 1) | 1u; }
+	static uint32_t EncodeDistance(float distance)
+	{
+		uint32_t bits;
+		memcpy(&bits, &distance, sizeof(bits));
+		return bits & ~1u;
+	}
+
+	//Bricks per axis of a 3D atlas that fits brickCount of them
+	static glm::uvec3 GetAtlasLayout(uint32_t brickCount)
+	{
+		uint32_t side = glm::max((uint32_t)glm::ceil(glm::pow((float)brickCount, 1.0f / 3.0f)), 1u);
+		return { side, side, glm::max((brickCount + side * side - 1) / (side * side), 1u) };
+	}
+};
+
+//Coarser versions of the cells of an SdfBrickMap, level k covers 2^k cells per axis. Every level halves the extent of the one
+//before rounding down, like Vulkan sizes mips, so the last texel of an odd axis also takes the cell left over. The levels stop
+//once every axis is 1 texel wide. A texel holds a distance that holds for every point in it, the smallest of its cells when
+//they're all outside the mesh, the largest when they're all inside and 0 when it reaches the surface, so it never overestimates.
+struct SdfCellMips
+{
+	std::vector<glm::uvec3> extents;	//From level 1
+	std::vector<float> texels;	//Every level after the other, x fastest
+};
+
+//Turns an OBJ mesh into a sparse signed distance volume on the CPU.
+//The distance is the closest point on any triangle, found through a BVH over the triangles. The sign comes from the
+//generalized winding number, approximated far away with the same BVH, so meshes with holes, overlapping parts or inverted normals still get a sensible inside.
+class MeshSdfBaker
+{
+public:
+	//Resolution of the longest axis, the others get the same voxel size. Only the bricks near the surface are baked, so the
+	//time and memory grow with the area of the mesh rather than the volume.
+	static const uint32_t MinResolution = 8;
+	static const uint32_t MaxResolution = 1024;
+
+	//Cells with a sample closer to the surface than this many voxels get a brick
+	static constexpr float BrickBandVoxels = 2.0f;
+
+	//Throws std::runtime_error when the mesh can't be loaded. A thread count of 0 uses every core.
+	static SdfBrickMap Bake(const std::string& objFile, uint32_t resolution, uint32_t threadCount = 0);
+
+	static uint32_t GetBrickBytes(SdfBrickFormat format);
+
+	//Encodes the BrickSampleCount samples of a brick and returns the range they're normalized to. Every sample is rounded towards 0,
+	//or past it where a BC4 block has nothing in between, so a quantized brick never lets a ray step further than the float one would.
+	static glm::vec2 EncodeBrick(const float* samples, SdfBrickFormat format, uint8_t* encoded);
+	static void DecodeBrick(const uint8_t* encoded, SdfBrickFormat format, const glm::vec2& range, float* samples);
+
+	//From the page table with nothing resident, like SdfBrickFile::GetCells(). A cell with a brick counts as being on the surface
+	static SdfCellMips BuildCellMips(const glm::uvec3& cellCount, const uint32_t* cells);
+};
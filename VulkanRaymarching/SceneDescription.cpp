@@ -0,0 +1,777 @@
+#include "pch.h"
+#include "SceneDescription.h"
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+namespace
+{
+	struct Token
+	{
+		std::string text;
+		int line;
+	};
+
+	//Keywords of the nodes, parameter i is stored in params[i / 3][i % 3] so vectors never straddle the two vec4s
+	struct NodeKeyword
+	{
+		const char* name;
+		SceneOpcode opcode;
+		int paramCount;
+	};
+
+	const NodeKeyword NodeKeywords[] =
+	{
+		{ "Sphere", SCENE_OP_SPHERE, 1 },
+		{ "Box", SCENE_OP_BOX, 3 },
+		{ "RoundBox", SCENE_OP_ROUND_BOX, 4 },
+		{ "Cylinder", SCENE_OP_CYLINDER, 2 },
+		{ "Plane", SCENE_OP_PLANE, 0 },
+		{ "Mesh", SCENE_OP_MESH, 0 },	//Followed by the file and resolution, see ParseMesh()
+		{ "Additive", SCENE_OP_ADDITIVE, 0 },
+		{ "Subtractive", SCENE_OP_SUBTRACTIVE, 0 },
+		{ "Intersect", SCENE_OP_INTERSECT, 0 },
+		{ "SmoothAdditive", SCENE_OP_SMOOTH_ADDITIVE, 1 },
+		{ "SmoothSubtractive", SCENE_OP_SMOOTH_SUBTRACTIVE, 1 },
+		{ "SmoothIntersect", SCENE_OP_SMOOTH_INTERSECT, 1 },
+		{ "Translate", SCENE_OP_TRANSLATE, 3 },
+		{ "RotateX", SCENE_OP_ROTATE_X, 1 },
+		{ "RotateY", SCENE_OP_ROTATE_Y, 1 },
+		{ "RotateZ", SCENE_OP_ROTATE_Z, 1 },
+		{ "Scale", SCENE_OP_SCALE, 1 },
+		{ "Repeat", SCENE_OP_REPEAT, 3 },
+		{ "RepeatLimited", SCENE_OP_REPEAT_LIMITED, 6 },
+		{ "Scatter", SCENE_OP_SCATTER, 6 }	//Followed by its templates, see ParseScatter()
+	};
+
+	const NodeKeyword* FindKeyword(SceneOpcode opcode)
+	{
+		for (const NodeKeyword& keyword : NodeKeywords)
+		{
+			if (keyword.opcode == opcode)
+				return &keyword;
+		}
+		return nullptr;
+	}
+
+	//Empty when the parameters are valid for the node
+	std::string CheckParams(SceneOpcode opcode, const glm::vec4 params[2])
+	{
+		switch (opcode)
+		{
+		case SCENE_OP_SCALE:
+			if (params[0].x <= 0.0f)
+				return "Scale has to be positive";
+			break;
+		case SCENE_OP_REPEAT:
+		case SCENE_OP_REPEAT_LIMITED:
+			if (glm::any(glm::lessThanEqual(glm::vec3(params[0]), glm::vec3(0.0f))))
+				return "Repetition spacing has to be positive";
+			break;
+		default:
+			break;
+		}
+		return "";
+	}
+
+	class SceneParser
+	{
+	public:
+		SceneParser(const std::vector<Token>& tokens, std::vector<std::string>& materialNames, const std::string& sceneFile)
+			: m_Tokens(tokens), m_MaterialNames(materialNames), m_SceneFile(sceneFile)
+		{
+		}
+
+		bool IsDone() const { return m_Index >= m_Tokens.size(); }
+		const Token& Peek() const { return m_Tokens[m_Index]; }
+
+		const Token& Next(const char* expected)
+		{
+			if (IsDone())
+				Fail(m_Tokens.empty() ? 0 : m_Tokens.back().line, std::string("Expected ") + expected + " at the end of the file");
+			return m_Tokens[m_Index++];
+		}
+
+		float NextFloat()
+		{
+			const Token& token = Next("a number");
+			try
+			{
+				size_t length;
+				float value = std::stof(token.text, &length);
+				if (length == token.text.size())
+					return value;
+			}
+			catch (const std::exception&) {}
+
+			Fail(token.line, "Expected a number but got '" + token.text + "'");
+			return 0.0f;
+		}
+
+		uint32_t NextMaterial()
+		{
+			const Token& token = Next("a material name");
+			for (size_t i = 0; i < m_MaterialNames.size(); ++i)
+			{
+				if (m_MaterialNames[i] == token.text)
+					return (uint32_t)i;
+			}
+
+			Fail(token.line, "Unknown material '" + token.text + "'");
+			return 0;
+		}
+
+		SceneMaterial ParseMaterial()
+		{
+			const Token& name = Next("a material name");
+			for (const std::string& existing : m_MaterialNames)
+			{
+				if (existing == name.text)
+					Fail(name.line, "Material '" + name.text + "' is defined twice");
+			}
+
+			SceneMaterial material;
+			material.name = name.text;
+			material.color = glm::vec4(1.0f);
+			material.specular = glm::vec4(1.0f);
+			for (int i = 0; i < 3; ++i)
+				material.color[i] = NextFloat();
+			for (int i = 0; i < 3; ++i)
+				material.specular[i] = NextFloat();
+			m_MaterialNames.push_back(material.name);
+			return material;
+		}
+
+		SceneNode ParseNode()
+		{
+			const Token& keywordToken = Next("a node");
+			const NodeKeyword* keyword = nullptr;
+			for (const NodeKeyword& candidate : NodeKeywords)
+			{
+				if (keywordToken.text == candidate.name)
+					keyword = &candidate;
+			}
+			if (!keyword)
+				Fail(keywordToken.line, "Unknown node '" + keywordToken.text + "'");
+
+			SceneNode node;
+			node.opcode = keyword->opcode;
+			for (int i = 0; i < keyword->paramCount; ++i)
+				node.params[i / 3][i % 3] = NextFloat();
+
+			if (node.opcode == SCENE_OP_MESH)
+				ParseMesh(keywordToken);
+
+			if (node.opcode == SCENE_OP_ROTATE_X || node.opcode == SCENE_OP_ROTATE_Y || node.opcode == SCENE_OP_ROTATE_Z)
+				node.params[0].x = glm::radians(node.params[0].x);
+
+			std::string error = CheckParams(node.opcode, node.params);
+			if (!error.empty())
+				Fail(keywordToken.line, error);
+
+			if (node.opcode == SCENE_OP_SCATTER)
+			{
+				ParseScatter(node, keywordToken);
+				return node;
+			}
+
+			if (SceneDescription::GetNodeKind(node.opcode) == SCENE_NODE_PRIMITIVE)
+			{
+				node.materialId = NextMaterial();
+				return node;
+			}
+
+			//Operators and transforms have their children between braces
+			const Token& open = Next("'{'");
+			if (open.text != "{")
+				Fail(open.line, "Expected '{' after " + keywordToken.text + " but got '" + open.text + "'");
+
+			while (Next("'}'").text != "}")
+			{
+				--m_Index;
+				node.children.push_back(ParseNode());
+			}
+
+			if (node.children.empty())
+				Fail(keywordToken.line, keywordToken.text + " needs at least one child");
+
+			return node;
+		}
+
+		//Every Mesh node has to use the same file, they share the one volume
+		void ParseMesh(const Token& keywordToken)
+		{
+			const Token& file = Next("a mesh file");
+			float resolution = NextFloat();
+			if (resolution < 1.0f)
+				Fail(keywordToken.line, "Mesh resolution has to be positive");
+
+			std::string meshFile = (std::filesystem::path(m_SceneFile).parent_path() / file.text).lexically_normal().generic_string();
+			if (!m_MeshFile.empty() && (meshFile != m_MeshFile || (uint32_t)resolution != m_MeshResolution))
+				Fail(keywordToken.line, "Only one mesh and resolution per scene is supported");
+
+			m_MeshFile = meshFile;
+			m_MeshResolution = (uint32_t)resolution;
+		}
+
+		//The templates are plain primitives between braces, every instance takes one of them at random. The node gets the bounds of the instances.
+		void ParseScatter(SceneNode& node, const Token& keywordToken)
+		{
+			float count = node.params[0].x;
+			glm::vec3 size{ node.params[0].y, node.params[0].z, node.params[1].x };
+			float minScale = node.params[1].y;
+			float maxScale = node.params[1].z;
+
+			float moving = 0.0f;
+			float bobHeight = 0.0f;
+			if (!IsDone() && Peek().text != "{")
+			{
+				moving = NextFloat();
+				bobHeight = NextFloat();
+			}
+			if (m_HasScatter)
+				Fail(keywordToken.line, "Only one Scatter per scene is supported");
+			if (count < 1.0f || count > (float)SceneDescription::MaxInstances)
+				Fail(keywordToken.line, "Scatter needs between 1 and " + std::to_string(SceneDescription::MaxInstances) + " instances");
+			if (glm::any(glm::lessThan(size, glm::vec3(0.0f))))
+				Fail(keywordToken.line, "Scatter size can't be negative");
+			if (minScale <= 0.0f || maxScale < minScale)
+				Fail(keywordToken.line, "Scatter scales have to be positive and the smallest first");
+			if (moving < 0.0f || moving > count || bobHeight < 0.0f)
+				Fail(keywordToken.line, "Scatter can move between 0 and all of its instances by a height that isn't negative");
+			m_HasScatter = true;
+
+			const Token& open = Next("'{'");
+			if (open.text != "{")
+				Fail(open.line, "Expected '{' after Scatter but got '" + open.text + "'");
+
+			std::vector<SceneNode> templates;
+			while (Next("'}'").text != "}")
+			{
+				--m_Index;
+				int line = Peek().line;
+				templates.push_back(ParseNode());
+				SceneOpcode opcode = templates.back().opcode;
+				if (SceneDescription::GetNodeKind(opcode) != SCENE_NODE_PRIMITIVE || opcode == SCENE_OP_PLANE || opcode == SCENE_OP_MESH || opcode == SCENE_OP_SCATTER)
+					Fail(line, "Scatter can only place spheres, boxes, round boxes and cylinders");
+			}
+
+			if (templates.empty())
+				Fail(keywordToken.line, "Scatter needs at least one template");
+
+			//A fixed seed and one draw per statement, so every compiler lays the scene out the same way
+			std::mt19937 random(1);
+			std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+			std::uniform_int_distribution<size_t> pick(0, templates.size() - 1);
+			SceneDescription::Bounds bounds{ glm::vec3(std::numeric_limits<float>::max()), glm::vec3(std::numeric_limits<float>::lowest()) };
+			m_Instances.resize((size_t)count);
+			for (size_t i = 0; i < m_Instances.size(); ++i)
+			{
+				SceneInstance& instance = m_Instances[i];
+				const SceneNode& shape = templates[pick(random)];
+				SceneDescription::Bounds shapeBounds = SceneDescription::CalculateNodeBounds(shape);
+
+				glm::vec3 position;
+				for (int axis = 0; axis < 3; ++axis)
+					position[axis] = unit(random) * size[axis];
+				float scale = glm::mix(minScale, maxScale, unit(random));
+
+				instance.positionScale = glm::vec4(position, scale);
+				instance.params = glm::vec4(glm::vec3(shape.params[0]), shape.params[1].x);
+				instance.opcode = shape.opcode;
+				instance.materialId = shape.materialId;
+				instance.rotation = unit(random) * glm::two_pi<float>();
+				instance.radius = glm::length(glm::max(glm::abs(shapeBounds.min), glm::abs(shapeBounds.max)));
+				instance.bobPhase = unit(random) * glm::two_pi<float>();
+				instance.bobHeight = i < (size_t)moving ? bobHeight : 0.0f;
+
+				glm::vec3 reach = glm::vec3(instance.radius * scale) + glm::vec3(0.0f, instance.bobHeight, 0.0f);
+				bounds.min = glm::min(bounds.min, position - reach);
+				bounds.max = glm::max(bounds.max, position + reach);
+			}
+
+			node.params[0] = glm::vec4(bounds.min, 0.0f);
+			node.params[1] = glm::vec4(bounds.max, 0.0f);
+		}
+
+		const std::string& GetMeshFile() const { return m_MeshFile; }
+		uint32_t GetMeshResolution() const { return m_MeshResolution; }
+		std::vector<SceneInstance>& GetInstances() { return m_Instances; }
+
+		[[noreturn]] static void Fail(int line, const std::string& message)
+		{
+			throw std::runtime_error("SceneDescription::LoadFromFile() >> " + message + " on line " + std::to_string(line));
+		}
+
+	private:
+		const std::vector<Token>& m_Tokens;
+		std::vector<std::string>& m_MaterialNames;
+		size_t m_Index = 0;
+
+		std::string m_SceneFile;
+		std::string m_MeshFile;
+		uint32_t m_MeshResolution = 0;
+
+		bool m_HasScatter = false;
+		std::vector<SceneInstance> m_Instances;
+	};
+
+	SceneDescription::Bounds UnionBounds(const SceneDescription::Bounds& a, const SceneDescription::Bounds& b)
+	{
+		return { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+	}
+
+	SceneDescription::Bounds IntersectBounds(const SceneDescription::Bounds& a, const SceneDescription::Bounds& b)
+	{
+		SceneDescription::Bounds result{ glm::max(a.min, b.min), glm::min(a.max, b.max) };
+
+		//Keep an empty intersection a valid (degenerate) box
+		result.max = glm::max(result.max, result.min);
+		return result;
+	}
+
+	void AssignMeshBounds(SceneNode& node, const SceneDescription::Bounds& bounds)
+	{
+		if (node.opcode == SCENE_OP_MESH)
+		{
+			node.params[0] = glm::vec4(bounds.min, 0.0f);
+			node.params[1] = glm::vec4(bounds.max, 0.0f);
+		}
+
+		for (SceneNode& child : node.children)
+			AssignMeshBounds(child, bounds);
+	}
+
+	uint32_t AssignNodeIds(SceneNode& node, uint32_t id)
+	{
+		node.id = id++;
+		for (SceneNode& child : node.children)
+			id = AssignNodeIds(child, id);
+		return id;
+	}
+
+	SceneNode* FindNode(SceneNode& node, uint32_t id)
+	{
+		if (node.id == id)
+			return &node;
+
+		//The ids of a subtree are consecutive, so only one child can have it
+		for (size_t i = 0; i < node.children.size(); ++i)
+		{
+			if (i + 1 == node.children.size() || node.children[i + 1].id > id)
+				return FindNode(node.children[i], id);
+		}
+		return nullptr;
+	}
+
+	SceneDescription::Instruction GetNodeInstruction(const SceneNode& node)
+	{
+		SceneDescription::Instruction instruction{};
+		instruction.opcode = node.opcode;
+		instruction.materialId = node.materialId;
+		instruction.params[0] = node.params[0];
+		instruction.params[1] = node.params[1];
+		return instruction;
+	}
+
+	//Restores the sample point after the children of a transform, a scaled distance has to be scaled back
+	SceneDescription::Instruction GetPopInstruction(const SceneNode& node)
+	{
+		SceneDescription::Instruction pop{};
+		pop.opcode = SCENE_OP_POP_TRANSFORM;
+		pop.params[0].x = node.opcode == SCENE_OP_SCALE ? node.params[0].x : 1.0f;
+		return pop;
+	}
+
+	//Composes the transforms above the Scatter node, repeated is set when one of them is a repetition
+	bool FindScatterSpace(const SceneNode& node, const glm::mat4& worldToNode, bool repeated, glm::mat4& worldToLocal, bool& localRepeated)
+	{
+		if (node.opcode == SCENE_OP_SCATTER)
+		{
+			worldToLocal = worldToNode;
+			localRepeated = repeated;
+			return true;
+		}
+
+		//The same as the interpreter does to the sample point, see CollectMeshSpacePoints()
+		const glm::vec4& p0 = node.params[0];
+		glm::mat4 transform{ 1.0f };
+		switch (node.opcode)
+		{
+		case SCENE_OP_TRANSLATE:
+			transform = glm::translate(glm::mat4(1.0f), -glm::vec3(p0));
+			break;
+		case SCENE_OP_ROTATE_X:
+		case SCENE_OP_ROTATE_Y:
+		case SCENE_OP_ROTATE_Z:
+		{
+			glm::vec3 axis = node.opcode == SCENE_OP_ROTATE_X ? glm::vec3(1, 0, 0) : node.opcode == SCENE_OP_ROTATE_Y ? glm::vec3(0, 1, 0) : glm::vec3(0, 0, 1);
+			transform = glm::rotate(glm::mat4(1.0f), -p0.x, axis);
+			break;
+		}
+		case SCENE_OP_SCALE:
+			transform = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f / p0.x));
+			break;
+		case SCENE_OP_REPEAT:
+		case SCENE_OP_REPEAT_LIMITED:
+			repeated = true;
+			break;
+		default:
+			break;
+		}
+
+		for (const SceneNode& child : node.children)
+		{
+			if (FindScatterSpace(child, transform * worldToNode, repeated, worldToLocal, localRepeated))
+				return true;
+		}
+		return false;
+	}
+
+	//Same transforms as the interpreter applies to the sample point
+	void CollectMeshSpacePoints(const SceneNode& node, glm::vec3 point, float scale, std::vector<glm::vec4>& points)
+	{
+		const glm::vec4& p0 = node.params[0];
+		switch (node.opcode)
+		{
+		case SCENE_OP_MESH:
+			points.push_back(glm::vec4(point, scale));
+			return;
+		case SCENE_OP_TRANSLATE:
+			point -= glm::vec3(p0);
+			break;
+		case SCENE_OP_ROTATE_X:
+		case SCENE_OP_ROTATE_Y:
+		case SCENE_OP_ROTATE_Z:
+		{
+			glm::vec3 axis = node.opcode == SCENE_OP_ROTATE_X ? glm::vec3(1, 0, 0) : node.opcode == SCENE_OP_ROTATE_Y ? glm::vec3(0, 1, 0) : glm::vec3(0, 0, 1);
+			point = glm::mat3(glm::rotate(glm::mat4(1.0f), -p0.x, axis)) * point;
+			break;
+		}
+		case SCENE_OP_SCALE:
+			point /= p0.x;
+			scale *= p0.x;
+			break;
+		case SCENE_OP_REPEAT:
+			point = glm::mod(glm::abs(point) + 0.5f * glm::vec3(p0), glm::vec3(p0)) - 0.5f * glm::vec3(p0);
+			break;
+		case SCENE_OP_REPEAT_LIMITED:
+			point -= glm::vec3(p0) * glm::clamp(glm::round(point / glm::vec3(p0)), glm::vec3(0.0f), glm::vec3(node.params[1]));
+			break;
+		default:
+			break;
+		}
+
+		for (const SceneNode& child : node.children)
+			CollectMeshSpacePoints(child, point, scale, points);
+	}
+}
+
+SceneDescription SceneDescription::LoadFromFile(const std::string& fileName, const std::vector<std::string>& builtInMaterials)
+{
+	std::ifstream file(fileName);
+	if (!file.is_open())
+		throw std::runtime_error("SceneDescription::LoadFromFile() >> Failed to open " + fileName);
+
+	//Split into tokens, braces don't need whitespace around them
+	std::vector<Token> tokens;
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		++lineNumber;
+		line = line.substr(0, line.find('#'));
+
+		std::string spaced;
+		for (char c : line)
+		{
+			if (c == '{' || c == '}')
+				spaced += std::string(" ") + c + " ";
+			else
+				spaced += c;
+		}
+
+		std::istringstream stream(spaced);
+		std::string text;
+		while (stream >> text)
+			tokens.push_back({ text, lineNumber });
+	}
+
+	SceneDescription scene;
+	scene.m_FileName = fileName;
+
+	//Everything at the top level is added together
+	scene.m_Root.opcode = SCENE_OP_ADDITIVE;
+
+	std::vector<std::string> materialNames = builtInMaterials;
+	SceneParser parser(tokens, materialNames, fileName);
+	while (!parser.IsDone())
+	{
+		if (parser.Peek().text == "Material")
+		{
+			parser.Next("Material");
+			scene.m_Materials.push_back(parser.ParseMaterial());
+		}
+		else
+			scene.m_Root.children.push_back(parser.ParseNode());
+	}
+
+	if (scene.m_Root.children.empty())
+		throw std::runtime_error("SceneDescription::LoadFromFile() >> " + fileName + " doesn't contain any nodes");
+
+	scene.m_MeshFile = parser.GetMeshFile();
+	scene.m_MeshResolution = parser.GetMeshResolution();
+	scene.m_Instances = std::move(parser.GetInstances());
+	scene.m_NodeCount = AssignNodeIds(scene.m_Root, 0);
+
+	return scene;
+}
+
+SceneNodeKind SceneDescription::GetNodeKind(SceneOpcode opcode)
+{
+	if (opcode <= SCENE_OP_MESH || opcode == SCENE_OP_SCATTER)
+		return SCENE_NODE_PRIMITIVE;
+	if (opcode <= SCENE_OP_SMOOTH_INTERSECT)
+		return SCENE_NODE_OPERATOR;
+	return SCENE_NODE_TRANSFORM;
+}
+
+const char* SceneDescription::GetNodeName(SceneOpcode opcode)
+{
+	const NodeKeyword* keyword = FindKeyword(opcode);
+	return keyword ? keyword->name : "";
+}
+
+int SceneDescription::GetNodeParamCount(SceneOpcode opcode)
+{
+	const NodeKeyword* keyword = FindKeyword(opcode);
+	return keyword ? keyword->paramCount : 0;
+}
+
+void SceneDescription::SetMeshBounds(const Bounds& bounds)
+{
+	AssignMeshBounds(m_Root, bounds);
+}
+
+std::vector<glm::vec4> SceneDescription::GetMeshSpacePoints(const glm::vec3& point) const
+{
+	std::vector<glm::vec4> points;
+	CollectMeshSpacePoints(m_Root, point, 1.0f, points);
+	return points;
+}
+
+bool SceneDescription::GetScatterSpace(glm::mat4& worldToLocal) const
+{
+	bool repeated = false;
+	return FindScatterSpace(m_Root, glm::mat4(1.0f), false, worldToLocal, repeated) && !repeated;
+}
+
+std::vector<SceneDescription::Instruction> SceneDescription::Compile()
+{
+	std::vector<Instruction> instructions;
+	uint32_t objectDepth = 0;
+	uint32_t pointDepth = 1;
+	uint32_t maxDepth = 1;
+	CompileNode(m_Root, instructions, objectDepth, pointDepth, maxDepth);
+
+	if (maxDepth > MaxStackDepth)
+		throw std::runtime_error("SceneDescription::Compile() >> " + m_FileName + " is nested too deep, it needs a stack of " + std::to_string(maxDepth) + " but the shader has " + std::to_string(MaxStackDepth));
+
+	//The whole program is current again
+	for (uint32_t id : m_ChangedNodes)
+		FindNode(m_Root, id)->changed = false;
+	m_ChangedNodes.clear();
+
+	return instructions;
+}
+
+void SceneDescription::CompileNode(SceneNode& node, std::vector<Instruction>& instructions, uint32_t& objectDepth, uint32_t& pointDepth, uint32_t& maxDepth)
+{
+	Instruction instruction = GetNodeInstruction(node);
+	node.instructions.clear();
+
+	switch (GetNodeKind(node.opcode))
+	{
+	case SCENE_NODE_PRIMITIVE:
+		node.instructions.push_back((uint32_t)instructions.size());
+		instructions.push_back(instruction);
+		maxDepth = glm::max(maxDepth, ++objectDepth);
+		break;
+
+	case SCENE_NODE_OPERATOR:
+		//Postfix, every child after the first is combined with everything before it
+		CompileNode(node.children[0], instructions, objectDepth, pointDepth, maxDepth);
+		for (size_t i = 1; i < node.children.size(); ++i)
+		{
+			CompileNode(node.children[i], instructions, objectDepth, pointDepth, maxDepth);
+			node.instructions.push_back((uint32_t)instructions.size());
+			instructions.push_back(instruction);
+			--objectDepth;
+		}
+		break;
+
+	case SCENE_NODE_TRANSFORM:
+	{
+		node.instructions.push_back((uint32_t)instructions.size());
+		instructions.push_back(instruction);
+		maxDepth = glm::max(maxDepth, ++pointDepth);
+
+		Instruction additive{};
+		additive.opcode = SCENE_OP_ADDITIVE;
+		CompileNode(node.children[0], instructions, objectDepth, pointDepth, maxDepth);
+		for (size_t i = 1; i < node.children.size(); ++i)
+		{
+			CompileNode(node.children[i], instructions, objectDepth, pointDepth, maxDepth);
+			instructions.push_back(additive);
+			--objectDepth;
+		}
+
+		node.instructions.push_back((uint32_t)instructions.size());
+		instructions.push_back(GetPopInstruction(node));
+		--pointDepth;
+		break;
+	}
+	}
+}
+
+void SceneDescription::EditNode(uint32_t id, const glm::vec4 params[2], uint32_t materialId)
+{
+	SceneNode* node = id < m_NodeCount ? FindNode(m_Root, id) : nullptr;
+	if (!node)
+		throw std::runtime_error("SceneDescription::EditNode() >> " + m_FileName + " has no node " + std::to_string(id));
+
+	//Their parameters are bounds
+	if (node->opcode != SCENE_OP_MESH && node->opcode != SCENE_OP_SCATTER)
+	{
+		std::string error = CheckParams(node->opcode, params);
+		if (!error.empty())
+			throw std::runtime_error("SceneDescription::EditNode() >> " + error);
+
+		node->params[0] = params[0];
+		node->params[1] = params[1];
+	}
+	node->materialId = materialId;
+
+	if (!node->changed)
+	{
+		node->changed = true;
+		m_ChangedNodes.push_back(id);
+	}
+}
+
+std::vector<SceneDescription::InstructionPatch> SceneDescription::CompileChanges()
+{
+	std::vector<InstructionPatch> patches;
+	for (uint32_t id : m_ChangedNodes)
+	{
+		SceneNode& node = *FindNode(m_Root, id);
+		for (size_t i = 0; i < node.instructions.size(); ++i)
+		{
+			bool pop = GetNodeKind(node.opcode) == SCENE_NODE_TRANSFORM && i + 1 == node.instructions.size();
+			patches.push_back({ node.instructions[i], pop ? GetPopInstruction(node) : GetNodeInstruction(node) });
+		}
+		node.changed = false;
+	}
+	m_ChangedNodes.clear();
+
+	return patches;
+}
+
+SceneDescription::Bounds SceneDescription::CalculateBounds() const
+{
+	Bounds bounds = CalculateNodeBounds(m_Root);
+	bounds.min = glm::clamp(bounds.min, glm::vec3(-UnboundedExtent), glm::vec3(UnboundedExtent));
+	bounds.max = glm::clamp(bounds.max, glm::vec3(-UnboundedExtent), glm::vec3(UnboundedExtent));
+	return bounds;
+}
+
+SceneDescription::Bounds SceneDescription::CalculateNodeBounds(const SceneNode& node)
+{
+	const glm::vec3 unbounded{ UnboundedExtent };
+	const glm::vec4& p0 = node.params[0];
+
+	switch (node.opcode)
+	{
+	case SCENE_OP_SPHERE:
+		return { glm::vec3(-p0.x), glm::vec3(p0.x) };
+	case SCENE_OP_BOX:
+		return { -glm::vec3(p0), glm::vec3(p0) };
+	case SCENE_OP_ROUND_BOX:
+		return { -glm::vec3(p0) - node.params[1].x, glm::vec3(p0) + node.params[1].x };
+	case SCENE_OP_CYLINDER:
+		return { -glm::vec3(p0.y, p0.x, p0.y), glm::vec3(p0.y, p0.x, p0.y) };
+	case SCENE_OP_PLANE:
+		return { -unbounded, glm::vec3(UnboundedExtent, 0.0f, UnboundedExtent) };
+	case SCENE_OP_MESH:
+	case SCENE_OP_SCATTER:
+		return { glm::vec3(p0), glm::vec3(node.params[1]) };
+	default:
+		break;
+	}
+
+	Bounds bounds = CalculateNodeBounds(node.children[0]);
+	for (size_t i = 1; i < node.children.size(); ++i)
+	{
+		Bounds child = CalculateNodeBounds(node.children[i]);
+		switch (node.opcode)
+		{
+		case SCENE_OP_SUBTRACTIVE:
+		case SCENE_OP_SMOOTH_SUBTRACTIVE:
+			break;
+		case SCENE_OP_INTERSECT:
+		case SCENE_OP_SMOOTH_INTERSECT:
+			bounds = IntersectBounds(bounds, child);
+			break;
+		default:
+			bounds = UnionBounds(bounds, child);
+			break;
+		}
+	}
+
+	switch (node.opcode)
+	{
+	case SCENE_OP_SMOOTH_ADDITIVE:
+	case SCENE_OP_SMOOTH_SUBTRACTIVE:
+	case SCENE_OP_SMOOTH_INTERSECT:
+		//The blend never moves the surface further than k
+		bounds.min -= p0.x;
+		bounds.max += p0.x;
+		return bounds;
+
+	case SCENE_OP_TRANSLATE:
+		return { bounds.min + glm::vec3(p0), bounds.max + glm::vec3(p0) };
+
+	case SCENE_OP_ROTATE_X:
+	case SCENE_OP_ROTATE_Y:
+	case SCENE_OP_ROTATE_Z:
+	{
+		//The RotateAround functions in the shader turn the sample point by -angle, so the children end up turned by +angle
+		glm::vec3 axis = node.opcode == SCENE_OP_ROTATE_X ? glm::vec3(1, 0, 0) : node.opcode == SCENE_OP_ROTATE_Y ? glm::vec3(0, 1, 0) : glm::vec3(0, 0, 1);
+		glm::mat3 inverse = glm::mat3(glm::rotate(glm::mat4(1.0f), p0.x, axis));
+
+		Bounds rotated{ glm::vec3(std::numeric_limits<float>::max()), glm::vec3(std::numeric_limits<float>::lowest()) };
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			glm::vec3 point{ corner & 1 ? bounds.max.x : bounds.min.x, corner & 2 ? bounds.max.y : bounds.min.y, corner & 4 ? bounds.max.z : bounds.min.z };
+			point = inverse * point;
+			rotated.min = glm::min(rotated.min, point);
+			rotated.max = glm::max(rotated.max, point);
+		}
+		return rotated;
+	}
+
+	case SCENE_OP_SCALE:
+		return { bounds.min * p0.x, bounds.max * p0.x };
+
+	case SCENE_OP_REPEAT:
+		return { -unbounded, unbounded };
+
+	case SCENE_OP_REPEAT_LIMITED:
+		//Copies at spacing * 0..limit
+		return { bounds.min, bounds.max + glm::vec3(p0) * glm::vec3(node.params[1]) };
+
+	default:
+		return bounds;
+	}
+}
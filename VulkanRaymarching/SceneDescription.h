@@ -0,0 +1,182 @@
+#pragma once
+#include <string>
+
+//Instruction of the scene program, has to match the SCENE_OP_ constants in the shader.
+//Primitives push a distance, operators combine the top two and transforms change the sample point until the POP_TRANSFORM after their children.
+enum SceneOpcode : uint32_t
+{
+	SCENE_OP_SPHERE = 0,
+	SCENE_OP_BOX,
+	SCENE_OP_ROUND_BOX,
+	SCENE_OP_CYLINDER,
+	SCENE_OP_PLANE,
+	SCENE_OP_MESH,
+	SCENE_OP_ADDITIVE,
+	SCENE_OP_SUBTRACTIVE,
+	SCENE_OP_INTERSECT,
+	SCENE_OP_SMOOTH_ADDITIVE,
+	SCENE_OP_SMOOTH_SUBTRACTIVE,
+	SCENE_OP_SMOOTH_INTERSECT,
+	SCENE_OP_TRANSLATE,
+	SCENE_OP_ROTATE_X,
+	SCENE_OP_ROTATE_Y,
+	SCENE_OP_ROTATE_Z,
+	SCENE_OP_SCALE,
+	SCENE_OP_REPEAT,
+	SCENE_OP_REPEAT_LIMITED,
+	SCENE_OP_POP_TRANSFORM,
+	SCENE_OP_SCATTER	//Primitive, evaluates the instances of the scene through their grid
+};
+
+enum SceneNodeKind
+{
+	SCENE_NODE_PRIMITIVE,
+	SCENE_NODE_OPERATOR,	//Combines its children from left to right
+	SCENE_NODE_TRANSFORM	//Changes the sample point of its children, more than one child is an implicit union
+};
+
+//Node of the scene tree, the parameters are in the order they're written in the file and angles are in radians.
+//A mesh has the bounds of its baked volume instead, min in params[0] and max in params[1], and a Scatter the bounds of its instances.
+struct SceneNode
+{
+	SceneOpcode opcode = SCENE_OP_SPHERE;
+	glm::vec4 params[2]{};
+	uint32_t materialId = 0;
+	std::vector<SceneNode> children;
+
+	uint32_t id = 0;	//Depth first, the root is 0
+	bool changed = false;	//Edited since the last Compile() or CompileChanges()
+
+	//Filled in by Compile(), the instructions that carry the parameters of the node. An operator has one per child after the first and
+	//a transform ends with its POP_TRANSFORM.
+	std::vector<uint32_t> instructions;
+};
+
+//std430 layout of an instance of a Scatter node, the primitive is turned around y and scaled uniformly around the center
+struct SceneInstance
+{
+	glm::vec4 positionScale;	//Center (xyz) and scale (w)
+	glm::vec4 params;	//Of the primitive, a RoundBox has its radius in w
+	uint32_t opcode;
+	uint32_t materialId;
+	float rotation;
+	float radius;	//Around the center before scaling, holds the whole primitive in any rotation
+	float bobHeight;	//The center moves up and down by this much with the scene time, 0 for instances that stay put
+	float bobPhase;
+	float padding[2];
+
+	//Same as InstancePosition() in the shader
+	glm::vec3 GetPosition(float time) const { return glm::vec3(positionScale) + glm::vec3(0.0f, bobHeight * sin(time + bobPhase), 0.0f); }
+};
+
+struct SceneMaterial
+{
+	std::string name;
+	glm::vec4 color;
+	glm::vec4 specular;
+};
+
+//Tree of primitives, operators and transforms read from a .scene file.
+//Every node is "Keyword parameters", primitives end with a material name and operators/transforms have their children between braces:
+//	Material Red 0.8 0.1 0.1 0.0 0.0 0.0
+//	SmoothAdditive 0.5
+//	{
+//		Sphere 1 GOLD
+//		Translate 0 -1 0 { Box 4 0.2 4 Red }
+//	}
+//Meshes are "Mesh path resolution material" with the OBJ path relative to the scene file, a scene can use one mesh as often as it likes.
+//"Scatter count sizeX sizeY sizeZ minScale maxScale { templates }" places count copies of its primitives at random in a box of that size,
+//with random scales and turns around y. A scene can have one, its instances are laid out in the same way every time it's loaded.
+//"moving height" after the scales lets that many of the instances bob up and down by height while the scene is animated.
+class SceneDescription
+{
+public:
+	//std430 layout of an instruction in the scene program buffer
+	struct Instruction
+	{
+		uint32_t opcode;
+		uint32_t materialId;
+		uint32_t padding[2];
+		glm::vec4 params[2];
+	};
+
+	struct InstructionPatch
+	{
+		uint32_t index;
+		Instruction instruction;
+	};
+
+	struct Bounds
+	{
+		glm::vec3 min;
+		glm::vec3 max;
+	};
+
+	//Size of the distance and sample point stacks in the shader
+	static const uint32_t MaxStackDepth = 16;
+
+	//Instances a Scatter node can place, the grid over them has to fit in a storage buffer
+	static const uint32_t MaxInstances = 1 << 20;
+
+	//Anything further away than this counts as unbounded (planes, infinite repetition)
+	static constexpr float UnboundedExtent = 1e30f;
+
+	//Materials the file defines get ids after the built-in ones, throws std::runtime_error with the line of the first error
+	static SceneDescription LoadFromFile(const std::string& fileName, const std::vector<std::string>& builtInMaterials);
+
+	//Postfix program for the interpreter in the shader, throws std::runtime_error when it needs deeper stacks than the shader has.
+	//Remembers where every node ended up, so later edits can be patched in with CompileChanges().
+	std::vector<Instruction> Compile();
+
+	//Edits keep the structure of the tree, so the program keeps its layout and only the instructions of the edited nodes change.
+	//Throws std::runtime_error when the parameters aren't valid for the node, the parameters of a Mesh or Scatter are its bounds and stay as they are.
+	void EditNode(uint32_t id, const glm::vec4 params[2], uint32_t materialId);
+
+	//The instructions of every node edited since the last Compile() or CompileChanges()
+	std::vector<InstructionPatch> CompileChanges();
+	bool HasChanges() const { return !m_ChangedNodes.empty(); }
+
+	//Conservative box around everything the scene can return
+	Bounds CalculateBounds() const;
+
+	//Same for a single node in its own space, not clamped to UnboundedExtent
+	static Bounds CalculateNodeBounds(const SceneNode& node);
+
+	const SceneNode& GetRoot() const { return m_Root; }
+	const std::vector<SceneMaterial>& GetMaterials() const { return m_Materials; }
+	const std::string& GetFileName() const { return m_FileName; }
+
+	//OBJ file the Mesh nodes sample and the resolution to bake it at, empty when the scene has no meshes
+	const std::string& GetMeshFile() const { return m_MeshFile; }
+	uint32_t GetMeshResolution() const { return m_MeshResolution; }
+
+	//Bounds of the baked volume, the Mesh nodes need them before the scene can be compiled or bounded
+	void SetMeshBounds(const Bounds& bounds);
+
+	//Instances of the Scatter node, empty when the scene has none
+	const std::vector<SceneInstance>& GetInstances() const { return m_Instances; }
+
+	//Takes world space into the space of the Scatter node. False without one or when it's repeated, the space isn't a single one then.
+	bool GetScatterSpace(glm::mat4& worldToLocal) const;
+
+	//A point in the space of every Mesh node (xyz) and how much that space is scaled (w), repetitions give the closest copy
+	std::vector<glm::vec4> GetMeshSpacePoints(const glm::vec3& point) const;
+
+	static SceneNodeKind GetNodeKind(SceneOpcode opcode);
+
+	//Keyword of the node in a .scene file and how many parameters it reads, see the layout of SceneNode::params
+	static const char* GetNodeName(SceneOpcode opcode);
+	static int GetNodeParamCount(SceneOpcode opcode);
+
+private:
+	void CompileNode(SceneNode& node, std::vector<Instruction>& instructions, uint32_t& objectDepth, uint32_t& pointDepth, uint32_t& maxDepth);
+
+	SceneNode m_Root;
+	std::vector<SceneMaterial> m_Materials;
+	std::string m_FileName;
+	std::string m_MeshFile;
+	uint32_t m_MeshResolution = 0;
+	std::vector<SceneInstance> m_Instances;
+	uint32_t m_NodeCount = 0;
+	std::vector<uint32_t> m_ChangedNodes;
+};
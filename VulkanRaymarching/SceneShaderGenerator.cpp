@@ -0,0 +1,313 @@
+#include "pch.h"
+#include "SceneShaderGenerator.h"
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+
+namespace
+{
+	const std::string SceneCacheDirectory = "../Resources/Shaders/SceneCache/";
+	const std::string GeneratedSceneFile = "GeneratedScene.glsl";
+
+	//Same matrices as the RotateAround functions in the shader
+	glm::mat3 RotationMatrix(SceneOpcode opcode, float angle)
+	{
+		float c = cos(angle);
+		float s = sin(angle);
+
+		switch (opcode)
+		{
+		case SCENE_OP_ROTATE_X: return glm::mat3(glm::vec3(1, 0, 0), glm::vec3(0, c, -s), glm::vec3(0, s, c));
+		case SCENE_OP_ROTATE_Y: return glm::mat3(glm::vec3(c, 0, s), glm::vec3(0, 1, 0), glm::vec3(-s, 0, c));
+		default: return glm::mat3(glm::vec3(c, -s, 0), glm::vec3(s, c, 0), glm::vec3(0, 0, 1));
+		}
+	}
+
+	bool Overlaps(const SceneDescription::Bounds& a, const SceneDescription::Bounds& b)
+	{
+		return glm::all(glm::lessThanEqual(a.min, b.max)) && glm::all(glm::lessThanEqual(b.min, a.max));
+	}
+}
+
+SceneShaderGenerator::SceneShaderGenerator(const SceneDescription& scene)
+{
+	Point samplePoint;
+	samplePoint.base = "samplePoint";
+	std::string result = EmitNode(scene.GetRoot(), samplePoint);
+
+	SceneDescription::Bounds bounds = scene.CalculateBounds();
+
+	std::ostringstream code;
+	code << "//Generated from " << scene.GetFileName() << " by SceneShaderGenerator\n";
+	code << "const vec3 GENERATED_BOUNDS_MIN = " << Literal(bounds.min) << ";\n";
+	code << "const vec3 GENERATED_BOUNDS_MAX = " << Literal(bounds.max) << ";\n\n";
+	code << "SceneObject map(vec3 samplePoint)\n{\n";
+	code << m_Body.str();
+	code << "    return " << result << ";\n}\n";
+	m_Code = code.str();
+}
+
+std::string SceneShaderGenerator::EmitNode(const SceneNode& node, Point point)
+{
+	const glm::vec4& a = node.params[0];
+	const glm::vec4& b = node.params[1];
+
+	switch (SceneDescription::GetNodeKind(node.opcode))
+	{
+	case SCENE_NODE_PRIMITIVE:
+	{
+		std::string p = EmitPoint(point);
+		if (node.opcode == SCENE_OP_SCATTER)
+		{
+			//The instances bring their own materials
+			std::string object = NewVariable("object");
+			m_Body << "    SceneObject " << object << " = ScatterSDF(" << p << ");\n";
+			if (point.distanceScale != 1.0f)
+				m_Body << "    " << object << ".value *= " << Literal(point.distanceScale) << ";\n";
+			return object;
+		}
+
+		std::string distance;
+		switch (node.opcode)
+		{
+		case SCENE_OP_SPHERE: distance = "SphereSDF(" + p + ", " + Literal(a.x) + ")"; break;
+		case SCENE_OP_BOX: distance = "BoxSDF(" + p + ", " + Literal(glm::vec3(a)) + ")"; break;
+		case SCENE_OP_ROUND_BOX: distance = "RoundBoxSDF(" + p + ", " + Literal(glm::vec3(a)) + ", " + Literal(b.x) + ")"; break;
+		case SCENE_OP_CYLINDER: distance = "CylinderSDF(" + p + ", " + Literal(a.x) + ", " + Literal(a.y) + ")"; break;
+		case SCENE_OP_MESH: distance = "MeshSDF(" + p + ", " + Literal(glm::vec3(a)) + ", " + Literal(glm::vec3(b)) + ")"; break;
+		default: distance = "GroundPlaneSDF(" + p + ")"; break;
+		}
+
+		//The scales above the primitive shrank the sample point, the distance has to grow back
+		if (point.distanceScale != 1.0f)
+			distance += " * " + Literal(point.distanceScale);
+
+		std::string object = NewVariable("object");
+		m_Body << "    SceneObject " << object << " = CreateSceneObject(" << distance << ", " << node.materialId << "u);\n";
+		return object;
+	}
+
+	case SCENE_NODE_OPERATOR:
+	{
+		//Distances are already scaled, the smooth operators are homogeneous so scaling k the same keeps the blend
+		float k = a.x * point.distanceScale;
+		bool subtractive = node.opcode == SCENE_OP_SUBTRACTIVE || node.opcode == SCENE_OP_SMOOTH_SUBTRACTIVE;
+		bool smooth = node.opcode >= SCENE_OP_SMOOTH_ADDITIVE;
+
+		SceneDescription::Bounds first = SceneDescription::CalculateNodeBounds(node.children[0]);
+		if (smooth)
+		{
+			first.min -= a.x;
+			first.max += a.x;
+		}
+
+		std::string result = EmitNode(node.children[0], point);
+		for (size_t i = 1; i < node.children.size(); ++i)
+		{
+			//Subtracting something that can't reach the first child doesn't change its surface
+			if (subtractive && !Overlaps(first, SceneDescription::CalculateNodeBounds(node.children[i])))
+				continue;
+
+			std::string child = EmitNode(node.children[i], point);
+			std::string call;
+			switch (node.opcode)
+			{
+			case SCENE_OP_ADDITIVE: call = "AdditiveSDF(" + result + ", " + child + ")"; break;
+			case SCENE_OP_SUBTRACTIVE: call = "SubtractiveSDF(" + result + ", " + child + ")"; break;
+			case SCENE_OP_INTERSECT: call = "IntersectSDF(" + result + ", " + child + ")"; break;
+			case SCENE_OP_SMOOTH_ADDITIVE: call = "SmoothAdditiveSDF(" + result + ", " + child + ", " + Literal(k) + ")"; break;
+			case SCENE_OP_SMOOTH_SUBTRACTIVE: call = "SmoothSubtractiveSDF(" + child + ", " + result + ", " + Literal(k) + ")"; break;
+			default: call = "SmoothIntersectionSDF(" + result + ", " + child + ", " + Literal(k) + ")"; break;
+			}
+
+			std::string combined = NewVariable("object");
+			m_Body << "    SceneObject " << combined << " = " << call << ";\n";
+			result = combined;
+		}
+		return result;
+	}
+
+	case SCENE_NODE_TRANSFORM:
+	{
+		//Linear transforms are folded into the point, repetition isn't linear so the point is written out before it
+		switch (node.opcode)
+		{
+		case SCENE_OP_TRANSLATE:
+			point.offset -= glm::vec3(a);
+			break;
+		case SCENE_OP_ROTATE_X:
+		case SCENE_OP_ROTATE_Y:
+		case SCENE_OP_ROTATE_Z:
+		{
+			glm::mat3 rotation = RotationMatrix(node.opcode, a.x);
+			point.matrix = rotation * point.matrix;
+			point.offset = rotation * point.offset;
+			break;
+		}
+		case SCENE_OP_SCALE:
+			point.matrix /= a.x;
+			point.offset /= a.x;
+			point.distanceScale *= a.x;
+			break;
+		case SCENE_OP_REPEAT:
+		{
+			std::string p = EmitPoint(point);
+			point.base = NewVariable("point");
+			m_Body << "    vec3 " << point.base << " = OpRep(" << p << ", " << Literal(glm::vec3(a)) << ");\n";
+			break;
+		}
+		case SCENE_OP_REPEAT_LIMITED:
+		{
+			//No copies past the first is the point itself
+			if (glm::vec3(b) == glm::vec3(0.0f))
+				break;
+
+			std::string p = EmitPoint(point);
+			point.base = NewVariable("point");
+			m_Body << "    vec3 " << point.base << " = opRepLim(" << p << ", " << Literal(glm::vec3(a)) << ", " << Literal(glm::vec3(b)) << ");\n";
+			break;
+		}
+		default:
+			break;
+		}
+
+		//Siblings share the transformed point instead of each transforming it again
+		if (node.children.size() > 1)
+			EmitPoint(point);
+
+		std::string result = EmitNode(node.children[0], point);
+		for (size_t i = 1; i < node.children.size(); ++i)
+		{
+			std::string child = EmitNode(node.children[i], point);
+			std::string combined = NewVariable("object");
+			m_Body << "    SceneObject " << combined << " = AdditiveSDF(" << result << ", " << child << ");\n";
+			result = combined;
+		}
+		return result;
+	}
+	}
+
+	return "";
+}
+
+std::string SceneShaderGenerator::EmitPoint(Point& point)
+{
+	bool identity = point.matrix == glm::mat3(1.0f);
+	bool noOffset = point.offset == glm::vec3(0.0f);
+	if (identity && noOffset)
+		return point.base;
+
+	//A matrix that only scales is a multiplication
+	std::string expression = point.base;
+	if (!identity)
+		expression = point.matrix == glm::mat3(point.matrix[0][0]) ? point.base + " * " + Literal(point.matrix[0][0]) : Literal(point.matrix) + " * " + point.base;
+
+	if (!noOffset)
+		expression += " + " + Literal(point.offset);
+
+	std::string variable = NewVariable("point");
+	m_Body << "    vec3 " << variable << " = " << expression << ";\n";
+
+	point.base = variable;
+	point.matrix = glm::mat3(1.0f);
+	point.offset = glm::vec3(0.0f);
+	return variable;
+}
+
+std::string SceneShaderGenerator::NewVariable(const char* prefix)
+{
+	return prefix + std::to_string(m_VariableCount++);
+}
+
+std::string SceneShaderGenerator::Literal(float value)
+{
+	std::ostringstream stream;
+	stream.imbue(std::locale::classic());
+	stream << std::setprecision(9) << value;
+
+	std::string text = stream.str();
+	if (text.find_first_of(".e") == std::string::npos)
+		text += ".0";
+	return text + "f";
+}
+
+std::string SceneShaderGenerator::Literal(const glm::vec3& value)
+{
+	return "vec3(" + Literal(value.x) + ", " + Literal(value.y) + ", " + Literal(value.z) + ")";
+}
+
+std::string SceneShaderGenerator::Literal(const glm::mat3& value)
+{
+	//Column major like glm
+	return "mat3(" + Literal(value[0]) + ", " + Literal(value[1]) + ", " + Literal(value[2]) + ")";
+}
+
+std::string SceneShaderGenerator::GetShaderSource(const std::string& compiledShader)
+{
+	const std::string suffix = "_comp.spv";
+	if (compiledShader.size() <= suffix.size() || compiledShader.compare(compiledShader.size() - suffix.size(), suffix.size(), suffix) != 0)
+		return "";
+
+	std::string source = compiledShader.substr(0, compiledShader.size() - suffix.size()) + ".comp";
+	std::ifstream file(source);
+	if (!file.is_open())
+		return "";
+
+	//Only shaders that can take a generated map() are worth compiling again
+	std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	return text.find("GENERATED_SCENE") != std::string::npos ? source : "";
+}
+
+std::string SceneShaderGenerator::GetCachedShaderPath(const std::string& generatedCode, const std::string& shaderSource)
+{
+	std::ifstream file(shaderSource, std::ios::binary);
+	std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	std::ostringstream path;
+	path << SceneCacheDirectory << std::hex << std::hash<std::string>{}(generatedCode + source) << "_comp.spv";
+	return path.str();
+}
+
+bool SceneShaderGenerator::IsCachedShader(const std::string& compiledShader)
+{
+	return compiledShader.compare(0, SceneCacheDirectory.size(), SceneCacheDirectory) == 0;
+}
+
+bool SceneShaderGenerator::CompileShader(const std::string& generatedCode, const std::string& shaderSource, const std::string& outputFile)
+{
+	//Every cached shader gets its own include directory so builds can run side by side
+	std::filesystem::path output{ outputFile };
+	std::filesystem::path includeDirectory = output.parent_path() / output.stem();
+	std::error_code error;
+	std::filesystem::create_directories(includeDirectory, error);
+
+	std::ofstream includeFile(includeDirectory / GeneratedSceneFile);
+	if (!includeFile.is_open())
+		return false;
+	includeFile << generatedCode;
+	includeFile.close();
+
+	//glslc of the Vulkan SDK, or the one on the path
+	std::string glslc = "glslc";
+#ifdef _WIN32
+	char* sdk = nullptr;
+	size_t length = 0;
+	if (_dupenv_s(&sdk, &length, "VULKAN_SDK") == 0 && sdk)
+	{
+		glslc = std::string(sdk) + "\\Bin\\glslc.exe";
+		free(sdk);
+	}
+#else
+	if (const char* sdk = std::getenv("VULKAN_SDK"))
+		glslc = std::string(sdk) + "/bin/glslc";
+#endif
+
+	std::string command = "\"" + glslc + "\" \"" + shaderSource + "\" -DGENERATED_SCENE -I \"" + includeDirectory.string() + "\" -o \"" + outputFile + "\"";
+#ifdef _WIN32
+	//cmd.exe strips the first and last quote of the line
+	command = "\"" + command + "\"";
+#endif
+
+	return std::system(command.c_str()) == 0 && std::filesystem::exists(output, error);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "SceneDescription.h"
+#include <sstream>
+
+//Turns a scene description into GLSL that replaces the map() of a shader, so the scene runs as straight-line code instead of
+//through the interpreter. Parameters become literals, chains of translations, rotations and scales are folded into one
+//matrix and offset per primitive, and subtracted children that can't touch what they're subtracted from are dropped.
+//The shader includes the code as GeneratedScene.glsl when it's compiled with GENERATED_SCENE defined.
+class SceneShaderGenerator
+{
+public:
+	explicit SceneShaderGenerator(const SceneDescription& scene);
+
+	const std::string& GetCode() const { return m_Code; }
+
+	//Source of a compiled shader following the naming of compile.py (Name_comp.spv -> Name.comp), empty when it doesn't
+	static std::string GetShaderSource(const std::string& compiledShader);
+
+	//Where the shader source compiled with this scene is cached, the name is a hash of both so either changing rebuilds it
+	static std::string GetCachedShaderPath(const std::string& generatedCode, const std::string& shaderSource);
+	static bool IsCachedShader(const std::string& compiledShader);
+
+	//Writes the generated code next to the cached shader and runs glslc, blocks until it's done
+	static bool CompileShader(const std::string& generatedCode, const std::string& shaderSource, const std::string& outputFile);
+
+private:
+	//Sample point of a node: matrix * base + offset, only written to a variable when something needs it
+	struct Point
+	{
+		std::string base;
+		glm::mat3 matrix{ 1.0f };
+		glm::vec3 offset{ 0.0f };
+		float distanceScale = 1.0f;	//Product of the scales above the node, the distances are multiplied by it
+	};
+
+	std::string EmitNode(const SceneNode& node, Point point);
+	std::string EmitPoint(Point& point);
+	std::string NewVariable(const char* prefix);
+
+	static std::string Literal(float value);
+	static std::string Literal(const glm::vec3& value);
+	static std::string Literal(const glm::mat3& value);
+
+	std::ostringstream m_Body;
+	uint32_t m_VariableCount = 0;
+	std::string m_Code;
+};
@@ -0,0 +1,255 @@
+#include "pch.h"
+#include "SdfBrickFile.h"
+#include <filesystem>
+#include <fstream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	uint64_t AlignSection(uint64_t offset)
+	{
+		return (offset + SdfBrickFile::SectionAlignment - 1) / SdfBrickFile::SectionAlignment * SdfBrickFile::SectionAlignment;
+	}
+
+	//Offsets of the sections for a header that has its counts filled in
+	void LayOutSections(SdfBrickFile::Header& header)
+	{
+		uint64_t cellCount = (uint64_t)header.cellCount.x * header.cellCount.y * header.cellCount.z;
+		header.cellsOffset = AlignSection(sizeof(SdfBrickFile::Header));
+		header.brickCellsOffset = AlignSection(header.cellsOffset + cellCount * sizeof(uint32_t));
+		header.fallbacksOffset = AlignSection(header.brickCellsOffset + header.brickCount * sizeof(uint32_t));
+		header.rangesOffset = AlignSection(header.fallbacksOffset + header.brickCount * sizeof(uint32_t));
+		header.bricksOffset = AlignSection(header.rangesOffset + header.brickCount * sizeof(glm::vec2));
+	}
+
+	void WriteFile(const std::string& fileName, const SdfBrickFile::Header& header, const uint32_t* cells, const uint32_t* brickCells, const uint32_t* fallbacks,
+		const glm::vec2* ranges, const uint8_t* bricks)
+	{
+		uint64_t cellCount = (uint64_t)header.cellCount.x * header.cellCount.y * header.cellCount.z;
+		std::string temporaryFile = fileName + ".tmp";
+		{
+			std::ofstream file(temporaryFile, std::ios::binary | std::ios::trunc);
+			if (!file.is_open())
+				throw std::runtime_error("SdfBrickFile::Write() >> Failed to create " + temporaryFile);
+
+			auto writeSection = [&](uint64_t offset, const void* data, uint64_t size)
+			{
+				//Zeros up to the start of the section
+				static const char padding[SdfBrickFile::SectionAlignment]{};
+				file.write(padding, (std::streamsize)(offset - (uint64_t)file.tellp()));
+				file.write(static_cast<const char*>(data), (std::streamsize)size);
+			};
+
+			file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			writeSection(header.cellsOffset, cells, cellCount * sizeof(uint32_t));
+			writeSection(header.brickCellsOffset, brickCells, header.brickCount * sizeof(uint32_t));
+			writeSection(header.fallbacksOffset, fallbacks, header.brickCount * sizeof(uint32_t));
+			writeSection(header.rangesOffset, ranges, header.brickCount * sizeof(glm::vec2));
+			writeSection(header.bricksOffset, bricks, (uint64_t)header.brickCount * header.brickBytes);
+
+			if (!file)
+				throw std::runtime_error("SdfBrickFile::Write() >> Failed to write " + temporaryFile);
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temporaryFile, fileName, error);
+		if (error)
+		{
+			std::filesystem::remove(temporaryFile, error);
+			throw std::runtime_error("SdfBrickFile::Write() >> Failed to replace " + fileName);
+		}
+	}
+
+	bool ReadHeader(const std::string& fileName, SdfBrickFile::Header& header)
+	{
+		std::ifstream file(fileName, std::ios::binary);
+		return file.read(reinterpret_cast<char*>(&header), sizeof(header)) && header.magic == SdfBrickFile::Magic && header.version == SdfBrickFile::Version;
+	}
+}
+
+SdfBrickFile::SdfBrickFile(const std::string& fileName)
+	: m_FileName(fileName)
+{
+#ifdef _WIN32
+	m_File = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (m_File == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("SdfBrickFile::SdfBrickFile() >> Failed to open " + fileName);
+
+	LARGE_INTEGER size;
+	GetFileSizeEx(m_File, &size);
+	m_Size = (uint64_t)size.QuadPart;
+
+	m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_Mapping)
+		m_Data = static_cast<const uint8_t*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	int file = open(fileName.c_str(), O_RDONLY);
+	if (file < 0)
+		throw std::runtime_error("SdfBrickFile::SdfBrickFile() >> Failed to open " + fileName);
+
+	struct stat status;
+	fstat(file, &status);
+	m_Size = (uint64_t)status.st_size;
+
+	void* data = m_Size > 0 ? mmap(nullptr, m_Size, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+	close(file);
+	if (data != MAP_FAILED)
+	{
+		m_Data = static_cast<const uint8_t*>(data);
+
+		//The bricks are read in whatever order the camera wants them
+		madvise(data, m_Size, MADV_RANDOM);
+	}
+#endif
+
+	if (!m_Data)
+	{
+		Unmap();
+		throw std::runtime_error("SdfBrickFile::SdfBrickFile() >> Failed to map " + fileName);
+	}
+
+	//The sections have to be where the counts put them, that also keeps a truncated file from being read past its end
+	Header expected{};
+	bool valid = m_Size >= sizeof(Header) && GetHeader().magic == Magic && GetHeader().version == Version;
+	if (valid)
+	{
+		expected = GetHeader();
+		LayOutSections(expected);
+		valid = expected.cellsOffset == GetHeader().cellsOffset && expected.brickCellsOffset == GetHeader().brickCellsOffset
+			&& expected.fallbacksOffset == GetHeader().fallbacksOffset && expected.rangesOffset == GetHeader().rangesOffset
+			&& expected.bricksOffset == GetHeader().bricksOffset && expected.format < SDF_BRICK_FORMAT_COUNT
+			&& expected.brickBytes == MeshSdfBaker::GetBrickBytes(expected.format) && expected.bricksOffset + (uint64_t)expected.brickCount * expected.brickBytes <= m_Size;
+	}
+
+	if (!valid)
+	{
+		Unmap();
+		throw std::runtime_error("SdfBrickFile::SdfBrickFile() >> " + fileName + " isn't a brick file of version " + std::to_string(Version));
+	}
+}
+
+SdfBrickFile::~SdfBrickFile()
+{
+	Unmap();
+}
+
+void SdfBrickFile::Unmap()
+{
+#ifdef _WIN32
+	if (m_Data)
+		UnmapViewOfFile(m_Data);
+	if (m_Mapping)
+		CloseHandle(m_Mapping);
+	if (m_File && m_File != INVALID_HANDLE_VALUE)
+		CloseHandle(m_File);
+	m_Mapping = nullptr;
+	m_File = nullptr;
+#else
+	if (m_Data)
+		munmap(const_cast<uint8_t*>(m_Data), m_Size);
+#endif
+	m_Data = nullptr;
+}
+
+std::string SdfBrickFile::GetCachePath(const std::string& objFile, uint32_t resolution, SdfBrickFormat format)
+{
+	std::string name = std::filesystem::path(objFile).stem().string() + "_" + std::to_string(resolution);
+	if (format != SDF_BRICK_FLOAT32)
+	{
+		name += "_";
+		for (const char* c = SdfBrickFormatNames[format]; *c; ++c)
+			name += (char)tolower(*c);
+	}
+	return (std::filesystem::path(objFile).parent_path() / (name + ".sdfbricks")).generic_string();
+}
+
+uint64_t SdfBrickFile::GetSourceStamp(const std::string& objFile)
+{
+	std::error_code error;
+	uint64_t size = std::filesystem::file_size(objFile, error);
+	if (error)
+		return 0;
+
+	uint64_t time = (uint64_t)std::filesystem::last_write_time(objFile, error).time_since_epoch().count();
+	return std::hash<std::string>{}(std::to_string(size) + ":" + std::to_string(time));
+}
+
+bool SdfBrickFile::IsCurrent(const std::string& fileName, uint32_t resolution, uint64_t sourceStamp, SdfBrickFormat format)
+{
+	Header header;
+	return ReadHeader(fileName, header) && header.resolution == resolution && header.sourceStamp == sourceStamp && header.format == format;
+}
+
+void SdfBrickFile::Write(const std::string& fileName, const SdfBrickMap& brickMap, uint32_t resolution, uint64_t sourceStamp)
+{
+	Header header{};
+	header.magic = Magic;
+	header.version = Version;
+	header.resolution = resolution;
+	header.brickCount = brickMap.GetBrickCount();
+	header.format = SDF_BRICK_FLOAT32;
+	header.brickBytes = MeshSdfBaker::GetBrickBytes(SDF_BRICK_FLOAT32);
+	header.sourceStamp = sourceStamp;
+	header.cellCount = brickMap.cellCount;
+	header.voxelSize = brickMap.voxelSize;
+	header.boundsMin = brickMap.boundsMin;
+	header.boundsMax = brickMap.boundsMax;
+	LayOutSections(header);
+
+	std::vector<uint32_t> cells = brickMap.cells;
+	for (uint32_t brick = 0; brick < header.brickCount; ++brick)
+		cells[brickMap.brickCells[brick]] = brickMap.brickFallbacks[brick];
+
+	std::vector<glm::vec2> ranges(header.brickCount, glm::vec2(0.0f, 1.0f));
+	WriteFile(fileName, header, cells.data(), brickMap.brickCells.data(), brickMap.brickFallbacks.data(), ranges.data(), reinterpret_cast<const uint8_t*>(brickMap.bricks.data()));
+}
+
+void SdfBrickFile::WriteEncoded(const std::string& fileName, const SdfBrickFile& source, SdfBrickFormat format)
+{
+	if (source.GetHeader().format != SDF_BRICK_FLOAT32)
+		throw std::runtime_error("SdfBrickFile::WriteEncoded() >> " + source.GetFileName() + " isn't Float32");
+
+	Header header = source.GetHeader();
+	header.format = format;
+	header.brickBytes = MeshSdfBaker::GetBrickBytes(format);
+	LayOutSections(header);
+
+	//The error is measured against the float samples, in voxels
+	std::vector<glm::vec2> ranges(header.brickCount);
+	std::vector<uint8_t> bricks((size_t)header.brickCount * header.brickBytes);
+	std::vector<float> decoded(SdfBrickMap::BrickSampleCount);
+	double squaredError = 0.0;
+	float maxError = 0.0f;
+	for (uint32_t brick = 0; brick < header.brickCount; ++brick)
+	{
+		const float* samples = reinterpret_cast<const float*>(source.GetBrick(brick));
+		uint8_t* encoded = bricks.data() + (size_t)brick * header.brickBytes;
+		ranges[brick] = MeshSdfBaker::EncodeBrick(samples, format, encoded);
+		MeshSdfBaker::DecodeBrick(encoded, format, ranges[brick], decoded.data());
+
+		for (uint32_t i = 0; i < SdfBrickMap::BrickSampleCount; ++i)
+		{
+			float error = glm::abs(decoded[i] - samples[i]) / header.voxelSize;
+			squaredError += (double)error * error;
+			maxError = glm::max(maxError, error);
+		}
+	}
+
+	WriteFile(fileName, header, source.GetCells(), source.GetBrickCells(), source.GetBrickFallbacks(), ranges.data(), bricks.data());
+
+	uint64_t sampleCount = (uint64_t)header.brickCount * SdfBrickMap::BrickSampleCount;
+	float sourceMegabytes = (float)((uint64_t)header.brickCount * source.GetHeader().brickBytes) / (1024.0f * 1024.0f);
+	float encodedMegabytes = (float)bricks.size() / (1024.0f * 1024.0f);
+	std::cout << "Encoded " << header.brickCount << " bricks as " << SdfBrickFormatNames[format] << ": " << encodedMegabytes << " MB instead of " << sourceMegabytes
+		<< " MB, error " << (sampleCount > 0 ? sqrt(squaredError / (double)sampleCount) : 0.0) << " voxels RMS and " << maxError << " voxels at most\n";
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "MeshSdfBaker.h"
+
+//Baked brick map on disk, read through a memory mapping so only the pages of the bricks that get streamed in are ever loaded.
+//Every section starts on a page boundary and every brick on a multiple of its own size:
+//	Header
+//	cells		one entry per cell like SdfBrickMap, but the cells with a brick hold its fallback, so it's the page table with nothing resident
+//	brick cells	per brick, the cell it belongs to
+//	fallbacks	per brick, the entry its cell gets back when the brick is evicted
+//	ranges		per brick, the range its samples are normalized to
+//	bricks		GetBrickBytes() per brick in the format of the file
+class SdfBrickFile
+{
+public:
+	static const uint32_t Magic = 0x42464453;	//"SDFB"
+	static const uint32_t Version = 2;
+	static const uint64_t SectionAlignment = 4096;
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t resolution;	//Requested from the baker, with sourceStamp it tells whether the file is still current
+		uint32_t brickCount;
+		SdfBrickFormat format;
+		uint32_t brickBytes;
+		uint64_t sourceStamp;
+		glm::uvec3 cellCount;
+		float voxelSize;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		uint64_t cellsOffset;
+		uint64_t brickCellsOffset;
+		uint64_t fallbacksOffset;
+		uint64_t rangesOffset;
+		uint64_t bricksOffset;
+	};
+
+	//Maps the file, throws std::runtime_error when it can't be opened or isn't a brick file of this version
+	explicit SdfBrickFile(const std::string& fileName);
+	~SdfBrickFile();
+
+	SdfBrickFile(const SdfBrickFile&) = delete;
+	SdfBrickFile& operator=(const SdfBrickFile&) = delete;
+
+	const std::string& GetFileName() const { return m_FileName; }
+	const Header& GetHeader() const { return *reinterpret_cast<const Header*>(m_Data); }
+	uint32_t GetCellCount() const { return GetHeader().cellCount.x * GetHeader().cellCount.y * GetHeader().cellCount.z; }
+	uint32_t GetBrickCount() const { return GetHeader().brickCount; }
+
+	const uint32_t* GetCells() const { return reinterpret_cast<const uint32_t*>(m_Data + GetHeader().cellsOffset); }
+	const uint32_t* GetBrickCells() const { return reinterpret_cast<const uint32_t*>(m_Data + GetHeader().brickCellsOffset); }
+	const uint32_t* GetBrickFallbacks() const { return reinterpret_cast<const uint32_t*>(m_Data + GetHeader().fallbacksOffset); }
+	const glm::vec2* GetBrickRanges() const { return reinterpret_cast<const glm::vec2*>(m_Data + GetHeader().rangesOffset); }
+	const uint8_t* GetBrick(uint32_t brick) const { return m_Data + GetHeader().bricksOffset + (uint64_t)brick * GetHeader().brickBytes; }
+
+	//Where the bricks of an OBJ baked at a resolution are kept in a format, next to the OBJ
+	static std::string GetCachePath(const std::string& objFile, uint32_t resolution, SdfBrickFormat format);
+
+	//Changes whenever the OBJ is written to, 0 when it doesn't exist
+	static uint64_t GetSourceStamp(const std::string& objFile);
+
+	//Whether the file exists and was baked from this version of the OBJ at this resolution and in this format, without mapping it
+	static bool IsCurrent(const std::string& fileName, uint32_t resolution, uint64_t sourceStamp, SdfBrickFormat format);
+
+	//Writes the bricks as Float32. Writes next to the file and renames it over it at the end, so a bake that fails halfway never
+	//leaves a broken file behind. Throws std::runtime_error when it can't be written.
+	static void Write(const std::string& fileName, const SdfBrickMap& brickMap, uint32_t resolution, uint64_t sourceStamp);
+
+	//Encodes the bricks of a Float32 file in another format and prints the memory it saves and the error it adds
+	static void WriteEncoded(const std::string& fileName, const SdfBrickFile& source, SdfBrickFormat format);
+
+private:
+	void Unmap();
+
+	std::string m_FileName;
+	const uint8_t* m_Data = nullptr;
+	uint64_t m_Size = 0;
+
+#ifdef _WIN32
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+#endif
+};
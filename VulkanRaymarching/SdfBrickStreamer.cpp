@@ -0,0 +1,105 @@
+#include "pch.h"
+#include "SdfBrickStreamer.h"
+#include <algorithm>
+#include <numeric>
+
+SdfBrickStreamer::SdfBrickStreamer(const SdfBrickFile& file, uint32_t slotCount)
+	: m_File(file)
+{
+	const SdfBrickFile::Header& header = file.GetHeader();
+	float cellSize = (float)(SdfBrickMap::BrickSize - 1) * header.voxelSize;
+	m_BrickRadius = 0.5f * sqrt(3.0f) * cellSize;
+
+	uint32_t brickCount = file.GetBrickCount();
+	m_BrickCenters.resize(brickCount);
+	for (uint32_t brick = 0; brick < brickCount; ++brick)
+	{
+		uint32_t cell = file.GetBrickCells()[brick];
+		glm::uvec3 coordinate{ cell % header.cellCount.x, (cell / header.cellCount.x) % header.cellCount.y, cell / (header.cellCount.x * header.cellCount.y) };
+		m_BrickCenters[brick] = header.boundsMin + (glm::vec3(coordinate) + 0.5f) * cellSize;
+	}
+
+	m_BrickSlots.assign(brickCount, InvalidSlot);
+	m_WantedUpdate.assign(brickCount, 0);
+	m_SlotBricks.assign(slotCount, InvalidSlot);
+	m_LruPositions.resize(slotCount);
+	for (uint32_t slot = 0; slot < slotCount; ++slot)
+		m_LruPositions[slot] = m_LruSlots.insert(m_LruSlots.end(), slot);
+
+	m_Order.resize(brickCount);
+	std::iota(m_Order.begin(), m_Order.end(), 0u);
+	m_Priorities.resize(brickCount);
+}
+
+void SdfBrickStreamer::Update(const std::vector<glm::vec4>& viewPoints, uint32_t maxUploads, std::vector<BrickUpload>& uploads, std::vector<CellUpdate>& cellUpdates)
+{
+	uint32_t brickCount = m_File.GetBrickCount();
+	if (viewPoints.empty() || brickCount == 0 || m_SlotBricks.empty())
+	{
+		m_MissingCount = 0;
+		return;
+	}
+
+	//Nothing moved and everything that's wanted is there already
+	if (viewPoints == m_LastViewPoints && m_MissingCount == 0)
+		return;
+	m_LastViewPoints = viewPoints;
+	++m_UpdateCount;
+
+	//World distance from the viewer to the closest point of the brick in any of the places the mesh is used
+	for (uint32_t brick = 0; brick < brickCount; ++brick)
+	{
+		float priority = std::numeric_limits<float>::max();
+		for (const glm::vec4& viewPoint : viewPoints)
+			priority = glm::min(priority, glm::max(glm::length(glm::vec3(viewPoint) - m_BrickCenters[brick]) - m_BrickRadius, 0.0f) * viewPoint.w);
+		m_Priorities[brick] = priority;
+	}
+
+	uint32_t wantedCount = glm::min(GetSlotCount(), brickCount);
+	auto closer = [&](uint32_t a, uint32_t b) { return m_Priorities[a] < m_Priorities[b]; };
+	std::nth_element(m_Order.begin(), m_Order.begin() + (wantedCount - 1), m_Order.end(), closer);
+	std::sort(m_Order.begin(), m_Order.begin() + wantedCount, closer);
+
+	//Furthest first, so the closest end up as the most recently wanted
+	for (uint32_t i = wantedCount; i-- > 0;)
+	{
+		uint32_t brick = m_Order[i];
+		m_WantedUpdate[brick] = m_UpdateCount;
+		if (m_BrickSlots[brick] != InvalidSlot)
+			m_LruSlots.splice(m_LruSlots.end(), m_LruSlots, m_LruPositions[m_BrickSlots[brick]]);
+	}
+
+	//The wanted bricks are all at the back now, so the front is free or not wanted anymore
+	uint32_t uploadCount = 0;
+	m_MissingCount = 0;
+	for (uint32_t i = 0; i < wantedCount; ++i)
+	{
+		uint32_t brick = m_Order[i];
+		if (m_BrickSlots[brick] != InvalidSlot)
+			continue;
+
+		uint32_t slot = m_LruSlots.front();
+		uint32_t evicted = m_SlotBricks[slot];
+		if (uploadCount == maxUploads || (evicted != InvalidSlot && m_WantedUpdate[evicted] == m_UpdateCount))
+		{
+			++m_MissingCount;
+			continue;
+		}
+
+		if (evicted != InvalidSlot)
+		{
+			m_BrickSlots[evicted] = InvalidSlot;
+			cellUpdates.push_back({ m_File.GetBrickCells()[evicted], m_File.GetBrickFallbacks()[evicted] });
+			--m_ResidentCount;
+		}
+
+		m_SlotBricks[slot] = brick;
+		m_BrickSlots[brick] = slot;
+		m_LruSlots.splice(m_LruSlots.end(), m_LruSlots, m_LruPositions[slot]);
+		++m_ResidentCount;
+		++uploadCount;
+
+		uploads.push_back({ brick, slot });
+		cellUpdates.push_back({ m_File.GetBrickCells()[brick], SdfBrickMap::EncodeBrick(slot) });
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <list>
+#include "SdfBrickFile.h"
+
+//Decides which bricks of a brick file live in a GPU atlas with a fixed number of slots.
+//The bricks closest to the viewer are wanted, as many as there are slots. A wanted brick that isn't resident takes the slot of
+//the least recently wanted one, so bricks that drop out of the wanted set stay until their slot is needed for a closer one.
+class SdfBrickStreamer
+{
+public:
+	struct BrickUpload
+	{
+		uint32_t brick;	//In the file
+		uint32_t slot;	//In the atlas, x fastest like SdfBrickMap::GetAtlasLayout()
+	};
+
+	struct CellUpdate
+	{
+		uint32_t cell;
+		uint32_t entry;
+	};
+
+	static constexpr uint32_t InvalidSlot = ~0u;
+
+	SdfBrickStreamer(const SdfBrickFile& file, uint32_t slotCount);
+
+	//The viewer in the space of every Mesh node (xyz) and the scale of that space (w), see SceneDescription::GetMeshSpacePoints().
+	//Adds the closest at most maxUploads missing bricks to uploads and the page table entries that change with them to cellUpdates.
+	void Update(const std::vector<glm::vec4>& viewPoints, uint32_t maxUploads, std::vector<BrickUpload>& uploads, std::vector<CellUpdate>& cellUpdates);
+
+	uint32_t GetSlotCount() const { return (uint32_t)m_SlotBricks.size(); }
+	uint32_t GetResidentCount() const { return m_ResidentCount; }
+	uint32_t GetMissingCount() const { return m_MissingCount; }	//Wanted bricks that didn't fit in the uploads of the last update
+
+private:
+	const SdfBrickFile& m_File;
+
+	std::vector<glm::vec3> m_BrickCenters;
+	float m_BrickRadius;
+
+	std::vector<uint32_t> m_BrickSlots;	//InvalidSlot when the brick isn't resident
+	std::vector<uint32_t> m_SlotBricks;	//InvalidSlot when the slot is free
+	std::vector<uint32_t> m_WantedUpdate;	//Update a brick was last wanted in
+
+	//Every slot, free and least recently wanted first
+	std::list<uint32_t> m_LruSlots;
+	std::vector<std::list<uint32_t>::iterator> m_LruPositions;
+
+	std::vector<uint32_t> m_Order;
+	std::vector<float> m_Priorities;
+	std::vector<glm::vec4> m_LastViewPoints;
+	uint32_t m_UpdateCount = 0;
+	uint32_t m_ResidentCount = 0;
+	uint32_t m_MissingCount = 0;
+};
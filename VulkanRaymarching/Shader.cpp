@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "Shader.h"
 #include <fstream>
+#include <algorithm>
 
 Shader::Shader(const VkDevice& device, const std::string& vertShaderFile, const std::string& fragShaderFile)
 	:m_Device(device), m_VertLocation(vertShaderFile), m_FragLocation(fragShaderFile)
@@ -47,6 +48,38 @@ void Shader::LoadComputeShader()
 {
 	auto computeShaderCode = ReadFile(m_ComputeLocation);
 	m_ComputeShaderModule = CreateShaderModule(m_Device, computeShaderCode);
+	FindSpecializationConstants(computeShaderCode);
+}
+
+bool Shader::HasSpecializationConstant(uint32_t constantId) const
+{
+	return std::find(m_SpecializationConstantIds.begin(), m_SpecializationConstantIds.end(), constantId) != m_SpecializationConstantIds.end();
+}
+
+void Shader::FindSpecializationConstants(const std::vector<char>& byteCode)
+{
+	const uint32_t opDecorate = 71;
+	const uint32_t decorationSpecId = 1;
+
+	m_SpecializationConstantIds.clear();
+
+	//Skip the 5 word header, every instruction stores its word count in the upper 16 bits of the first word
+	const uint32_t* words = reinterpret_cast<const uint32_t*>(byteCode.data());
+	size_t wordCount = byteCode.size() / sizeof(uint32_t);
+	size_t i = 5;
+	while (i < wordCount)
+	{
+		uint32_t instructionLength = words[i] >> 16;
+		uint32_t opCode = words[i] & 0xFFFF;
+		if (instructionLength == 0)
+			break;
+
+		//OpDecorate <target> SpecId <constant_id>
+		if (opCode == opDecorate && instructionLength == 4 && i + 3 < wordCount && words[i + 2] == decorationSpecId)
+			m_SpecializationConstantIds.push_back(words[i + 3]);
+
+		i += instructionLength;
+	}
 }
 
 std::vector<char> Shader::ReadFile(const std::string& fileName)
@@ -14,6 +14,9 @@ public:
 	const VkShaderModule& GetComputeShaderModule() { return m_ComputeShaderModule; }
 	const VkDescriptorSetLayout& GetDescriptorSetLayout() { return m_descriptorSetLayout; }
 
+	//True when the compute shader declares a specialization constant with this constant_id
+	bool HasSpecializationConstant(uint32_t constantId) const;
+
 	virtual void InitDescriptors(int overlappingFrames, VkEngine* engine) = 0; //TODO: make abstract
 	virtual void UpdateShaderVariables(int currentFrame, VkEngine* engine) = 0;
 
@@ -34,6 +37,7 @@ private:
 
 	std::vector<char> ReadFile(const std::string& fileName);
 	VkShaderModule CreateShaderModule(const VkDevice& device, const std::vector<char>& byteCode);
+	void FindSpecializationConstants(const std::vector<char>& byteCode);
 
 	VkShaderModule m_VertShaderModule = VK_NULL_HANDLE;
 	VkShaderModule m_FragShaderModule = VK_NULL_HANDLE;
@@ -42,4 +46,6 @@ private:
 	std::string m_VertLocation;
 	std::string m_FragLocation;
 	std::string m_ComputeLocation;
+
+	std::vector<uint32_t> m_SpecializationConstantIds;
 };
\ No newline at end of file
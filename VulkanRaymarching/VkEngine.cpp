@@ -1,8 +1,11 @@
 #include "pch.h"
 #include "VkEngine.h"
 #include "ComputeShader.h"
+#include "CubemapShader.h"
+#include "SceneShaderGenerator.h"
 #include <string>
 #include <chrono>
+#include <filesystem>
 
 static bool isMouseHidden = true;
 
@@ -57,8 +60,14 @@ void VkEngine::Init()
 	InitFramebuffers();
 	InitCommands();
 	InitSyncStructures();
+	InitQueries();
 	LoadTextures();
+	InitSkyboxCubemap();
+	InitStorageImages();
+	InitMeshVolume();
+	InitSceneInstances();
 	InitShaders();
+	InitMaterials();
 	InitDescriptors();
 	InitPipelines();
 
@@ -90,10 +99,223 @@ void VkEngine::Cleanup()
 
 void VkEngine::ReloadShaders()
 {
+	//The frames in flight can still be using the pipelines
+	vkDeviceWaitIdle(m_Device);
 	CleanPipelines();
 
 	m_ComputeShader->ReloadShader(m_CurrentShader);
 	InitPipelines();
+
+	//A different shader can show a different scene
+	m_StaticFrameCount = 0;
+	m_GBufferValid = false;
+	m_DepthHistoryValid = false;
+	m_TemporalHistoryValid = false;
+}
+
+void VkEngine::StartSceneShaderBuild(const SceneDescription& scene)
+{
+	if (!SceneShaderGenerator::IsCachedShader(m_CurrentShader))
+		m_SceneBaseShader = m_CurrentShader;
+
+	//The interpreter keeps the scene on screen until the generated shader is there
+	m_GeneratedShader.clear();
+	m_GeneratedShaderReady = false;
+
+	std::string shaderSource = SceneShaderGenerator::GetShaderSource(m_SceneBaseShader);
+	if (shaderSource.empty())
+		return;
+
+	SceneShaderGenerator generator{ scene };
+	m_GeneratedShader = SceneShaderGenerator::GetCachedShaderPath(generator.GetCode(), shaderSource);
+	if (std::filesystem::exists(m_GeneratedShader))
+	{
+		m_GeneratedShaderReady = true;
+		return;
+	}
+
+	for (const SceneShaderBuild& build : m_SceneShaderBuilds)
+	{
+		if (build.shaderPath == m_GeneratedShader)
+			return;
+	}
+
+	std::cout << "Compiling " << scene.GetFileName() << " into " << m_GeneratedShader << "\n";
+	std::string code = generator.GetCode();
+	std::string output = m_GeneratedShader;
+	m_SceneShaderBuilds.push_back({ m_GeneratedShader, std::async(std::launch::async, [code, shaderSource, output]()
+		{
+			return SceneShaderGenerator::CompileShader(code, shaderSource, output);
+		}) });
+}
+
+void VkEngine::UpdateSceneShader()
+{
+	//Builds of scenes that were swapped out in the meantime only end up in the cache
+	for (auto it = m_SceneShaderBuilds.begin(); it != m_SceneShaderBuilds.end();)
+	{
+		if (it->succeeded.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			++it;
+			continue;
+		}
+
+		bool succeeded = it->succeeded.get();
+		if (it->shaderPath == m_GeneratedShader)
+		{
+			m_GeneratedShaderReady = succeeded;
+			if (!succeeded)
+				std::cout << "VkEngine::UpdateSceneShader() >> Failed to compile " << m_GeneratedShader << ", staying on the interpreter\n";
+		}
+		it = m_SceneShaderBuilds.erase(it);
+	}
+
+	bool useGenerated = m_UseGeneratedScene && m_GeneratedShaderReady;
+	if (useGenerated && m_CurrentShader != m_GeneratedShader)
+	{
+		m_CurrentShader = m_GeneratedShader;
+		ReloadShaders();
+	}
+	else if (!useGenerated && SceneShaderGenerator::IsCachedShader(m_CurrentShader))
+	{
+		m_CurrentShader = m_SceneBaseShader;
+		ReloadShaders();
+	}
+}
+
+void VkEngine::StartSceneBenchmark()
+{
+	m_SavedUseGeneratedScene = m_UseGeneratedScene;
+	m_SavedStaticSceneMode = m_StaticSceneMode;
+	m_SavedQualityGovernor = m_QualityGovernor;
+
+	m_SceneBenchmarkRunning = true;
+	m_SceneBenchmarkStep = 0;
+	m_SceneBenchmarkFrame = 0;
+	m_SceneBenchmarkResult = glm::vec2(0.0f);
+}
+
+void VkEngine::UpdateSceneBenchmark()
+{
+	//The interpreter first and then the generated shader, with every frame rendered at the same quality
+	m_UseGeneratedScene = m_SceneBenchmarkStep == 1;
+	m_StaticSceneMode = STATIC_RENDER;
+	m_QualityGovernor = false;
+
+	if (!m_GeneratedShaderReady)
+	{
+		std::cout << "Scene benchmark >> The scene changed, stopped\n";
+		m_UseGeneratedScene = m_SavedUseGeneratedScene;
+		m_StaticSceneMode = m_SavedStaticSceneMode;
+		m_QualityGovernor = m_SavedQualityGovernor;
+		m_SceneBenchmarkRunning = false;
+	}
+}
+
+void VkEngine::ReadSceneBenchmark()
+{
+	//Frames from before the switch don't count
+	bool generatedActive = SceneShaderGenerator::IsCachedShader(m_CurrentShader);
+	if (!m_SceneBenchmarkRunning || generatedActive != (m_SceneBenchmarkStep == 1))
+		return;
+
+	if (++m_SceneBenchmarkFrame <= m_SceneBenchmarkWarmupFrames)
+		return;
+
+	m_SceneBenchmarkResult[m_SceneBenchmarkStep] += m_ComputeTimeMs / (float)m_SceneBenchmarkFrames;
+	if (m_SceneBenchmarkFrame < m_SceneBenchmarkWarmupFrames + m_SceneBenchmarkFrames)
+		return;
+
+	m_SceneBenchmarkFrame = 0;
+	if (++m_SceneBenchmarkStep < 2)
+		return;
+
+	float speedup = m_SceneBenchmarkResult.y > 0.0f ? m_SceneBenchmarkResult.x / m_SceneBenchmarkResult.y : 0.0f;
+	std::cout << "Scene benchmark >> " << m_CurrentScene << ": interpreter " << m_SceneBenchmarkResult.x << " ms, generated " << m_SceneBenchmarkResult.y << " ms (" << speedup << "x)\n";
+
+	m_UseGeneratedScene = m_SavedUseGeneratedScene;
+	m_StaticSceneMode = m_SavedStaticSceneMode;
+	m_QualityGovernor = m_SavedQualityGovernor;
+	m_SceneBenchmarkRunning = false;
+}
+
+void VkEngine::StartBrickBenchmark()
+{
+	m_SavedMeshBrickFormat = m_MeshBrickFormat;
+	m_SavedStaticSceneMode = m_StaticSceneMode;
+	m_SavedQualityGovernor = m_QualityGovernor;
+
+	m_BrickBenchmarkRunning = true;
+	m_BrickBenchmarkStep = 0;
+	m_BrickBenchmarkFrame = 0;
+	m_BrickBenchmarkResults.assign(SDF_BRICK_FORMAT_COUNT, 0.0f);
+	m_BrickBenchmarkResident.assign(SDF_BRICK_FORMAT_COUNT, 0);
+	SkipUnsupportedBrickFormats();
+}
+
+void VkEngine::SkipUnsupportedBrickFormats()
+{
+	while (m_BrickBenchmarkStep < SDF_BRICK_FORMAT_COUNT && !IsMeshBrickFormatSupported((SdfBrickFormat)m_BrickBenchmarkStep))
+		++m_BrickBenchmarkStep;
+}
+
+void VkEngine::UpdateBrickBenchmark()
+{
+	//Switching formats waits for the GPU, so it happens here rather than where the timings are read. Loading a scene clears the results
+	bool sceneChanged = m_BrickBenchmarkResults.empty();
+	if (!sceneChanged && m_BrickBenchmarkStep < SDF_BRICK_FORMAT_COUNT)
+	{
+		m_StaticSceneMode = STATIC_RENDER;
+		m_QualityGovernor = false;
+		SetMeshBrickFormat((SdfBrickFormat)m_BrickBenchmarkStep);
+		if (m_MeshBrickStreamer && m_MeshBrickFile->GetHeader().format == m_BrickBenchmarkStep)
+			return;
+		sceneChanged = true;
+	}
+
+	if (sceneChanged)
+	{
+		std::cout << "Brick benchmark >> The scene changed, stopped\n";
+	}
+	else
+	{
+		float floatTime = m_BrickBenchmarkResults[SDF_BRICK_FLOAT32];
+		std::cout << "Brick benchmark >> " << m_CurrentScene << ":";
+		for (uint32_t format = 0; format < SDF_BRICK_FORMAT_COUNT; ++format)
+		{
+			float time = m_BrickBenchmarkResults[format];
+			if (time > 0.0f)
+				std::cout << " " << SdfBrickFormatNames[format] << " " << time << " ms (" << (floatTime > 0.0f ? floatTime / time : 0.0f) << "x, " << m_BrickBenchmarkResident[format] << " bricks)";
+		}
+		std::cout << "\n";
+	}
+
+	SetMeshBrickFormat(m_SavedMeshBrickFormat);
+	m_StaticSceneMode = m_SavedStaticSceneMode;
+	m_QualityGovernor = m_SavedQualityGovernor;
+	m_BrickBenchmarkRunning = false;
+}
+
+void VkEngine::ReadBrickBenchmark()
+{
+	//Frames from before the switch don't count, and neither do the ones that still stream bricks in
+	if (!m_BrickBenchmarkRunning || m_BrickBenchmarkResults.empty() || m_BrickBenchmarkStep == SDF_BRICK_FORMAT_COUNT || !m_MeshBrickStreamer
+		|| m_MeshBrickFile->GetHeader().format != m_BrickBenchmarkStep)
+		return;
+	if (m_BrickBenchmarkFrame == 0 && (m_MeshBrickStreamer->GetMissingCount() > 0 || m_MeshBrickUploads > 0))
+		return;
+
+	if (++m_BrickBenchmarkFrame <= m_SceneBenchmarkWarmupFrames)
+		return;
+
+	m_BrickBenchmarkResults[m_BrickBenchmarkStep] += m_ComputeTimeMs / (float)m_SceneBenchmarkFrames;
+	if (m_BrickBenchmarkFrame < m_SceneBenchmarkWarmupFrames + m_SceneBenchmarkFrames)
+		return;
+
+	m_BrickBenchmarkResident[m_BrickBenchmarkStep] = m_MeshBrickStreamer->GetResidentCount();
+	m_BrickBenchmarkFrame = 0;
+	++m_BrickBenchmarkStep;
+	SkipUnsupportedBrickFormats();
 }
 
 void VkEngine::Run()
@@ -101,24 +323,41 @@ void VkEngine::Run()
 	while (!glfwWindowShouldClose(m_pWindow))
 	{
 		glfwPollEvents();
+		if (!m_FrameAcquired)
+			AcquireFrame();
 		Update();
 
 		//Imgui
 		m_ImGui.Draw();
 
+		//Presenting the cached frame again would show the same image, wait for input instead. The timeout keeps polling background builds.
+		if (m_PresentCachedFrame && m_CachedFramePresented && m_ImGui.IsIdle())
+		{
+			glfwWaitEventsTimeout(m_IdleWaitSeconds);
+			continue;
+		}
+
 		Draw();
 	}
 
 	vkDeviceWaitIdle(m_Device);
 }
 
+void VkEngine::AcquireFrame()
+{
+	//The descriptor sets write to their own swapchain image, so the acquired image picks the buffers Update() writes to as well
+	m_AcquireSemaphore = GetCurrentFrame().presentSemaphore;
+	VK_CHECK(vkAcquireNextImageKHR(m_Device, m_Swapchain, UINT64_MAX, m_AcquireSemaphore, nullptr, &m_FrameIndex), "VkEngine::AcquireFrame() >> Failed to acquire next image in swapchain!");
+	m_FrameAcquired = true;
+}
+
 void VkEngine::Draw()
 {
-	uint32_t currentFrame;
-	VK_CHECK(vkAcquireNextImageKHR(m_Device, m_Swapchain, UINT64_MAX, GetCurrentFrame().presentSemaphore, nullptr, &currentFrame), "VkEngine::Draw() >> Failed to acquire next image in swapchain!");
+	DrawCompute(m_FrameIndex);
+	DrawGraphics(m_FrameIndex);
 
-	DrawCompute(currentFrame);
-	DrawGraphics(currentFrame);
+	m_CachedFramePresented = m_PresentCachedFrame;
+	m_FrameAcquired = false;
 }
 
 FrameData& VkEngine::GetCurrentFrame()
@@ -135,16 +374,28 @@ void VkEngine::DrawCompute(uint32_t frameNumber)
 	VkCommandBufferBeginInfo beginInfo = vkInit::CommandBufferBeginInfo(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 	VK_CHECK(vkBeginCommandBuffer(m_Frames[frameNumber].computeCommandBuffer, &beginInfo), "VkEngine::DrawCompute() >> Failed to begin command buffer!");
 
-	//Bind compute pipeline
-	vkCmdBindPipeline(m_Frames[frameNumber].computeCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_ComputePipeline);
+	//Scene edits and bricks are copied in before anything reads them, outside of the timing so it stays the cost of the render mode
+	m_ComputeShader->RecordScenePatches(m_Frames[frameNumber].computeCommandBuffer, m_StagingRing.buffer);
+	RecordInstanceBvh(m_Frames[frameNumber].computeCommandBuffer);
+	RecordMeshStreaming(m_Frames[frameNumber].computeCommandBuffer);
+
+	//Start timing the compute work of this frame
+	vkCmdResetQueryPool(m_Frames[frameNumber].computeCommandBuffer, m_TimestampQueryPool, frameNumber * 2, 2);
+	vkCmdWriteTimestamp(m_Frames[frameNumber].computeCommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_TimestampQueryPool, frameNumber * 2);
 
 	//bind descriptor sets
 	vkCmdBindDescriptorSets(m_Frames[frameNumber].computeCommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_ComputePipelineLayout, 0, 1, &m_ComputeShader->GetDescriptorSet(frameNumber), 0, nullptr);
 
-	//Dispatch compute
-	uint32_t groupsX = (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f);
-	uint32_t groupsY = (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f);
-	vkCmdDispatch(m_Frames[frameNumber].computeCommandBuffer, groupsX, groupsY, 1);
+	if (m_CollectStatistics)
+		vkCmdFillBuffer(m_Frames[frameNumber].computeCommandBuffer, m_ComputeShader->GetStatisticsBuffer(frameNumber).buffer, 0, VK_WHOLE_SIZE, 0);
+
+	//Nothing changed, refine or re-present the cached frame instead of rendering it again
+	if (m_PresentCachedFrame || m_RefinementSample > 0)
+		RecordStaticFrame(m_Frames[frameNumber].computeCommandBuffer);
+	else
+		RecordRenderMode(m_Frames[frameNumber].computeCommandBuffer);
+
+	vkCmdWriteTimestamp(m_Frames[frameNumber].computeCommandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_TimestampQueryPool, frameNumber * 2 + 1);
 
 	VK_CHECK(vkEndCommandBuffer(m_Frames[frameNumber].computeCommandBuffer), "VkEngine::DrawCompute() Failed to end command buffer!");
 
@@ -155,13 +406,324 @@ void VkEngine::DrawCompute(uint32_t frameNumber)
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &m_Frames[frameNumber].computeCommandBuffer;
 	submitInfo.waitSemaphoreCount = 1; //wait untill the image is good to go
-	submitInfo.pWaitSemaphores = &m_Frames[frameNumber].presentSemaphore;
+	submitInfo.pWaitSemaphores = &m_AcquireSemaphore;
 	submitInfo.pWaitDstStageMask = &waitPipelineFlag;
 	submitInfo.signalSemaphoreCount = 1;
 	submitInfo.pSignalSemaphores = &m_Frames[frameNumber].computeSempahore;
 	vkQueueSubmit(m_ComputeQueue, 1, &submitInfo, VK_NULL_HANDLE);
 }
 
+void VkEngine::RecordRenderMode(VkCommandBuffer cmd)
+{
+	if (UseTemporalReprojection())
+		RecordReprojection(cmd);
+
+	if (m_RenderMode != RENDER_DEFERRED && GetActiveLightingScale() > 1)
+		RecordLightingPrepass(cmd);
+
+	bool temporalUpsampling = m_RenderMode == RENDER_TEMPORAL_UPSAMPLING && m_StagePipelines[STAGE_TAAU_RESOLVE] != VK_NULL_HANDLE;
+	bool interleaved = m_RenderMode == RENDER_INTERLEAVED && m_StagePipelines[STAGE_INTERLEAVED_RESOLVE] != VK_NULL_HANDLE;
+	if (temporalUpsampling)
+		RecordTemporalUpsampling(cmd);
+	else if (interleaved)
+		RecordInterleaved(cmd);
+	else if (m_RenderMode == RENDER_FOVEATED && m_StagePipelines[STAGE_FOVEATED] != VK_NULL_HANDLE)
+		RecordFoveated(cmd);
+	else if (m_RenderMode == RENDER_DEFERRED && m_StagePipelines[STAGE_DEFERRED_LIGHTING] != VK_NULL_HANDLE)
+		RecordDeferred(cmd);
+	else if (m_RenderMode == RENDER_WAVEFRONT && m_StagePipelines[STAGE_PRIMARY] != VK_NULL_HANDLE)
+		RecordWavefront(cmd);
+	else if (m_RenderMode == RENDER_PERSISTENT && m_StagePipelines[STAGE_PERSISTENT] != VK_NULL_HANDLE)
+		RecordPersistent(cmd);
+	else
+		RecordMegakernel(cmd);
+
+	if (UseEdgeSupersampling())
+		RecordEdgeSupersampling(cmd);
+
+	//Every mode wrote the camera ray depth for the next frame, except the deferred mode when it reused its G-buffer, which means nothing moved.
+	//The temporal upsampling, interleaved and foveated modes don't trace every pixel so they have no per pixel depth.
+	m_DepthHistoryValid = m_StagePipelines[STAGE_REPROJECT] != VK_NULL_HANDLE && TracesEveryPixel();
+	m_TemporalHistoryValid = temporalUpsampling || interleaved;
+}
+
+void VkEngine::RecordMegakernel(VkCommandBuffer cmd)
+{
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_MEGAKERNEL]);
+
+	uint32_t groupsX = (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f);
+	uint32_t groupsY = (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+}
+
+void VkEngine::RecordWavefront(VkCommandBuffer cmd)
+{
+	const AllocatedBuffer& hitQueue = m_ComputeShader->GetHitQueueBuffer();
+	const AllocatedBuffer& shadowQueue = m_ComputeShader->GetShadowQueueBuffer();
+	const AllocatedBuffer& bounceQueue = m_ComputeShader->GetBounceQueueBuffer();
+
+	uint32_t groupsX = (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f);
+	uint32_t groupsY = (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f);
+
+	ResetRayQueue(cmd, hitQueue);
+	ResetRayQueue(cmd, shadowQueue);
+	ResetRayQueue(cmd, bounceQueue);
+	ComputeBarrier(cmd);
+
+	//Camera rays are the only stage that runs over every pixel
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_PRIMARY]);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+	ComputeBarrier(cmd);
+
+	//The camera hit plus the reflections of the quality tier
+	uint32_t bounces = glm::min(m_WavefrontBounces, QualityTiers[m_QualityTier].reflectionBounces + 1);
+	for (uint32_t bounce = 0; bounce < bounces; ++bounce)
+	{
+		//Shade the hits, fills the shadow and bounce queues
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_SHADE]);
+		vkCmdDispatchIndirect(cmd, hitQueue.buffer, 0);
+		ComputeBarrier(cmd);
+
+		//The hits are consumed so the reflections can refill the queue
+		ResetRayQueue(cmd, hitQueue);
+
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_SHADOW]);
+		vkCmdDispatchIndirect(cmd, shadowQueue.buffer, 0);
+		ComputeBarrier(cmd);
+
+		ResetRayQueue(cmd, shadowQueue);
+
+		if (bounce + 1 < bounces)
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_REFLECT]);
+			vkCmdDispatchIndirect(cmd, bounceQueue.buffer, 0);
+			ComputeBarrier(cmd);
+		}
+
+		ResetRayQueue(cmd, bounceQueue);
+		ComputeBarrier(cmd);
+	}
+
+	//Write the gathered radiance to the swapchain image
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_RESOLVE]);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+}
+
+void VkEngine::RecordPersistent(VkCommandBuffer cmd)
+{
+	//Start handing out tiles from the first one again
+	vkCmdFillBuffer(cmd, m_ComputeShader->GetTileQueueBuffer().buffer, 0, sizeof(uint32_t), 0);
+	ComputeBarrier(cmd);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_PERSISTENT]);
+	vkCmdDispatch(cmd, (uint32_t)m_PersistentGroupCount, 1, 1);
+}
+
+void VkEngine::RecordLightingPrepass(VkCommandBuffer cmd)
+{
+	uint32_t scale = GetActiveLightingScale();
+
+	//Normal and depth of every camera ray, this overwrites the deferred G-buffer
+	m_GBufferValid = false;
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_PRIMARY_HIT]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f), (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f), 1);
+	ComputeBarrier(cmd);
+
+	//Shadow and AO for one pixel out of every scale x scale block
+	uint32_t lowResWidth = (m_WindowExtent.width + scale - 1) / scale;
+	uint32_t lowResHeight = (m_WindowExtent.height + scale - 1) / scale;
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_LOWRES_LIGHTING]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(lowResWidth / 32.0f), (uint32_t)glm::ceil(lowResHeight / 32.0f), 1);
+	ComputeBarrier(cmd);
+}
+
+void VkEngine::RecordDeferred(VkCommandBuffer cmd)
+{
+	uint32_t scale = GetActiveLightingScale();
+	uint32_t groupsX = (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f);
+	uint32_t groupsY = (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f);
+
+	//The G-buffer of an earlier submission is read below
+	ComputeBarrier(cmd);
+
+	//Skip the primary rays when only the lighting changed
+	const ComputeShader::SceneBufferData& sceneData = m_ComputeShader->GetSceneBufferData();
+	bool sceneChanged = !m_GBufferValid || sceneData.viewMat != m_GBufferSceneData.viewMat
+		|| sceneData.projInverseMat != m_GBufferSceneData.projInverseMat || sceneData.sceneMoved != 0;
+	if (sceneChanged)
+	{
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_PRIMARY_HIT]);
+		vkCmdDispatch(cmd, groupsX, groupsY, 1);
+		ComputeBarrier(cmd);
+
+		m_GBufferValid = true;
+		m_GBufferSceneData = sceneData;
+	}
+
+	//Shadow/AO and reflections only read the G-buffer so they don't need a barrier between them
+	uint32_t lowResWidth = (m_WindowExtent.width + scale - 1) / scale;
+	uint32_t lowResHeight = (m_WindowExtent.height + scale - 1) / scale;
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_LOWRES_LIGHTING]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(lowResWidth / 32.0f), (uint32_t)glm::ceil(lowResHeight / 32.0f), 1);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_DEFERRED_REFLECT]);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+	ComputeBarrier(cmd);
+
+	//Direct light, combined with the visibility and reflections, written to the swapchain image
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_DEFERRED_LIGHTING]);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+}
+
+void VkEngine::RecordReprojection(VkCommandBuffer cmd)
+{
+	//Mark every pixel as empty, the reprojection keeps the closest depth that lands on a pixel
+	vkCmdFillBuffer(cmd, m_ComputeShader->GetReprojectedDepthBuffer().buffer, 0, VK_WHOLE_SIZE, 0xFFFFFFFF);
+	ComputeBarrier(cmd);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_REPROJECT]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f), (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f), 1);
+	ComputeBarrier(cmd);
+}
+
+void VkEngine::RecordTemporalUpsampling(VkCommandBuffer cmd)
+{
+	//The history written by an earlier submission is read in the resolve
+	ComputeBarrier(cmd);
+
+	//Jittered samples at the render resolution
+	VkExtent2D renderExtent = GetTemporalRenderExtent();
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_TAAU_RENDER]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(renderExtent.width / 32.0f), (uint32_t)glm::ceil(renderExtent.height / 32.0f), 1);
+	ComputeBarrier(cmd);
+
+	//Reconstruct full resolution and accumulate it into the history
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_TAAU_RESOLVE]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f), (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f), 1);
+}
+
+void VkEngine::RecordStaticFrame(VkCommandBuffer cmd)
+{
+	//The cache was written by an earlier submission
+	ComputeBarrier(cmd);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[m_RefinementSample > 0 ? STAGE_REFINE : STAGE_PRESENT_CACHED]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f), (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f), 1);
+}
+
+void VkEngine::RecordEdgeSupersampling(VkCommandBuffer cmd)
+{
+	const AllocatedBuffer& edgeList = m_ComputeShader->GetEdgeListBuffer();
+
+	ResetRayQueue(cmd, edgeList);
+	ComputeBarrier(cmd);
+
+	//Compare every pixel of the base pass with its neighbours
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_EDGE_DETECT]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f), (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f), 1);
+	ComputeBarrier(cmd);
+
+	//One thread per edge pixel
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_EDGE_SUPERSAMPLE]);
+	vkCmdDispatchIndirect(cmd, edgeList.buffer, 0);
+}
+
+bool VkEngine::UseEdgeSupersampling()
+{
+	//Needs the depth history of every pixel
+	return m_EdgeSupersampling && m_StagePipelines[STAGE_EDGE_SUPERSAMPLE] != VK_NULL_HANDLE && TracesEveryPixel();
+}
+
+bool VkEngine::TracesEveryPixel()
+{
+	return m_RenderMode != RENDER_TEMPORAL_UPSAMPLING && m_RenderMode != RENDER_INTERLEAVED && m_RenderMode != RENDER_FOVEATED;
+}
+
+float VkEngine::GetFoveatedRayFraction()
+{
+	//Same tile rates as FoveatedTileRate() in the shader
+	uint32_t tilesX = (m_WindowExtent.width + 31) / 32;
+	uint32_t tilesY = (m_WindowExtent.height + 31) / 32;
+	float rays = 0.0f;
+	for (uint32_t y = 0; y < tilesY; ++y)
+	{
+		for (uint32_t x = 0; x < tilesX; ++x)
+		{
+			glm::vec2 tileCenter = (glm::vec2(x, y) + 0.5f) * 32.0f;
+			float distanceToFocus = glm::length(tileCenter - m_FocusPoint) / (float)m_WindowExtent.height;
+			float rate = distanceToFocus < m_FoveaInnerRadius ? 1.0f : distanceToFocus < glm::max(m_FoveaOuterRadius, m_FoveaInnerRadius) ? 2.0f : 4.0f;
+			rays += 1.0f / (rate * rate);
+		}
+	}
+	return rays / (float)(tilesX * tilesY);
+}
+
+void VkEngine::RecordFoveated(VkCommandBuffer cmd)
+{
+	//Same groups as the megakernel, every group picks its own shading rate
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_FOVEATED]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f), (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f), 1);
+}
+
+void VkEngine::RecordInterleaved(VkCommandBuffer cmd)
+{
+	//The previous frame is read in the resolve
+	ComputeBarrier(cmd);
+
+	//One thread per traced pixel, the checkerboard traces every row and the 2x2 pattern every other row
+	uint32_t tracedWidth = (m_WindowExtent.width + 1) / 2;
+	uint32_t tracedHeight = m_InterleavePattern == INTERLEAVE_CHECKERBOARD ? m_WindowExtent.height : (m_WindowExtent.height + 1) / 2;
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_INTERLEAVED_RENDER]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(tracedWidth / 32.0f), (uint32_t)glm::ceil(tracedHeight / 32.0f), 1);
+	ComputeBarrier(cmd);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, m_StagePipelines[STAGE_INTERLEAVED_RESOLVE]);
+	vkCmdDispatch(cmd, (uint32_t)glm::ceil(m_WindowExtent.width / 32.0f), (uint32_t)glm::ceil(m_WindowExtent.height / 32.0f), 1);
+}
+
+VkExtent2D VkEngine::GetTemporalRenderExtent()
+{
+	VkExtent2D extent;
+	extent.width = glm::max((uint32_t)(m_WindowExtent.width * m_RenderScale), 1u);
+	extent.height = glm::max((uint32_t)(m_WindowExtent.height * m_RenderScale), 1u);
+	return extent;
+}
+
+bool VkEngine::UseTemporalReprojection()
+{
+	return m_TemporalReprojection && m_DepthHistoryValid && m_StagePipelines[STAGE_REPROJECT] != VK_NULL_HANDLE;
+}
+
+uint32_t VkEngine::GetActiveLightingScale()
+{
+	//The wavefront stages trace their own shadow rays, the prepass needs a camera hit for every pixel
+	//and shaders without stages can't run it
+	if (m_RenderMode == RENDER_WAVEFRONT || !TracesEveryPixel() || m_StagePipelines[STAGE_LOWRES_LIGHTING] == VK_NULL_HANDLE)
+		return 1;
+
+	return (uint32_t)m_LightingScale;
+}
+
+void VkEngine::ResetRayQueue(VkCommandBuffer cmd, const AllocatedBuffer& queue)
+{
+	//groupsX, groupsY, groupsZ, count
+	uint32_t emptyQueue[4] = { 0, 1, 1, 0 };
+	vkCmdUpdateBuffer(cmd, queue.buffer, 0, sizeof(emptyQueue), emptyQueue);
+}
+
+void VkEngine::ComputeBarrier(VkCommandBuffer cmd)
+{
+	//Make everything written by previous dispatches and buffer updates visible to the next dispatch and its indirect arguments
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	VkPipelineStageFlags srcStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+	VkPipelineStageFlags dstStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+	vkCmdPipelineBarrier(cmd, srcStages, dstStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
 void VkEngine::DrawGraphics(uint32_t frameNumber)
 {
 	//START RECORDING GRAPHICS COMMAND BUFFER
@@ -224,6 +786,10 @@ void VkEngine::DrawGraphics(uint32_t frameNumber)
 	vkResetFences(m_Device, 1, &m_Frames[frameNumber].graphicsFence);
 	vkResetCommandBuffer(m_Frames[frameNumber].graphicsCommandBuffer, 0);
 
+	//The graphics queue waited on the compute semaphore, so the timestamps of this frame are available now
+	ReadComputeTimings(frameNumber);
+	ReadStatistics(frameNumber);
+
 	//PRESENT the image in the swapchain
 	VkPresentInfoKHR presentInfo = vkInit::PresentInfoKHR();
 	presentInfo.swapchainCount = 1;
@@ -236,6 +802,137 @@ void VkEngine::DrawGraphics(uint32_t frameNumber)
 	m_FrameNumber++;
 }
 
+void VkEngine::ReadComputeTimings(uint32_t frameNumber)
+{
+	//Refining or re-presenting a static frame isn't the cost of the render mode
+	if (m_PresentCachedFrame || m_RefinementSample > 0)
+		return;
+
+	uint64_t timestamps[2];
+	VkResult result = vkGetQueryPoolResults(m_Device, m_TimestampQueryPool, frameNumber * 2, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+	if (result != VK_SUCCESS)
+		return;
+
+	//timestampPeriod is the amount of nanoseconds per tick
+	m_ComputeTimeMs = (float)(timestamps[1] - timestamps[0]) * m_GPUProperties.limits.timestampPeriod / 1000000.0f;
+	m_AverageComputeTimeMs = glm::mix(m_AverageComputeTimeMs, m_ComputeTimeMs, 0.05f);
+
+	if (m_ComputeTimeHistory.size() < m_ComputeTimeHistorySize)
+		m_ComputeTimeHistory.push_back(m_ComputeTimeMs);
+	else
+		m_ComputeTimeHistory[m_ComputeTimeHistoryIndex] = m_ComputeTimeMs;
+	m_ComputeTimeHistoryIndex = (m_ComputeTimeHistoryIndex + 1) % m_ComputeTimeHistorySize;
+
+	UpdateQualityGovernor();
+	ReadSceneBenchmark();
+	ReadBrickBenchmark();
+}
+
+void VkEngine::UpdateQualityGovernor()
+{
+	if (!m_QualityGovernor)
+		return;
+
+	//Count how long the frames stayed on one side of the band, a frame inside the band resets both
+	bool overTarget = m_ComputeTimeMs > m_TargetComputeTimeMs;
+	bool underTarget = m_ComputeTimeMs < m_TargetComputeTimeMs * m_UpgradeHeadroom;
+	m_FramesOverTarget = overTarget ? m_FramesOverTarget + 1 : 0;
+	m_FramesUnderTarget = underTarget ? m_FramesUnderTarget + 1 : 0;
+
+	uint32_t tier = m_QualityTier;
+	if (m_FramesOverTarget >= m_DowngradeFrames && tier + 1 < QualityTierCount)
+		++tier;
+	else if (m_FramesUnderTarget >= m_UpgradeFrames && tier > 0)
+		--tier;
+
+	if (tier != m_QualityTier)
+	{
+		std::cout << "Quality governor >> " << QualityTiers[m_QualityTier].name << " -> " << QualityTiers[tier].name << " at " << m_ComputeTimeMs << " ms\n";
+		m_QualityTier = tier;
+		m_FramesOverTarget = 0;
+		m_FramesUnderTarget = 0;
+	}
+
+	//One line per frame so the tier can be lined up with the timings afterwards
+	if (!m_QualityLog.is_open())
+	{
+		m_QualityLog.open("QualityGovernor.csv");
+		m_QualityLog << "frame,computeMs,targetMs,tier\n";
+	}
+	m_QualityLog << m_FrameNumber << ',' << m_ComputeTimeMs << ',' << m_TargetComputeTimeMs << ',' << QualityTiers[m_QualityTier].name << '\n';
+}
+
+void VkEngine::ResetComputeTimings()
+{
+	m_ComputeTimeHistory.clear();
+	m_ComputeTimeHistoryIndex = 0;
+	m_AverageComputeTimeMs = m_ComputeTimeMs;
+}
+
+void VkEngine::StartLodBenchmark()
+{
+	m_SavedCamera = _Camera;
+	m_SavedRenderMode = m_RenderMode;
+	m_SavedFractalLod = m_FractalLod;
+	m_SavedTemporalReprojection = m_TemporalReprojection;
+	m_SavedCollectStatistics = m_CollectStatistics;
+
+	m_LodBenchmarkRunning = true;
+	m_LodBenchmarkStep = 0;
+	m_LodBenchmarkFrame = 0;
+	m_LodBenchmarkResults.assign(std::size(LodBenchmarkDistances), glm::vec2(0.0f));
+}
+
+void VkEngine::UpdateLodBenchmark()
+{
+	//Every distance is rendered with the level of detail off and then on, the megakernel is the mode that counts the steps
+	//and the reprojection is turned off so it doesn't hide the difference
+	uint32_t distanceIndex = m_LodBenchmarkStep / 2;
+	_Camera = Camera{ glm::vec3(0.0f, 0.0f, LodBenchmarkDistances[distanceIndex]) };
+	m_RenderMode = RENDER_MEGAKERNEL;
+	m_FractalLod = m_LodBenchmarkStep % 2 == 1;
+	m_TemporalReprojection = false;
+	m_CollectStatistics = true;
+}
+
+void VkEngine::ReadStatistics(uint32_t frameNumber)
+{
+	if (!m_CollectStatistics)
+		return;
+
+	const AllocatedBuffer& statisticsBuffer = m_ComputeShader->GetStatisticsBuffer(frameNumber);
+	ComputeShader::StatisticsBufferData statistics;
+	memcpy(&statistics, GetBufferMemory(statisticsBuffer), sizeof(statistics));
+	ReleaseBufferMemory(statisticsBuffer);
+
+	if (statistics.primaryRays > 0)
+		m_PrimaryStepsPerRay = (float)statistics.primarySteps / (float)statistics.primaryRays;
+	m_EdgePixelFraction = (float)statistics.edgePixels / (float)(m_WindowExtent.width * m_WindowExtent.height);
+
+	//A few frames per setting so the statistics are from a frame that was rendered with it
+	if (!m_LodBenchmarkRunning || ++m_LodBenchmarkFrame < m_LodBenchmarkFrames)
+		return;
+
+	m_LodBenchmarkFrame = 0;
+	m_LodBenchmarkResults[m_LodBenchmarkStep / 2][m_LodBenchmarkStep % 2] = m_PrimaryStepsPerRay;
+	if (++m_LodBenchmarkStep < 2 * m_LodBenchmarkResults.size())
+		return;
+
+	for (size_t i = 0; i < m_LodBenchmarkResults.size(); ++i)
+	{
+		glm::vec2 steps = m_LodBenchmarkResults[i];
+		float saving = steps.x > 0.0f ? (1.0f - steps.y / steps.x) * 100.0f : 0.0f;
+		std::cout << "LOD benchmark >> distance " << LodBenchmarkDistances[i] << ": " << steps.x << " steps per ray without LOD, " << steps.y << " with LOD (" << saving << "% fewer)\n";
+	}
+
+	_Camera = m_SavedCamera;
+	m_RenderMode = m_SavedRenderMode;
+	m_FractalLod = m_SavedFractalLod;
+	m_TemporalReprojection = m_SavedTemporalReprojection;
+	m_CollectStatistics = m_SavedCollectStatistics;
+	m_LodBenchmarkRunning = false;
+}
+
 void VkEngine::InitVulkan()
 {
 	//Create vulkan instance
@@ -264,6 +961,11 @@ void VkEngine::InitVulkan()
 	vkGetPhysicalDeviceProperties(m_PhysicalDevice, &m_GPUProperties);
 	std::cout << "The gpu min alignment for uniform buffers is: " << m_GPUProperties.limits.minUniformBufferOffsetAlignment << '\n';
 
+	//BC4 mesh bricks are optional, the other formats need no features
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(m_PhysicalDevice, &supportedFeatures);
+	physDevice.features.textureCompressionBC = supportedFeatures.textureCompressionBC;
+
 	//Create logical device
 	vkb::DeviceBuilder deviceBuilder{ physDevice };
 	vkb::Device device = deviceBuilder.build().value();
@@ -475,15 +1177,161 @@ void VkEngine::InitSyncStructures()
 		});
 }
 
+void VkEngine::InitQueries()
+{
+	VkQueryPoolCreateInfo queryPoolInfo{};
+	queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryPoolInfo.queryCount = m_OverlappingFrameCount * 2;
+
+	VK_CHECK(vkCreateQueryPool(m_Device, &queryPoolInfo, nullptr, &m_TimestampQueryPool), "VkEngine::InitQueries() >> Failed to create timestamp query pool!");
+	m_DeletionQueue.PushFunction([=]() {vkDestroyQueryPool(m_Device, m_TimestampQueryPool, nullptr); });
+}
+
 void VkEngine::InitShaders()
 {
 	m_ComputeShader = new ComputeShader(m_Device, m_CurrentShader);
 }
 
+void VkEngine::InitMaterials()
+{
+	//Order has to match the MAT_ constants in the shaders, scene files refer to them by these names
+	m_BuiltInMaterialNames = { "WHITE", "GOLD", "COPPER", "BRASS", "SILVER", "GROUND", "PURPLE" };
+	m_BuiltInMaterials =
+	{
+		{ glm::vec4(1.0f, 1.0f, 1.0f, 1.0f), glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) },		//MAT_WHITE
+		{ glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), glm::vec4(1.0f, 0.71f, 0.29f, 1.0f) },		//MAT_GOLD
+		{ glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), glm::vec4(1.0f, 0.63f, 0.53f, 1.0f) },		//MAT_COPPER
+		{ glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), glm::vec4(1.0f, 0.74f, 0.34f, 1.0f) },		//MAT_BRASS
+		{ glm::vec4(0.0f, 0.0f, 0.0f, 1.0f), glm::vec4(0.8f, 0.8f, 0.8f, 1.0f) },		//MAT_SILVER
+		{ glm::vec4(0.8f, 0.8f, 0.8f, 1.0f), glm::vec4(0.2f, 0.2f, 0.2f, 1.0f) },		//MAT_GROUND
+		{ glm::vec4(0.6f, 0.1f, 0.5f, 1.0f), glm::vec4(0.0f, 0.0f, 0.0f, 1.0f) }		//MAT_PURPLE
+	};
+	m_ComputeShader->SetMaterialBufferData(m_BuiltInMaterials);
+}
+
+void VkEngine::LoadScene(const std::string& fileName)
+{
+	std::vector<ComputeShader::MaterialData> materials = m_BuiltInMaterials;
+	try
+	{
+		if (fileName.empty())
+		{
+			m_ComputeShader->SetSceneProgram({}, {});
+			m_GeneratedShader.clear();
+			m_GeneratedShaderReady = false;
+			m_Scene = SceneDescription{};
+			ReplaceSceneInstances(m_Scene);
+		}
+		else
+		{
+			SceneDescription scene = SceneDescription::LoadFromFile(fileName, m_BuiltInMaterialNames);
+			if (m_BuiltInMaterials.size() + scene.GetMaterials().size() > ComputeShader::MaxMaterials)
+				throw std::runtime_error("VkEngine::LoadScene() >> " + fileName + " defines more materials than the material table fits");
+
+			for (const SceneMaterial& material : scene.GetMaterials())
+				materials.push_back({ material.color, material.specular });
+
+			//The Mesh nodes are bounded by the baked volume, so it's needed before the scene is compiled.
+			//Only the header and the page table of the brick file are read here, the bricks are streamed in while the scene is shown.
+			std::unique_ptr<SdfBrickFile> brickFile;
+			if (!scene.GetMeshFile().empty())
+			{
+				brickFile = OpenMeshBrickFile(scene.GetMeshFile(), scene.GetMeshResolution(), m_MeshBrickFormat);
+				const SdfBrickFile::Header& header = brickFile->GetHeader();
+				scene.SetMeshBounds({ header.boundsMin, header.boundsMax });
+				if (glm::any(glm::greaterThan(header.cellCount, glm::uvec3(m_GPUProperties.limits.maxImageDimension3D))))
+					throw std::runtime_error("VkEngine::LoadScene() >> The mesh of " + fileName + " needs a larger 3D image than the GPU supports, lower its resolution");
+			}
+
+			m_ComputeShader->SetSceneProgram(scene.Compile(), scene.CalculateBounds());
+			if (brickFile)
+				ReplaceMeshVolume(std::move(brickFile));
+			ReplaceSceneInstances(scene);
+			StartSceneShaderBuild(scene);
+			m_Scene = std::move(scene);
+		}
+	}
+	catch (const std::exception& e)
+	{
+		//Keep showing the current scene
+		std::cout << e.what() << std::endl;
+		return;
+	}
+
+	m_ComputeShader->SetMaterialBufferData(materials);
+	m_CurrentScene = fileName;
+	m_SceneBenchmarkResult = glm::vec2(0.0f);
+	m_BrickBenchmarkResults.clear();
+
+	//Nothing from the old scene can be reused, the pipelines stay the same
+	m_StaticFrameCount = 0;
+	m_GBufferValid = false;
+	m_DepthHistoryValid = false;
+	m_TemporalHistoryValid = false;
+}
+
+void VkEngine::EditSceneNode(uint32_t id, const glm::vec4 params[2], uint32_t materialId)
+{
+	try
+	{
+		m_Scene.EditNode(id, params, materialId);
+		m_ComputeShader->PatchSceneProgram(m_Scene.CompileChanges(), m_Scene.CalculateBounds());
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << e.what() << std::endl;
+		return;
+	}
+
+	//The tree is in the space of the Scatter node, so moving the node only changes how the rays are taken into it
+	if (m_InstanceBvh)
+	{
+		bool usable = m_Scene.GetScatterSpace(m_InstanceBvhHeader.worldToLocal);
+		m_InstanceBvhHeader.nodeCount = usable ? (uint32_t)m_InstanceBvh->GetNodes().size() : 0;
+		m_InstanceBvhHeaderChanged = true;
+	}
+
+	//Until FinishSceneEdit() the interpreter shows the edits
+	m_GeneratedShader.clear();
+	m_GeneratedShaderReady = false;
+
+	//The baked bricks are in the space of the mesh, so moving a Mesh node only changes which of them the streaming wants.
+	//What the last frames saw of the old surface can't be reprojected onto the new one.
+	m_GBufferValid = false;
+	m_DepthHistoryValid = false;
+	m_TemporalHistoryValid = false;
+}
+
+void VkEngine::EditSceneMaterial(uint32_t index, const ComputeShader::MaterialData& material)
+{
+	//The generated map() and the G-buffer only have the material ids, so nothing but the lighting has to be redone
+	try
+	{
+		m_ComputeShader->SetMaterial(index, material);
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << e.what() << std::endl;
+	}
+}
+
+void VkEngine::FinishSceneEdit()
+{
+	if (!m_CurrentScene.empty() && !m_GeneratedShaderReady)
+		StartSceneShaderBuild(m_Scene);
+}
+
 void VkEngine::InitDescriptors()
 {
 	m_ComputeShader->SetSkyboxTexture(&m_SkyBoxTexture.imageView);
+	m_ComputeShader->SetSkyboxCubemap(&m_SkyboxCubemap.imageView);
 	m_ComputeShader->SetSwapchainImage(m_SwapchainImageViews.data());
+	m_ComputeShader->SetHistoryImages(&m_HistoryImages[0].imageView);
+	m_ComputeShader->SetOutputCacheImage(&m_OutputCache.imageView);
+	m_ComputeShader->SetMeshVolume(&m_MeshVolume.brickAtlas.imageView, &m_MeshVolume.brickCells.imageView, &m_MeshVolume.cellMips.imageView, &m_MeshVolume.brickRanges.buffer);
+	m_ComputeShader->SetSceneInstances(&m_SceneInstances.instances.buffer, &m_SceneInstances.grid.buffer, &m_SceneInstances.bvh.buffer, &m_SceneInstances.bvhIndices.buffer);
+	m_ComputeShader->SetRayQueueCapacity(m_WindowExtent.width * m_WindowExtent.height);
 	m_ComputeShader->InitDescriptors(m_OverlappingFrameCount, this);
 }
 
@@ -502,15 +1350,635 @@ void VkEngine::InitPipelines()
 	VkPipelineLayoutCreateInfo graphicsLayoutCreateInfo = vkInit::PipelineLayoutCreateInfo();
 	graphicsLayoutCreateInfo.setLayoutCount = 0;
 
-	//Create base pipeline
+	//Create a pipeline per render stage, they share the module and only differ in the RENDER_STAGE specialization constant
 	ComputePipelineBuilder builder{};
 	builder.m_PipelineLayout = m_ComputePipelineLayout;
 	builder.m_ShaderStageCreateInfo = vkInit::PipelineShaderStageInfo(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
-	m_ComputePipeline = builder.BuildPipeline(m_Device);
+
+	uint32_t stageCount = m_ComputeShader->HasSpecializationConstant(0) ? STAGE_COUNT : 1;
+	m_StagePipelines.assign(STAGE_COUNT, VK_NULL_HANDLE);
+	for (uint32_t stage = 0; stage < stageCount; ++stage)
+	{
+		VkSpecializationMapEntry stageEntry{};
+		stageEntry.constantID = 0;
+		stageEntry.offset = 0;
+		stageEntry.size = sizeof(uint32_t);
+
+		VkSpecializationInfo specializationInfo{};
+		specializationInfo.mapEntryCount = 1;
+		specializationInfo.pMapEntries = &stageEntry;
+		specializationInfo.dataSize = sizeof(uint32_t);
+		specializationInfo.pData = &stage;
+
+		builder.m_ShaderStageCreateInfo.pSpecializationInfo = &specializationInfo;
+		m_StagePipelines[stage] = builder.BuildPipeline(m_Device);
+	}
 
 	m_ComputeShader->CleanModules();
 }
 
+void VkEngine::InitStorageImages()
+{
+	m_HistoryImages.resize(ComputeShader::HistoryImageCount);
+	for (Texture& history : m_HistoryImages)
+		history = CreateStorageImage(ComputeShader::HistoryImageFormat);
+
+	m_OutputCache = CreateStorageImage(ComputeShader::OutputCacheFormat);
+}
+
+Texture VkEngine::CreateStorageImage(VkFormat format)
+{
+	VkExtent3D imageExtent{ m_WindowExtent.width, m_WindowExtent.height, 1 };
+
+	Texture storageImage;
+	VkImageCreateInfo imageCreateInfo = vkInit::ImageCreateInfo(format, VK_IMAGE_USAGE_STORAGE_BIT, imageExtent);
+	VmaAllocationCreateInfo imageAllocInfo{};
+	imageAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	VK_CHECK(vmaCreateImage(m_Allocator, &imageCreateInfo, &imageAllocInfo, &storageImage.image.image, &storageImage.image.allocation, nullptr), "VkEngine::CreateStorageImage() >> Failed to create image!");
+
+	VkImageViewCreateInfo viewInfo = vkInit::ImageViewCreateInfo(format, storageImage.image.image, VK_IMAGE_ASPECT_COLOR_BIT);
+	VK_CHECK(vkCreateImageView(m_Device, &viewInfo, nullptr, &storageImage.imageView), "VkEngine::CreateStorageImage() >> Failed to create image view!");
+
+	m_DeletionQueue.PushFunction([=]()
+		{
+			vkDestroyImageView(m_Device, storageImage.imageView, nullptr);
+			vmaDestroyImage(m_Allocator, storageImage.image.image, storageImage.image.allocation);
+		});
+
+	//The shader reads and writes it, so it stays in the general layout
+	ImmediateSubmit([&](VkCommandBuffer cmdBuffer)
+		{
+			VkImageMemoryBarrier toGeneral{};
+			toGeneral.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			toGeneral.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			toGeneral.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+			toGeneral.image = storageImage.image.image;
+			toGeneral.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+			toGeneral.srcAccessMask = 0;
+			toGeneral.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toGeneral);
+		});
+
+	return storageImage;
+}
+
+void VkEngine::InitMeshVolume()
+{
+	//Scenes without a mesh never sample it, but the descriptors have to point at something
+	uint32_t placeholderCell = SdfBrickMap::EncodeDistance(1.0f);
+	m_MeshVolume = CreateMeshVolume(glm::uvec3(1), &placeholderCell, 1, SDF_BRICK_FLOAT32);
+	if (!IsMeshBrickFormatSupported(m_MeshBrickFormat))
+		m_MeshBrickFormat = SDF_BRICK_FLOAT32;
+
+	//Whichever volume is loaded by then
+	m_DeletionQueue.PushFunction([=]()
+		{
+			DestroyMeshVolume(m_MeshVolume);
+		});
+
+	//Stays mapped, the scene patches and the streaming write into it every frame they have something to upload
+	m_StagingRing = CreateBuffer(m_StagingSegmentSize * m_OverlappingFrameCount, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY);
+	m_StagingMemory = static_cast<uint8_t*>(GetBufferMemory(m_StagingRing));
+	m_DeletionQueue.PushFunction([=]()
+		{
+			ReleaseBufferMemory(m_StagingRing);
+		});
+}
+
+MeshVolume VkEngine::CreateMeshVolume(const glm::uvec3& cellCount, const uint32_t* cells, uint32_t slotCount, SdfBrickFormat format)
+{
+	//The atlas and the ranges of its slots start out empty, a slot is only sampled once its brick is uploaded
+	MeshVolume volume;
+	const uint32_t brickSize = SdfBrickMap::BrickSize;
+	glm::uvec3 atlasBricks = SdfBrickMap::GetAtlasLayout(slotCount);
+	VkExtent3D atlasExtent{ atlasBricks.x * brickSize, atlasBricks.y * brickSize, atlasBricks.z * brickSize };
+	volume.brickAtlas = CreateVolumeTexture(GetMeshBrickVkFormat(format), atlasExtent, 1, nullptr, 0, {});
+	volume.brickRanges = CreateBuffer(sizeof(glm::vec2) * slotCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, false);
+
+	VkExtent3D cellExtent{ cellCount.x, cellCount.y, cellCount.z };
+	VkBufferImageCopy cellCopy{};
+	cellCopy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	cellCopy.imageExtent = cellExtent;
+	volume.brickCells = CreateVolumeTexture(VK_FORMAT_R32_UINT, cellExtent, 1, cells, sizeof(uint32_t) * cellCount.x * cellCount.y * cellCount.z, { cellCopy });
+
+	//Full precision, a distance rounded up could let a ray step through the surface
+	SdfCellMips mips = MeshSdfBaker::BuildCellMips(cellCount, cells);
+	std::vector<VkBufferImageCopy> mipCopies(mips.extents.size());
+	VkDeviceSize mipOffset = 0;
+	for (uint32_t mip = 0; mip < mipCopies.size(); ++mip)
+	{
+		glm::uvec3 extent = mips.extents[mip];
+		mipCopies[mip].bufferOffset = mipOffset;
+		mipCopies[mip].imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, mip, 0, 1 };
+		mipCopies[mip].imageExtent = { extent.x, extent.y, extent.z };
+		mipOffset += sizeof(float) * extent.x * extent.y * extent.z;
+	}
+	glm::uvec3 mipExtent = mips.extents[0];
+	volume.cellMips = CreateVolumeTexture(VK_FORMAT_R32_SFLOAT, { mipExtent.x, mipExtent.y, mipExtent.z }, (uint32_t)mips.extents.size(), mips.texels.data(),
+		sizeof(float) * mips.texels.size(), mipCopies);
+	return volume;
+}
+
+void VkEngine::DestroyMeshVolume(const MeshVolume& volume)
+{
+	for (const Texture* texture : { &volume.brickAtlas, &volume.brickCells, &volume.cellMips })
+	{
+		vkDestroyImageView(m_Device, texture->imageView, nullptr);
+		vmaDestroyImage(m_Allocator, texture->image.image, texture->image.allocation);
+	}
+	vmaDestroyBuffer(m_Allocator, volume.brickRanges.buffer, volume.brickRanges.allocation);
+}
+
+Texture VkEngine::CreateVolumeTexture(VkFormat format, VkExtent3D extent, uint32_t mipLevels, const void* texels, VkDeviceSize size, const std::vector<VkBufferImageCopy>& copies)
+{
+	//Without texels the image is only made readable
+	AllocatedBuffer stagingBuffer{};
+	if (size > 0)
+	{
+		stagingBuffer = CreateBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, false);
+		void* data = GetBufferMemory(stagingBuffer);
+		memcpy(data, texels, size);
+		ReleaseBufferMemory(stagingBuffer);
+	}
+
+	VkImageCreateInfo imageCreateInfo = vkInit::ImageCreateInfo(format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, extent);
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_3D;
+	imageCreateInfo.mipLevels = mipLevels;
+
+	Texture volumeTexture;
+	VmaAllocationCreateInfo imageAllocInfo{};
+	imageAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	VK_CHECK(vmaCreateImage(m_Allocator, &imageCreateInfo, &imageAllocInfo, &volumeTexture.image.image, &volumeTexture.image.allocation, nullptr), "VkEngine::CreateVolumeTexture() >> Failed to create image!");
+
+	VkImageViewCreateInfo viewInfo = vkInit::ImageViewCreateInfo(format, volumeTexture.image.image, VK_IMAGE_ASPECT_COLOR_BIT);
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_3D;
+	viewInfo.subresourceRange.levelCount = mipLevels;
+	VK_CHECK(vkCreateImageView(m_Device, &viewInfo, nullptr, &volumeTexture.imageView), "VkEngine::CreateVolumeTexture() >> Failed to create image view!");
+
+	ImmediateSubmit([&](VkCommandBuffer cmdBuffer)
+		{
+			VkImageMemoryBarrier toTransfer{};
+			toTransfer.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			toTransfer.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			toTransfer.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			toTransfer.image = volumeTexture.image.image;
+			toTransfer.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1 };
+			toTransfer.srcAccessMask = 0;
+			toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toTransfer);
+
+			if (!copies.empty())
+				vkCmdCopyBufferToImage(cmdBuffer, stagingBuffer.buffer, volumeTexture.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)copies.size(), copies.data());
+
+			VkImageMemoryBarrier toReadable = toTransfer;
+			toReadable.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			toReadable.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			toReadable.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			toReadable.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toReadable);
+		});
+
+	if (size > 0)
+		vmaDestroyBuffer(m_Allocator, stagingBuffer.buffer, stagingBuffer.allocation);
+	return volumeTexture;
+}
+
+VkFormat VkEngine::GetMeshBrickVkFormat(SdfBrickFormat format)
+{
+	switch (format)
+	{
+	case SDF_BRICK_UNORM16:
+		return VK_FORMAT_R16_UNORM;
+	case SDF_BRICK_UNORM8:
+		return VK_FORMAT_R8_UNORM;
+	case SDF_BRICK_BC4:
+		return VK_FORMAT_BC4_UNORM_BLOCK;
+	default:
+		return VK_FORMAT_R32_SFLOAT;
+	}
+}
+
+bool VkEngine::IsMeshBrickFormatSupported(SdfBrickFormat format)
+{
+	//The atlas is a filtered 3D image, which block compressed formats in particular don't always allow
+	VkFormat vkFormat = GetMeshBrickVkFormat(format);
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(m_PhysicalDevice, vkFormat, &formatProperties);
+	if (!(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT))
+		return false;
+
+	VkImageFormatProperties imageProperties;
+	return vkGetPhysicalDeviceImageFormatProperties(m_PhysicalDevice, vkFormat, VK_IMAGE_TYPE_3D, VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, 0, &imageProperties) == VK_SUCCESS;
+}
+
+std::unique_ptr<SdfBrickFile> VkEngine::OpenMeshBrickFile(const std::string& objFile, uint32_t resolution, SdfBrickFormat format)
+{
+	//Every format is encoded from the Float32 file, which is baked again whenever the OBJ changes
+	uint64_t sourceStamp = SdfBrickFile::GetSourceStamp(objFile);
+	std::string floatFileName = SdfBrickFile::GetCachePath(objFile, resolution, SDF_BRICK_FLOAT32);
+	std::string brickFileName = SdfBrickFile::GetCachePath(objFile, resolution, format);
+	if (SdfBrickFile::IsCurrent(brickFileName, resolution, sourceStamp, format))
+		return std::make_unique<SdfBrickFile>(brickFileName);
+
+	//A mapped file can't be replaced everywhere, the current mesh keeps the bricks it has until the new one is there
+	auto releaseMapping = [&](const std::string& fileName)
+	{
+		if (m_MeshBrickFile && m_MeshBrickFile->GetFileName() == fileName)
+		{
+			vkDeviceWaitIdle(m_Device);
+			m_MeshBrickStreamer.reset();
+			m_MeshBrickFile.reset();
+		}
+	};
+
+	if (!SdfBrickFile::IsCurrent(floatFileName, resolution, sourceStamp, SDF_BRICK_FLOAT32))
+	{
+		releaseMapping(floatFileName);
+		SdfBrickFile::Write(floatFileName, MeshSdfBaker::Bake(objFile, resolution), resolution, sourceStamp);
+	}
+	if (format == SDF_BRICK_FLOAT32)
+		return std::make_unique<SdfBrickFile>(floatFileName);
+
+	releaseMapping(brickFileName);
+	SdfBrickFile::WriteEncoded(brickFileName, SdfBrickFile(floatFileName), format);
+	return std::make_unique<SdfBrickFile>(brickFileName);
+}
+
+void VkEngine::SetMeshBrickFormat(SdfBrickFormat format)
+{
+	if (format == m_MeshBrickFormat || !IsMeshBrickFormatSupported(format))
+		return;
+
+	m_MeshBrickFormat = format;
+	if (m_Scene.GetMeshFile().empty())
+		return;
+
+	//Same bricks and bounds, so the scene program stays as it is
+	try
+	{
+		ReplaceMeshVolume(OpenMeshBrickFile(m_Scene.GetMeshFile(), m_Scene.GetMeshResolution(), format));
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << e.what() << std::endl;
+	}
+}
+
+void VkEngine::ReplaceMeshVolume(std::unique_ptr<SdfBrickFile> brickFile)
+{
+	//The streamer points into the old file
+	m_MeshBrickStreamer.reset();
+	m_MeshBrickFile = std::move(brickFile);
+	ResizeMeshBrickAtlas();
+}
+
+void VkEngine::ResizeMeshBrickAtlas()
+{
+	if (!m_MeshBrickFile)
+		return;
+
+	//Nothing is resident in the new atlas, so the page table starts over from the one in the file and the uploads of this frame are dropped
+	m_BrickCopies.clear();
+	m_BrickCellCopies.clear();
+	m_BrickRangeCopies.clear();
+	uint32_t slotCount = GetMeshBrickSlotCount();
+	const SdfBrickFile::Header& header = m_MeshBrickFile->GetHeader();
+	MeshVolume volume = CreateMeshVolume(header.cellCount, m_MeshBrickFile->GetCells(), slotCount, header.format);
+
+	//The frames in flight can still be sampling the old one
+	vkDeviceWaitIdle(m_Device);
+	DestroyMeshVolume(m_MeshVolume);
+	m_MeshVolume = volume;
+	m_ComputeShader->UpdateMeshVolumeDescriptors();
+	m_MeshBrickStreamer = std::make_unique<SdfBrickStreamer>(*m_MeshBrickFile, slotCount);
+
+	m_StaticFrameCount = 0;
+	m_GBufferValid = false;
+}
+
+void VkEngine::InitSceneInstances()
+{
+	//Like the mesh volume, scenes without a Scatter never look at them
+	m_SceneInstances = CreateSceneInstanceBuffers({}, nullptr, m_InstanceBvhHeader);
+	m_DeletionQueue.PushFunction([=]()
+		{
+			DestroySceneInstanceBuffers(m_SceneInstances);
+		});
+}
+
+SceneInstanceBuffers VkEngine::CreateSceneInstanceBuffers(const std::vector<SceneInstance>& instances, const InstanceBvh* bvh, const InstanceBvh::Header& bvhHeader)
+{
+	InstanceGrid grid = InstanceGrid::Build(instances);
+
+	//A storage buffer can't be empty
+	VkDeviceSize instancesSize = sizeof(SceneInstance) * glm::max(instances.size(), (size_t)1);
+	VkDeviceSize gridSize = grid.GetBufferSize();
+	VkDeviceSize offsetsSize = sizeof(uint32_t) * grid.cellOffsets.size();
+	size_t nodeCount = bvh ? bvh->GetNodes().size() : 0;
+	size_t bvhIndexCount = bvh ? bvh->GetIndices().size() : 0;
+	VkDeviceSize bvhSize = sizeof(InstanceBvh::Header) + sizeof(InstanceBvh::Node) * glm::max(nodeCount, (size_t)1);
+	VkDeviceSize bvhIndicesSize = sizeof(uint32_t) * glm::max(bvhIndexCount, (size_t)1);
+
+	SceneInstanceBuffers buffers;
+	buffers.instances = CreateBuffer(instancesSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, false);
+	buffers.grid = CreateBuffer(gridSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, false);
+	buffers.bvh = CreateBuffer(bvhSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, false);
+	buffers.bvhIndices = CreateBuffer(bvhIndicesSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, false);
+
+	//All of them go through one staging buffer, one after the other
+	VkDeviceSize gridStart = instancesSize;
+	VkDeviceSize bvhStart = gridStart + gridSize;
+	VkDeviceSize bvhIndicesStart = bvhStart + bvhSize;
+	AllocatedBuffer stagingBuffer = CreateBuffer(bvhIndicesStart + bvhIndicesSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, false);
+	uint8_t* data = static_cast<uint8_t*>(GetBufferMemory(stagingBuffer));
+	memset(data, 0, bvhIndicesStart + bvhIndicesSize);
+	memcpy(data, instances.data(), sizeof(SceneInstance) * instances.size());
+	memcpy(data + gridStart, &grid.header, sizeof(InstanceGrid::Header));
+	memcpy(data + gridStart + sizeof(InstanceGrid::Header), grid.cellOffsets.data(), offsetsSize);
+	memcpy(data + gridStart + sizeof(InstanceGrid::Header) + offsetsSize, grid.indices.data(), sizeof(uint32_t) * grid.indices.size());
+	memcpy(data + bvhStart, &bvhHeader, sizeof(InstanceBvh::Header));
+	if (bvh)
+	{
+		memcpy(data + bvhStart + sizeof(InstanceBvh::Header), bvh->GetNodes().data(), sizeof(InstanceBvh::Node) * nodeCount);
+		memcpy(data + bvhIndicesStart, bvh->GetIndices().data(), sizeof(uint32_t) * bvhIndexCount);
+	}
+	ReleaseBufferMemory(stagingBuffer);
+
+	ImmediateSubmit([&](VkCommandBuffer cmdBuffer)
+		{
+			VkBufferCopy instancesCopy{ 0, 0, instancesSize };
+			VkBufferCopy gridCopy{ gridStart, 0, gridSize };
+			VkBufferCopy bvhCopy{ bvhStart, 0, bvhSize };
+			VkBufferCopy bvhIndicesCopy{ bvhIndicesStart, 0, bvhIndicesSize };
+			vkCmdCopyBuffer(cmdBuffer, stagingBuffer.buffer, buffers.instances.buffer, 1, &instancesCopy);
+			vkCmdCopyBuffer(cmdBuffer, stagingBuffer.buffer, buffers.grid.buffer, 1, &gridCopy);
+			vkCmdCopyBuffer(cmdBuffer, stagingBuffer.buffer, buffers.bvh.buffer, 1, &bvhCopy);
+			vkCmdCopyBuffer(cmdBuffer, stagingBuffer.buffer, buffers.bvhIndices.buffer, 1, &bvhIndicesCopy);
+
+			VkMemoryBarrier toShader{};
+			toShader.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			toShader.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			toShader.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &toShader, 0, nullptr, 0, nullptr);
+		});
+	vmaDestroyBuffer(m_Allocator, stagingBuffer.buffer, stagingBuffer.allocation);
+
+	if (!instances.empty())
+	{
+		uint32_t cellCount = grid.header.cellCount.w;
+		std::cout << "Instance grid: " << instances.size() << " instances in " << grid.header.cellCount.x << "x" << grid.header.cellCount.y << "x" << grid.header.cellCount.z
+			<< " cells of " << grid.header.boundsMin.w << ", " << (float)grid.indices.size() / (float)cellCount << " instances per cell, "
+			<< (float)(instancesSize + gridSize) / (1024.0f * 1024.0f) << " MB\n";
+	}
+	if (bvh)
+	{
+		std::cout << "Instance BVH: " << nodeCount << " nodes, " << bvh->GetDepth() << " deep, margin " << bvhHeader.margin << ", "
+			<< (float)(bvhSize + bvhIndicesSize) / (1024.0f * 1024.0f) << " MB" << (bvhHeader.nodeCount == 0 ? ", not used by the rays since the Scatter is repeated" : "") << "\n";
+	}
+	return buffers;
+}
+
+void VkEngine::DestroySceneInstanceBuffers(const SceneInstanceBuffers& buffers)
+{
+	vmaDestroyBuffer(m_Allocator, buffers.instances.buffer, buffers.instances.allocation);
+	vmaDestroyBuffer(m_Allocator, buffers.grid.buffer, buffers.grid.allocation);
+	vmaDestroyBuffer(m_Allocator, buffers.bvh.buffer, buffers.bvh.allocation);
+	vmaDestroyBuffer(m_Allocator, buffers.bvhIndices.buffer, buffers.bvhIndices.allocation);
+}
+
+void VkEngine::ReplaceSceneInstances(const SceneDescription& scene)
+{
+	//Fitted to the current time, the refits carry on from there
+	const std::vector<SceneInstance>& instances = scene.GetInstances();
+	std::unique_ptr<InstanceBvh> bvh;
+	InstanceBvh::Header header{};
+	if (!instances.empty())
+	{
+		bvh = std::make_unique<InstanceBvh>(instances, m_SceneTime);
+
+		bool usable = scene.GetScatterSpace(header.worldToLocal);
+		header.margin = bvh->GetMargin();
+		header.nodeCount = usable ? (uint32_t)bvh->GetNodes().size() : 0;
+		header.time = bvh->GetTime();
+	}
+	SceneInstanceBuffers buffers = CreateSceneInstanceBuffers(instances, bvh.get(), header);
+
+	//The frames in flight can still be reading the old ones
+	vkDeviceWaitIdle(m_Device);
+	DestroySceneInstanceBuffers(m_SceneInstances);
+	m_SceneInstances = buffers;
+	m_InstanceBvh = std::move(bvh);
+	m_InstanceBvhHeader = header;
+	m_InstanceBvhHeaderChanged = false;
+	m_InstanceBvhUploadedTime = header.time;
+	m_InstanceBvhCopies.clear();
+	m_ComputeShader->UpdateSceneInstanceDescriptors();
+}
+
+VkDeviceSize VkEngine::UpdateInstanceBvh(float time, VkDeviceSize stagingUsed)
+{
+	m_InstanceBvhCopies.clear();
+	m_InstancesMoved = false;
+	if (!m_InstanceBvh)
+		return 0;
+
+	if (m_InstanceBvh->Refit(m_Scene.GetInstances(), time))
+	{
+		m_InstanceBvhHeader.time = m_InstanceBvh->GetTime();
+		m_InstanceBvhHeaderChanged = true;
+	}
+	if (!m_InstanceBvhHeaderChanged)
+		return 0;
+
+	//The header and the runs of changed nodes after it, 16 byte aligned like the scene patches
+	const std::vector<uint32_t>& changedNodes = m_InstanceBvh->GetChangedNodes();
+	std::vector<VkBufferCopy> copies{ { 0, 0, sizeof(InstanceBvh::Header) } };
+	for (uint32_t node : changedNodes)
+	{
+		VkDeviceSize nodeOffset = sizeof(InstanceBvh::Header) + sizeof(InstanceBvh::Node) * node;
+		VkBufferCopy& last = copies.back();
+		if (copies.size() > 1 && last.dstOffset + last.size == nodeOffset)
+			last.size += sizeof(InstanceBvh::Node);
+		else
+			copies.push_back({ 0, nodeOffset, sizeof(InstanceBvh::Node) });
+	}
+
+	//All of it or nothing, the nodes only fit the header they were refitted with. What doesn't fit goes with the next frame.
+	VkDeviceSize size = 0;
+	for (const VkBufferCopy& copy : copies)
+		size += (copy.size + 15) / 16 * 16;
+	if (size > m_StagingSegmentSize - stagingUsed)
+		return 0;
+
+	VkDeviceSize offset = m_FrameIndex * m_StagingSegmentSize + stagingUsed;
+	for (VkBufferCopy copy : copies)
+	{
+		if (copy.dstOffset == 0)
+			memcpy(m_StagingMemory + offset, &m_InstanceBvhHeader, copy.size);
+		else
+			memcpy(m_StagingMemory + offset, reinterpret_cast<const uint8_t*>(m_InstanceBvh->GetNodes().data()) + (copy.dstOffset - sizeof(InstanceBvh::Header)), copy.size);
+		copy.srcOffset = offset;
+		m_InstanceBvhCopies.push_back(copy);
+		offset += (copy.size + 15) / 16 * 16;
+	}
+
+	m_InstanceBvh->ClearChanges();
+	m_InstanceBvhHeaderChanged = false;
+	m_InstancesMoved = m_InstanceBvhHeader.time != m_InstanceBvhUploadedTime;
+	m_InstanceBvhUploadedTime = m_InstanceBvhHeader.time;
+	return size;
+}
+
+void VkEngine::RecordInstanceBvh(VkCommandBuffer cmd)
+{
+	if (m_InstanceBvhCopies.empty())
+		return;
+
+	//Earlier submits on this queue may still be walking the tree
+	VkBufferMemoryBarrier toTransfer{};
+	toTransfer.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	toTransfer.buffer = m_SceneInstances.bvh.buffer;
+	toTransfer.size = VK_WHOLE_SIZE;
+	toTransfer.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	toTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &toTransfer, 0, nullptr);
+
+	vkCmdCopyBuffer(cmd, m_StagingRing.buffer, m_SceneInstances.bvh.buffer, (uint32_t)m_InstanceBvhCopies.size(), m_InstanceBvhCopies.data());
+
+	VkBufferMemoryBarrier toReadable = toTransfer;
+	toReadable.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	toReadable.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &toReadable, 0, nullptr);
+
+	m_InstanceBvhCopies.clear();
+}
+
+uint32_t VkEngine::GetMeshBrickSlotCount()
+{
+	//Never more slots than bricks, and never an atlas side longer than the GPU allows
+	uint64_t budgetSlots = (uint64_t)m_MeshBrickBudgetMB * 1024 * 1024 / m_MeshBrickFile->GetHeader().brickBytes;
+	uint64_t atlasSide = m_GPUProperties.limits.maxImageDimension3D / SdfBrickMap::BrickSize;
+	uint64_t slotCount = glm::min(glm::min(budgetSlots, (uint64_t)m_MeshBrickFile->GetBrickCount()), atlasSide * atlasSide * atlasSide);
+	return (uint32_t)glm::max(slotCount, (uint64_t)1);
+}
+
+bool VkEngine::UpdateMeshStreaming(const glm::vec3& cameraPosition, VkDeviceSize stagingUsed)
+{
+	m_BrickCopies.clear();
+	m_BrickCellCopies.clear();
+	m_BrickRangeCopies.clear();
+	m_MeshBrickUploads = 0;
+	if (!m_MeshBrickStreamer)
+		return false;
+
+	//Every upload brings its brick, its range and at most two page table entries, the one it takes and the one it evicts.
+	//The bricks go first, so they stay aligned to the texel blocks of the atlas
+	const VkDeviceSize brickBytes = m_MeshBrickFile->GetHeader().brickBytes;
+	uint32_t maxUploads = (uint32_t)((m_StagingSegmentSize - stagingUsed) / (brickBytes + sizeof(glm::vec2) + 2 * sizeof(uint32_t)));
+
+	std::vector<SdfBrickStreamer::BrickUpload> uploads;
+	std::vector<SdfBrickStreamer::CellUpdate> cellUpdates;
+	m_MeshBrickStreamer->Update(m_Scene.GetMeshSpacePoints(cameraPosition), maxUploads, uploads, cellUpdates);
+	if (cellUpdates.empty())
+		return false;
+
+	VkDeviceSize offset = m_FrameIndex * m_StagingSegmentSize + stagingUsed;
+
+	const uint32_t brickSize = SdfBrickMap::BrickSize;
+	glm::uvec3 atlasBricks = SdfBrickMap::GetAtlasLayout(m_MeshBrickStreamer->GetSlotCount());
+	for (const SdfBrickStreamer::BrickUpload& upload : uploads)
+	{
+		memcpy(m_StagingMemory + offset, m_MeshBrickFile->GetBrick(upload.brick), brickBytes);
+
+		VkBufferImageCopy copyRegion{};
+		copyRegion.bufferOffset = offset;
+		copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		copyRegion.imageOffset.x = (int32_t)(upload.slot % atlasBricks.x * brickSize);
+		copyRegion.imageOffset.y = (int32_t)(upload.slot / atlasBricks.x % atlasBricks.y * brickSize);
+		copyRegion.imageOffset.z = (int32_t)(upload.slot / (atlasBricks.x * atlasBricks.y) * brickSize);
+		copyRegion.imageExtent = { brickSize, brickSize, brickSize };
+		m_BrickCopies.push_back(copyRegion);
+		offset += brickBytes;
+	}
+
+	for (const SdfBrickStreamer::BrickUpload& upload : uploads)
+	{
+		memcpy(m_StagingMemory + offset, &m_MeshBrickFile->GetBrickRanges()[upload.brick], sizeof(glm::vec2));
+		m_BrickRangeCopies.push_back({ offset, sizeof(glm::vec2) * upload.slot, sizeof(glm::vec2) });
+		offset += sizeof(glm::vec2);
+	}
+
+	glm::uvec3 cellCount = m_MeshBrickFile->GetHeader().cellCount;
+	for (const SdfBrickStreamer::CellUpdate& update : cellUpdates)
+	{
+		memcpy(m_StagingMemory + offset, &update.entry, sizeof(uint32_t));
+
+		VkBufferImageCopy copyRegion{};
+		copyRegion.bufferOffset = offset;
+		copyRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		copyRegion.imageOffset.x = (int32_t)(update.cell % cellCount.x);
+		copyRegion.imageOffset.y = (int32_t)(update.cell / cellCount.x % cellCount.y);
+		copyRegion.imageOffset.z = (int32_t)(update.cell / (cellCount.x * cellCount.y));
+		copyRegion.imageExtent = { 1, 1, 1 };
+		m_BrickCellCopies.push_back(copyRegion);
+		offset += sizeof(uint32_t);
+	}
+
+	m_MeshBrickUploads = (uint32_t)uploads.size();
+	return true;
+}
+
+void VkEngine::RecordMeshStreaming(VkCommandBuffer cmd)
+{
+	if (m_BrickCellCopies.empty())
+		return;
+
+	//Earlier submits on this queue may still sample the slots that get overwritten
+	VkImageMemoryBarrier toTransfer[2]{};
+	for (int i = 0; i < 2; ++i)
+	{
+		toTransfer[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		toTransfer[i].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		toTransfer[i].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		toTransfer[i].image = i == 0 ? m_MeshVolume.brickAtlas.image.image : m_MeshVolume.brickCells.image.image;
+		toTransfer[i].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		toTransfer[i].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		toTransfer[i].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	}
+	VkBufferMemoryBarrier rangesToTransfer{};
+	rangesToTransfer.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	rangesToTransfer.buffer = m_MeshVolume.brickRanges.buffer;
+	rangesToTransfer.size = VK_WHOLE_SIZE;
+	rangesToTransfer.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	rangesToTransfer.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	rangesToTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	rangesToTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &rangesToTransfer, 2, toTransfer);
+
+	if (!m_BrickCopies.empty())
+	{
+		vkCmdCopyBufferToImage(cmd, m_StagingRing.buffer, m_MeshVolume.brickAtlas.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)m_BrickCopies.size(), m_BrickCopies.data());
+		vkCmdCopyBuffer(cmd, m_StagingRing.buffer, m_MeshVolume.brickRanges.buffer, (uint32_t)m_BrickRangeCopies.size(), m_BrickRangeCopies.data());
+	}
+	vkCmdCopyBufferToImage(cmd, m_StagingRing.buffer, m_MeshVolume.brickCells.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, (uint32_t)m_BrickCellCopies.size(), m_BrickCellCopies.data());
+
+	VkImageMemoryBarrier toReadable[2]{ toTransfer[0], toTransfer[1] };
+	for (VkImageMemoryBarrier& barrier : toReadable)
+	{
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	}
+	VkBufferMemoryBarrier rangesToReadable = rangesToTransfer;
+	rangesToReadable.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	rangesToReadable.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &rangesToReadable, 2, toReadable);
+}
+
 void VkEngine::LoadTextures()
 {
 	Texture skybox;
@@ -532,8 +2000,142 @@ void VkEngine::LoadTextures()
 	m_SkyBoxTexture = skybox;
 }
 
+void VkEngine::InitSkyboxCubemap()
+{
+	m_SkyboxMipLevels = (uint32_t)glm::floor(glm::log2((float)m_SkyboxFaceSize)) + 1;
+
+	//6 layers, the compute pass writes the first mip and blits fill the others
+	VkImageCreateInfo imageCreateInfo = vkInit::ImageCreateInfo(CubemapShader::CubemapFormat,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, { m_SkyboxFaceSize, m_SkyboxFaceSize, 1 });
+	imageCreateInfo.flags = VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT;
+	imageCreateInfo.mipLevels = m_SkyboxMipLevels;
+	imageCreateInfo.arrayLayers = 6;
+
+	Texture cubemap;
+	VmaAllocationCreateInfo imageAllocInfo{};
+	imageAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	VK_CHECK(vmaCreateImage(m_Allocator, &imageCreateInfo, &imageAllocInfo, &cubemap.image.image, &cubemap.image.allocation, nullptr), "VkEngine::InitSkyboxCubemap() >> Failed to create image!");
+
+	VkImageViewCreateInfo cubeViewInfo = vkInit::ImageViewCreateInfo(CubemapShader::CubemapFormat, cubemap.image.image, VK_IMAGE_ASPECT_COLOR_BIT);
+	cubeViewInfo.viewType = VK_IMAGE_VIEW_TYPE_CUBE;
+	cubeViewInfo.subresourceRange.levelCount = m_SkyboxMipLevels;
+	cubeViewInfo.subresourceRange.layerCount = 6;
+	VK_CHECK(vkCreateImageView(m_Device, &cubeViewInfo, nullptr, &cubemap.imageView), "VkEngine::InitSkyboxCubemap() >> Failed to create image view!");
+
+	m_DeletionQueue.PushFunction([=]()
+		{
+			vkDestroyImageView(m_Device, cubemap.imageView, nullptr);
+			vmaDestroyImage(m_Allocator, cubemap.image.image, cubemap.image.allocation);
+		});
+
+	//Storage images can't be cube views, the conversion writes the faces as an array
+	VkImageView facesView;
+	VkImageViewCreateInfo facesViewInfo = cubeViewInfo;
+	facesViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	facesViewInfo.subresourceRange.levelCount = 1;
+	VK_CHECK(vkCreateImageView(m_Device, &facesViewInfo, nullptr, &facesView), "VkEngine::InitSkyboxCubemap() >> Failed to create face view!");
+
+	CubemapShader cubemapShader{ m_Device, "../Resources/Shaders/EquirectToCubemap_comp.spv" };
+	cubemapShader.SetEquirectTexture(&m_SkyBoxTexture.imageView);
+	cubemapShader.SetCubemapFaces(&facesView);
+	cubemapShader.InitDescriptors(1, this);
+
+	VkPipelineLayoutCreateInfo layoutCreateInfo = vkInit::PipelineLayoutCreateInfo();
+	layoutCreateInfo.setLayoutCount = 1;
+	layoutCreateInfo.pSetLayouts = &cubemapShader.GetDescriptorSetLayout();
+	VkPipelineLayout pipelineLayout;
+	VK_CHECK(vkCreatePipelineLayout(m_Device, &layoutCreateInfo, nullptr, &pipelineLayout), "VkEngine::InitSkyboxCubemap() >> Failed to create pipeline layout!");
+
+	ComputePipelineBuilder builder{};
+	builder.m_PipelineLayout = pipelineLayout;
+	builder.m_ShaderStageCreateInfo = vkInit::PipelineShaderStageInfo(VK_SHADER_STAGE_COMPUTE_BIT, cubemapShader.GetComputeShaderModule());
+	VkPipeline pipeline = builder.BuildPipeline(m_Device);
+
+	ImmediateSubmit([&](VkCommandBuffer cmdBuffer)
+		{
+			VkImageMemoryBarrier barrier{};
+			barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			barrier.image = cubemap.image.image;
+			barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, m_SkyboxMipLevels, 0, 6 };
+			barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+			//One thread per texel of every face
+			vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+			vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &cubemapShader.GetDescriptorSet(), 0, nullptr);
+			vkCmdDispatch(cmdBuffer, (m_SkyboxFaceSize + 7) / 8, (m_SkyboxFaceSize + 7) / 8, 6);
+
+			//The first mip is read by the blits, the others are written by them
+			VkImageMemoryBarrier toTransfer[2] = { barrier, barrier };
+			toTransfer[0].subresourceRange.levelCount = 1;
+			toTransfer[0].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+			toTransfer[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+			toTransfer[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+			toTransfer[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+			toTransfer[1].subresourceRange.baseMipLevel = 1;
+			toTransfer[1].subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+			toTransfer[1].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+			toTransfer[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			toTransfer[1].srcAccessMask = 0;
+			toTransfer[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			uint32_t barrierCount = m_SkyboxMipLevels > 1 ? 2 : 1;
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, barrierCount, toTransfer);
+
+			//Every mip is a linear downsample of the one above it, all faces at once
+			for (uint32_t mip = 1; mip < m_SkyboxMipLevels; ++mip)
+			{
+				int32_t sourceSize = (int32_t)glm::max(m_SkyboxFaceSize >> (mip - 1), 1u);
+				int32_t destinationSize = (int32_t)glm::max(m_SkyboxFaceSize >> mip, 1u);
+
+				VkImageBlit blit{};
+				blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, mip - 1, 0, 6 };
+				blit.srcOffsets[1] = { sourceSize, sourceSize, 1 };
+				blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, mip, 0, 6 };
+				blit.dstOffsets[1] = { destinationSize, destinationSize, 1 };
+				vkCmdBlitImage(cmdBuffer, cubemap.image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, cubemap.image.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+				//This mip is the source of the next blit
+				VkImageMemoryBarrier toSource = barrier;
+				toSource.subresourceRange.baseMipLevel = mip;
+				toSource.subresourceRange.levelCount = 1;
+				toSource.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+				toSource.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+				toSource.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+				toSource.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+				vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toSource);
+			}
+
+			VkImageMemoryBarrier toReadable = barrier;
+			toReadable.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+			toReadable.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			toReadable.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			toReadable.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &toReadable);
+		});
+
+	//Only needed for the conversion, ImmediateSubmit() already waited for it
+	vkDestroyPipeline(m_Device, pipeline, nullptr);
+	vkDestroyPipelineLayout(m_Device, pipelineLayout, nullptr);
+	vkDestroyImageView(m_Device, facesView, nullptr);
+	cubemapShader.CleanDescriptors();
+	cubemapShader.CleanModules();
+
+	m_SkyboxCubemap = cubemap;
+}
+
 void VkEngine::Update()
 {
+	if (m_LodBenchmarkRunning)
+		UpdateLodBenchmark();
+	if (m_SceneBenchmarkRunning)
+		UpdateSceneBenchmark();
+	if (m_BrickBenchmarkRunning)
+		UpdateBrickBenchmark();
+	UpdateSceneShader();
+
 	//Camera movement
 	if (glfwGetKey(m_pWindow, GLFW_KEY_W))
 	{
@@ -568,24 +2170,125 @@ void VkEngine::Update()
 
 	ComputeShader::SceneBufferData sceneData;
 	glm::mat4 view = _Camera.GetViewMatrix();
-	glm::mat4 proj = glm::perspective(glm::radians(70.0f), (float)m_WindowExtent.width / (float)m_WindowExtent.height, 0.1f, 200.0f);
+	float fieldOfView = glm::radians(70.0f);
+	glm::mat4 proj = glm::perspective(fieldOfView, (float)m_WindowExtent.width / (float)m_WindowExtent.height, 0.1f, 200.0f);
 	sceneData.viewMat = view;
 	sceneData.viewInverseMat = glm::inverse(view);
 	sceneData.projInverseMat = glm::inverse(proj);
-	sceneData.time = glfwGetTime();
+	double currentTime = glfwGetTime();
+	if (m_AnimateScene)
+		m_SceneTime += (float)(currentTime - m_LastUpdateTime);
+	m_LastUpdateTime = currentTime;
+	sceneData.time = m_SceneTime;
+	sceneData.projMat = proj;
+
+	//Edits of the scene take as much of the staging segment as they need, they're small next to the bricks
+	VkDeviceSize segmentOffset = m_FrameIndex * m_StagingSegmentSize;
+	VkDeviceSize scenePatchBytes = m_ComputeShader->StageScenePatches(m_StagingMemory, segmentOffset, m_StagingSegmentSize);
+	VkDeviceSize instanceBvhBytes = UpdateInstanceBvh(m_SceneTime, scenePatchBytes);
+
+	//Streamed bricks and a refit that lands a frame late change the surface without changing any of the inputs
+	bool meshStreamed = UpdateMeshStreaming(glm::vec3(sceneData.viewInverseMat[3]), scenePatchBytes + instanceBvhBytes);
+	if (meshStreamed || instanceBvhBytes > 0)
+		m_GBufferValid = false;
+
+	//Nothing to reproject from on the first frame, the shader ignores the history when the flag is off.
+	//Only the bobbing instances move with the scene time, so the clock running on its own doesn't stop the reprojection.
+	sceneData.sceneMoved = m_InstancesMoved ? 1u : 0u;
+	sceneData.prevViewInverseMat = m_PreviousSceneData.viewInverseMat;
+	sceneData.prevProjInverseMat = m_PreviousSceneData.projInverseMat;
+	sceneData.prevViewProjMat = m_PreviousSceneData.projMat * m_PreviousSceneData.viewMat;
 	m_ComputeShader->SetSceneBufferData(sceneData);
+	m_PreviousSceneData = sceneData;
 
 	ComputeShader::LightBufferData lightData;
 	lightData.lightColor = glm::vec4(1.0f, 1.0f, 0.95f, 1.0f);
 	lightData.lightDirection = glm::normalize(glm::vec4(0.5f, -0.9f, 0.3f, 1.0f));
 	m_ComputeShader->SetLightBufferData(lightData);
 
-	m_ComputeShader->UpdateShaderVariables(m_FrameNumber % m_OverlappingFrameCount, this);
+	ComputeShader::RenderSettingsBufferData renderSettings;
+	renderSettings.lightingScale = GetActiveLightingScale();
+	renderSettings.temporalReprojection = UseTemporalReprojection();
+	renderSettings.collectStatistics = m_CollectStatistics;
+
+	//Halton(2, 3) jitter, 8 samples cover the pixel evenly before repeating
+	auto halton = [](uint32_t index, uint32_t base)
+	{
+		float result = 0.0f;
+		float fraction = 1.0f;
+		for (; index > 0; index /= base)
+		{
+			fraction /= (float)base;
+			result += fraction * (float)(index % base);
+		}
+		return result;
+	};
+	VkExtent2D renderExtent = GetTemporalRenderExtent();
+	renderSettings.renderWidth = renderExtent.width;
+	renderSettings.renderHeight = renderExtent.height;
+	renderSettings.jitterX = halton(m_FrameNumber % 8 + 1, 2) - 0.5f;
+	renderSettings.jitterY = halton(m_FrameNumber % 8 + 1, 3) - 0.5f;
+	renderSettings.historyIndex = m_FrameNumber % ComputeShader::HistoryImageCount;
+	renderSettings.historyValid = m_TemporalHistoryValid;
+	renderSettings.interleavePattern = m_InterleavePattern;
+	renderSettings.interleavePhase = m_FrameNumber % (m_InterleavePattern == INTERLEAVE_CHECKERBOARD ? 2 : 4);
+	renderSettings.edgeSamples = UseEdgeSupersampling() ? (uint32_t)m_EdgeSamples : 0;
+
+	const QualityTier& qualityTier = QualityTiers[m_QualityTier];
+	renderSettings.maxMarchingSteps = qualityTier.maxMarchingSteps;
+	renderSettings.reflectionBounces = qualityTier.reflectionBounces;
+	renderSettings.aoTaps = qualityTier.aoTaps;
+	renderSettings.shadowSteps = qualityTier.shadowSteps;
+
+	//Height of the view frustum at distance 1 divided over the pixels
+	float pixelAngle = 2.0f * glm::tan(fieldOfView * 0.5f) / (float)m_WindowExtent.height;
+	renderSettings.lodPixelAngle = m_FractalLod ? pixelAngle * m_LodPixelScale : 0.0f;
+	renderSettings.fractalIterations = (uint32_t)m_FractalIterations;
+
+	//Skybox mip where a cubemap texel covers about as much as a pixel, a face spans 90 degrees
+	float texelAngle = glm::half_pi<float>() / (float)m_SkyboxFaceSize;
+	renderSettings.skyboxLod = glm::max(glm::log2(pixelAngle / texelAngle), 0.0f);
+
+	//Only filled in for the foveated mode, so moving the mouse doesn't count as a change in the other modes
+	if (m_RenderMode == RENDER_FOVEATED)
+	{
+		glm::vec2 focus = glm::vec2(m_WindowExtent.width, m_WindowExtent.height) * 0.5f;
+		if (m_FocusSource == FOCUS_MOUSE)
+			focus = glm::clamp(_PrevMousePos, glm::vec2(0.0f), glm::vec2(m_WindowExtent.width, m_WindowExtent.height));
+		m_FocusPoint = focus;
+		renderSettings.focusX = focus.x;
+		renderSettings.focusY = focus.y;
+		renderSettings.foveaInnerRadius = m_FoveaInnerRadius;
+		renderSettings.foveaOuterRadius = glm::max(m_FoveaOuterRadius, m_FoveaInnerRadius);
+		renderSettings.showRateMap = m_ShowRateMap;
+	}
+
+	//Static scene detection, shaders without the static stages keep rendering every frame. The clock only counts once it moves something.
+	bool inputsChanged = m_ComputeShader->DetectInputChanges(renderSettings) || m_RenderMode != m_LastRenderMode || meshStreamed || instanceBvhBytes > 0;
+	m_LastRenderMode = m_RenderMode;
+	m_StaticFrameCount = inputsChanged ? 0 : m_StaticFrameCount + 1;
+
+	bool canSkip = m_StaticSceneMode != STATIC_RENDER && m_StagePipelines[STAGE_PRESENT_CACHED] != VK_NULL_HANDLE;
+	uint32_t refinementFrame = m_StaticFrameCount - m_StaticSettleFrames;
+	bool settled = canSkip && m_StaticFrameCount > m_StaticSettleFrames;
+	//The settled frame is the first sample in the cache, the refinement adds m_RefinementSamples jittered ones after it
+	m_RefinementSample = settled && m_StaticSceneMode == STATIC_REFINE && refinementFrame <= (uint32_t)m_RefinementSamples ? refinementFrame : 0;
+	m_PresentCachedFrame = settled && m_RefinementSample == 0;
+
+	//The edge detection reads the base pass colors from the cache
+	renderSettings.cacheOutput = (canSkip && m_StaticFrameCount > 0 && !settled) || UseEdgeSupersampling();
+	renderSettings.refinementSample = m_RefinementSample;
+	m_ComputeShader->SetRenderSettingsBufferData(renderSettings);
+
+	m_ComputeShader->UpdateShaderVariables(m_FrameIndex, this);
 }
 
 void VkEngine::CleanPipelines()
 {
-	vkDestroyPipeline(m_Device, m_ComputePipeline, nullptr);
+	for (VkPipeline pipeline : m_StagePipelines)
+		vkDestroyPipeline(m_Device, pipeline, nullptr);
+	m_StagePipelines.clear();
+
 	vkDestroyPipelineLayout(m_Device, m_ComputePipelineLayout, nullptr);
 }
 
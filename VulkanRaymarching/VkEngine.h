@@ -2,16 +2,21 @@
 #include <functional>
 #include <deque>
 #include <unordered_map>
+#include <fstream>
+#include <future>
+#include <memory>
 
 #include "Camera.h"
 #include "Texture.h"
+#include "ComputeShader.h"
+#include "SdfBrickStreamer.h"
+#include "InstanceGrid.h"
+#include "InstanceBvh.h"
 
 #include "ImGuiHandler.h"
 
 #define VK_CHECK(x, msg) if(x != VK_SUCCESS) throw std::runtime_error(msg);
 
-class ComputeShader;
-
 class GraphicsPipelineBuilder
 {
 public:
@@ -72,6 +77,24 @@ struct Texture
 	VkImageView imageView;
 };
 
+//Everything the shader samples of the mesh of a scene, replaced as a whole
+struct MeshVolume
+{
+	Texture brickAtlas;	//Streamed bricks, in the format of the brick file
+	Texture brickCells;	//Page table
+	Texture cellMips;	//SdfCellMips, mip k - 1 is level k
+	AllocatedBuffer brickRanges;	//Per slot of the atlas
+};
+
+//Instances of the Scatter node of a scene and the grid and tree the shader finds them through, replaced as a whole
+struct SceneInstanceBuffers
+{
+	AllocatedBuffer instances;
+	AllocatedBuffer grid;	//InstanceGrid::Header, then the cell offsets and the instance indices
+	AllocatedBuffer bvh;	//InstanceBvh::Header, then the nodes, which get patched while the instances bob
+	AllocatedBuffer bvhIndices;
+};
+
 struct FrameData
 {
 	//semaphores and fences for each frame
@@ -92,6 +115,62 @@ struct UploadContext
 	VkCommandPool commandPool;
 };
 
+enum RenderMode
+{
+	RENDER_MEGAKERNEL,	//One kernel traces and shades every bounce of a pixel
+	RENDER_WAVEFRONT,	//Separate kernels per ray type that pass rays on through queues
+	RENDER_PERSISTENT,	//Megakernel with a fixed amount of groups that pull screen tiles from a queue
+	RENDER_DEFERRED,	//Camera rays fill a G-buffer once, lighting passes shade from it every frame
+	RENDER_TEMPORAL_UPSAMPLING,	//Jittered lower resolution frames accumulated into a full resolution history
+	RENDER_INTERLEAVED,	//Traces a checkerboard or 2x2 pattern of pixels, the rest comes from the neighbours and the last frame
+	RENDER_FOVEATED	//Full rate around the focus point, one ray per 2x2 or 4x4 block further away
+};
+
+//What happens while the shader inputs don't change
+enum StaticSceneMode
+{
+	STATIC_RENDER,	//Keep rendering every frame
+	STATIC_SKIP,	//Present the cached frame once the scene settled
+	STATIC_REFINE	//Add jittered samples to the cached frame, then present it
+};
+
+//Has to match the INTERLEAVE_ constants in the shader
+enum InterleavePattern
+{
+	INTERLEAVE_CHECKERBOARD,	//Half of the pixels each frame
+	INTERLEAVE_2X2	//One pixel of every 2x2 block each frame
+};
+
+//Ray budgets the quality governor switches between, from best to cheapest
+struct QualityTier
+{
+	const char* name;
+	uint32_t maxMarchingSteps;
+	uint32_t reflectionBounces;
+	uint32_t aoTaps;
+	uint32_t shadowSteps;
+};
+
+static const QualityTier QualityTiers[] =
+{
+	{ "Ultra", 1024, 4, 5, 1024 },
+	{ "High", 512, 3, 4, 256 },
+	{ "Medium", 256, 2, 3, 128 },
+	{ "Low", 128, 1, 2, 64 },
+	{ "Minimal", 64, 0, 1, 32 }
+};
+static const uint32_t QualityTierCount = (uint32_t)std::size(QualityTiers);
+
+//Distances from the sponge center the level of detail benchmark looks at it from
+static const float LodBenchmarkDistances[] = { 10.0f, 100.0f, 200.0f, 400.0f, 800.0f };
+
+//Where the foveated mode keeps its full rate tiles
+enum FocusSource
+{
+	FOCUS_SCREEN_CENTER,
+	FOCUS_MOUSE
+};
+
 static Camera _Camera{glm::vec3(0,0,10)};
 static glm::vec2 _PrevMousePos;
 
@@ -110,6 +189,18 @@ public:
 
 	void ReloadShaders();
 
+	//Swaps the scene the shader interprets without rebuilding the pipelines, an empty file name goes back to the built-in map().
+	//A scene that fails to load is reported and the current one stays.
+	void LoadScene(const std::string& fileName);
+
+	//Edits of the loaded scene that keep the structure of its tree, only the instructions and materials that change are uploaded.
+	//Invalid parameters are reported and leave the node as it is.
+	void EditSceneNode(uint32_t id, const glm::vec4 params[2], uint32_t materialId);
+	void EditSceneMaterial(uint32_t index, const ComputeShader::MaterialData& material);
+
+	//The generated map() has the parameters in its code, so it's rebuilt once an edit is done and the interpreter shows the edits until then
+	void FinishSceneEdit();
+
 	//Will push commands immediatly to the graphics queue (mainly used to store textures on the gpu once in the initialization)
 	void ImmediateSubmit(std::function<void(VkCommandBuffer)>&& function);
 
@@ -131,17 +222,77 @@ private:
 	void InitFramebuffers();
 	void InitCommands();
 	void InitSyncStructures();
+	void InitQueries();
 	void InitShaders();
+	void InitMaterials();
 	void InitDescriptors();
 	void InitPipelines();
 	void LoadTextures();
+	void InitSkyboxCubemap();
+	void InitStorageImages();
+	Texture CreateStorageImage(VkFormat format);
+	void InitMeshVolume();
+	MeshVolume CreateMeshVolume(const glm::uvec3& cellCount, const uint32_t* cells, uint32_t slotCount, SdfBrickFormat format);
+	void DestroyMeshVolume(const MeshVolume& volume);
+	Texture CreateVolumeTexture(VkFormat format, VkExtent3D extent, uint32_t mipLevels, const void* texels, VkDeviceSize size, const std::vector<VkBufferImageCopy>& copies);
+	VkFormat GetMeshBrickVkFormat(SdfBrickFormat format);
+	bool IsMeshBrickFormatSupported(SdfBrickFormat format);
+	std::unique_ptr<SdfBrickFile> OpenMeshBrickFile(const std::string& objFile, uint32_t resolution, SdfBrickFormat format);
+	void SetMeshBrickFormat(SdfBrickFormat format);
+	void ReplaceMeshVolume(std::unique_ptr<SdfBrickFile> brickFile);
+	void ResizeMeshBrickAtlas();
+	uint32_t GetMeshBrickSlotCount();
+	bool UpdateMeshStreaming(const glm::vec3& cameraPosition, VkDeviceSize stagingUsed);
+	void RecordMeshStreaming(VkCommandBuffer cmd);
+	void InitSceneInstances();
+	SceneInstanceBuffers CreateSceneInstanceBuffers(const std::vector<SceneInstance>& instances, const InstanceBvh* bvh, const InstanceBvh::Header& bvhHeader);
+	void DestroySceneInstanceBuffers(const SceneInstanceBuffers& buffers);
+	void ReplaceSceneInstances(const SceneDescription& scene);
+	VkDeviceSize UpdateInstanceBvh(float time, VkDeviceSize stagingUsed);
+	void RecordInstanceBvh(VkCommandBuffer cmd);
 
 	void Update();
 	void CleanPipelines();
 
+	void AcquireFrame();
 	void Draw();
 	void DrawCompute(uint32_t frameNumber);
 	void DrawGraphics(uint32_t frameNumber);
+	void RecordRenderMode(VkCommandBuffer cmd);
+	void RecordMegakernel(VkCommandBuffer cmd);
+	void RecordWavefront(VkCommandBuffer cmd);
+	void RecordPersistent(VkCommandBuffer cmd);
+	void RecordLightingPrepass(VkCommandBuffer cmd);
+	void RecordDeferred(VkCommandBuffer cmd);
+	void RecordReprojection(VkCommandBuffer cmd);
+	void RecordTemporalUpsampling(VkCommandBuffer cmd);
+	void RecordInterleaved(VkCommandBuffer cmd);
+	void RecordStaticFrame(VkCommandBuffer cmd);
+	void RecordEdgeSupersampling(VkCommandBuffer cmd);
+	void RecordFoveated(VkCommandBuffer cmd);
+	bool UseEdgeSupersampling();
+	bool TracesEveryPixel();
+	float GetFoveatedRayFraction();
+	VkExtent2D GetTemporalRenderExtent();
+	bool UseTemporalReprojection();
+	uint32_t GetActiveLightingScale();
+	void ResetRayQueue(VkCommandBuffer cmd, const AllocatedBuffer& queue);
+	void ComputeBarrier(VkCommandBuffer cmd);
+	void ReadComputeTimings(uint32_t frameNumber);
+	void UpdateQualityGovernor();
+	void StartLodBenchmark();
+	void UpdateLodBenchmark();
+	void StartSceneShaderBuild(const SceneDescription& scene);
+	void UpdateSceneShader();
+	void StartSceneBenchmark();
+	void UpdateSceneBenchmark();
+	void ReadSceneBenchmark();
+	void StartBrickBenchmark();
+	void UpdateBrickBenchmark();
+	void ReadBrickBenchmark();
+	void SkipUnsupportedBrickFormats();
+	void ResetComputeTimings();
+	void ReadStatistics(uint32_t frameNumber);
 
 	FrameData& GetCurrentFrame();
 	size_t PadUniformBufferSize(size_t originalSize);
@@ -149,6 +300,8 @@ private:
 
 	bool m_IsInitialized = false;
 	int m_FrameNumber = 0;
+	uint32_t m_FrameIndex = 0;	//Swapchain image of this frame, indexes all the per frame data
+	VkSemaphore m_AcquireSemaphore = VK_NULL_HANDLE;
 	unsigned int m_OverlappingFrameCount = 2;
 
 #ifdef NDEBUG
@@ -167,9 +320,102 @@ private:
 	VkPhysicalDevice m_PhysicalDevice = VK_NULL_HANDLE;
 	VkPhysicalDeviceProperties m_GPUProperties;
 
-	VkPipeline m_ComputePipeline;
+	//One pipeline per RenderStage, only the megakernel is built when the shader has no RENDER_STAGE constant
+	std::vector<VkPipeline> m_StagePipelines;
 	VkPipelineLayout m_ComputePipelineLayout;
 
+	RenderMode m_RenderMode = RENDER_MEGAKERNEL;
+	uint32_t m_WavefrontBounces = 5;
+
+	//Enough 32x32 groups to keep every SM/CU busy, has to be tuned per gpu
+	int m_PersistentGroupCount = 128;
+
+	//Shadow and AO are traced at 1/m_LightingScale resolution and upsampled, 1 traces them per pixel
+	int m_LightingScale = 1;
+
+	//Scene state the G-buffer was built with, it only has to be rebuilt when that changes
+	bool m_GBufferValid = false;
+	ComputeShader::SceneBufferData m_GBufferSceneData{};
+
+	//Pausing the animation keeps the scene static so the deferred mode can reuse its G-buffer
+	bool m_AnimateScene = true;
+	float m_SceneTime = 0.0f;
+	double m_LastUpdateTime = 0.0;
+
+	//Camera rays start marching close to the depth of the previous frame
+	bool m_TemporalReprojection = true;
+	bool m_DepthHistoryValid = false;
+	ComputeShader::SceneBufferData m_PreviousSceneData{};
+
+	//Counting the march steps costs atomics, so it's only done when asked for
+	bool m_CollectStatistics = false;
+	float m_PrimaryStepsPerRay = 0.0f;
+
+	//Scale of the temporal upsampling render resolution per axis, 0.71 halves the amount of rays
+	float m_RenderScale = 0.71f;
+	bool m_TemporalHistoryValid = false;
+
+	InterleavePattern m_InterleavePattern = INTERLEAVE_CHECKERBOARD;
+
+	//Frames in a row where nothing changed, the first m_StaticSettleFrames still render normally so temporal modes converge
+	StaticSceneMode m_StaticSceneMode = STATIC_REFINE;
+	uint32_t m_StaticFrameCount = 0;
+	const uint32_t m_StaticSettleFrames = 32;
+	int m_RefinementSamples = 64;
+	RenderMode m_LastRenderMode = RENDER_MEGAKERNEL;
+
+	//Extra rays for the pixels on depth, normal or color edges
+	bool m_EdgeSupersampling = false;
+	int m_EdgeSamples = 4;
+	float m_EdgePixelFraction = 0.0f;
+
+	//Foveated rate map, the radii are in fractions of the screen height
+	FocusSource m_FocusSource = FOCUS_SCREEN_CENTER;
+	float m_FoveaInnerRadius = 0.2f;
+	float m_FoveaOuterRadius = 0.4f;
+	bool m_ShowRateMap = false;
+	glm::vec2 m_FocusPoint{};
+
+	//Lowers the ray budgets when the compute time goes over the target and raises them again once there's headroom.
+	//Going down reacts faster than going up, and the band between the two thresholds keeps it from oscillating.
+	bool m_QualityGovernor = false;
+	float m_TargetComputeTimeMs = 8.0f;
+	uint32_t m_QualityTier = 0;
+	uint32_t m_FramesOverTarget = 0;
+	uint32_t m_FramesUnderTarget = 0;
+	const uint32_t m_DowngradeFrames = 10;
+	const uint32_t m_UpgradeFrames = 60;
+	const float m_UpgradeHeadroom = 0.75f;	//Fraction of the target the frames have to stay under before going up
+	std::ofstream m_QualityLog;
+
+	//Fractals skip the iterations that add detail smaller than m_LodPixelScale pixels and baked meshes step with coarser cell mips
+	bool m_FractalLod = true;
+	float m_LodPixelScale = 1.0f;
+	int m_FractalIterations = 3;
+
+	//Camera ray steps with the level of detail off (x) and on (y) at every distance of LodBenchmarkDistances
+	bool m_LodBenchmarkRunning = false;
+	uint32_t m_LodBenchmarkStep = 0;
+	uint32_t m_LodBenchmarkFrame = 0;
+	const uint32_t m_LodBenchmarkFrames = 4;
+	std::vector<glm::vec2> m_LodBenchmarkResults;
+
+	//Settings the benchmark overrides, put back when it's done
+	Camera m_SavedCamera;
+	RenderMode m_SavedRenderMode = RENDER_MEGAKERNEL;
+	bool m_SavedFractalLod = true;
+	bool m_SavedTemporalReprojection = true;
+	bool m_SavedCollectStatistics = false;
+
+	//Decided in Update() for the frame that's being drawn
+	bool m_PresentCachedFrame = false;
+	uint32_t m_RefinementSample = 0;
+
+	//Once the cached frame is on screen the swapchain image is held until something changes
+	bool m_CachedFramePresented = false;
+	bool m_FrameAcquired = false;
+	const double m_IdleWaitSeconds = 0.05;
+
 	VkSwapchainKHR m_Swapchain = VK_NULL_HANDLE;
 	VkFormat m_SwapchainImageFormat = VK_FORMAT_UNDEFINED;
 	std::vector<VkImage> m_SwapchainImages;
@@ -187,14 +433,99 @@ private:
 
 	VkDescriptorPool m_DescriptorPool;
 
+	//2 timestamps per frame, around the compute dispatch
+	VkQueryPool m_TimestampQueryPool = VK_NULL_HANDLE;
+	float m_ComputeTimeMs = 0.0f;
+	float m_AverageComputeTimeMs = 0.0f;
+
+	//Ring buffer of the last compute timings for the percentiles
+	std::vector<float> m_ComputeTimeHistory;
+	size_t m_ComputeTimeHistoryIndex = 0;
+	const size_t m_ComputeTimeHistorySize = 240;
+
 	std::vector<FrameData> m_Frames;
 
 	UploadContext m_UploadContext;
 
 	Texture m_SkyBoxTexture;
 
+	//The skybox converted at load, a quarter of the 2k equirectangular width keeps its resolution at the horizon
+	Texture m_SkyboxCubemap;
+	const uint32_t m_SkyboxFaceSize = 512;
+	uint32_t m_SkyboxMipLevels = 1;
+	std::vector<Texture> m_HistoryImages;
+	Texture m_OutputCache;
+
+	//Sparse distance volume the Mesh nodes of the current scene sample, replaced when a scene with a mesh is loaded.
+	//The page table is complete from the start, the bricks closest to the camera are streamed from the mapped brick file into
+	//an atlas of m_MeshBrickBudgetMB and the cells of the others fall back to a conservative distance.
+	MeshVolume m_MeshVolume;
+
+	//Instances of the Scatter node of the current scene, uploaded once when the scene is loaded. Only the nodes of the tree the
+	//bobbing instances move are refitted and patched in, together with the time they're fitted to.
+	SceneInstanceBuffers m_SceneInstances;
+	std::unique_ptr<InstanceBvh> m_InstanceBvh;
+	InstanceBvh::Header m_InstanceBvhHeader{};
+	bool m_InstanceBvhHeaderChanged = false;
+	float m_InstanceBvhUploadedTime = 0.0f;
+	bool m_InstancesMoved = false;	//The last upload moved the bobbing instances
+	std::vector<VkBufferCopy> m_InstanceBvhCopies;
+	std::unique_ptr<SdfBrickFile> m_MeshBrickFile;
+	std::unique_ptr<SdfBrickStreamer> m_MeshBrickStreamer;
+	int m_MeshBrickBudgetMB = 64;
+	SdfBrickFormat m_MeshBrickFormat = SDF_BRICK_FLOAT32;	//Of the files that get opened, the atlas takes the format of the file
+	uint32_t m_MeshBrickUploads = 0;	//In the last frame
+
+	//Every frame in flight has its own segment of the ring. The scene patches and the refitted nodes of the frame go first and the bricks get the rest of it,
+	//they go into it straight from the mapping and from there into the atlas
+	AllocatedBuffer m_StagingRing;
+	uint8_t* m_StagingMemory = nullptr;
+	const VkDeviceSize m_StagingSegmentSize = 4 * 1024 * 1024;
+	std::vector<VkBufferImageCopy> m_BrickCopies;
+	std::vector<VkBufferImageCopy> m_BrickCellCopies;
+	std::vector<VkBufferCopy> m_BrickRangeCopies;
+
 	ImGuiHandler m_ImGui;
 
 	std::string m_CurrentShader = "../Resources/Shaders/TestComputeShader_comp.spv";
 	ComputeShader* m_ComputeShader;
+
+	//Scene files are interpreted by the shader, they can use the built-in materials next to their own
+	const std::string m_SceneDirectory = "../Resources/Scenes/";
+	std::string m_CurrentScene;
+	SceneDescription m_Scene;	//Empty for the built-in map()
+	std::vector<std::string> m_BuiltInMaterialNames;
+	std::vector<ComputeShader::MaterialData> m_BuiltInMaterials;
+
+	//The current scene compiled into the map() of the shader, built in the background and used instead of the interpreter once it's there
+	struct SceneShaderBuild
+	{
+		std::string shaderPath;
+		std::future<bool> succeeded;
+	};
+	bool m_UseGeneratedScene = true;
+	std::string m_GeneratedShader;	//Empty while the built-in map() is shown or the shader can't take a generated one
+	bool m_GeneratedShaderReady = false;
+	std::string m_SceneBaseShader;	//Shader the generated one is made from, the interpreter runs in it
+	std::vector<SceneShaderBuild> m_SceneShaderBuilds;
+
+	//Average compute time of the interpreter (x) and the generated shader (y) on the current scene
+	bool m_SceneBenchmarkRunning = false;
+	uint32_t m_SceneBenchmarkStep = 0;
+	uint32_t m_SceneBenchmarkFrame = 0;
+	const uint32_t m_SceneBenchmarkWarmupFrames = 16;
+	const uint32_t m_SceneBenchmarkFrames = 120;
+	glm::vec2 m_SceneBenchmarkResult{};
+	bool m_SavedUseGeneratedScene = true;
+	StaticSceneMode m_SavedStaticSceneMode = STATIC_REFINE;
+	bool m_SavedQualityGovernor = false;
+
+	//Renders the mesh of the scene with every brick format under the same budget, so the smaller ones also get more bricks resident.
+	//Uses the frame counts and the saved settings of the scene benchmark
+	bool m_BrickBenchmarkRunning = false;
+	uint32_t m_BrickBenchmarkStep = 0;	//The format being measured
+	uint32_t m_BrickBenchmarkFrame = 0;
+	std::vector<float> m_BrickBenchmarkResults;	//Per format, 0 when the GPU doesn't support it
+	std::vector<uint32_t> m_BrickBenchmarkResident;
+	SdfBrickFormat m_SavedMeshBrickFormat = SDF_BRICK_FLOAT32;
 };
\ No newline at end of file